@@ -1,6 +1,14 @@
-use std::env;
+use std::{env, path::PathBuf};
 
-use crate::{ci_provider, config::Config, prelude::*, runner, uploader, VERSION};
+use crate::{
+    ci_provider,
+    config::{Config, MeasurementMode},
+    daemon,
+    prelude::*,
+    runner, telemetry,
+    uploader::{self, ArchiveFormat},
+    VERSION,
+};
 use clap::Parser;
 
 fn show_banner() {
@@ -34,6 +42,195 @@ pub struct AppArgs {
     #[arg(long)]
     pub working_directory: Option<String>,
 
+    /// The format of the profile archive sent to the upload endpoint.
+    /// Falls back to gzip if the upload endpoint does not accept the format
+    #[arg(long, value_enum, default_value_t = ArchiveFormat::Gzip)]
+    pub archive_format: ArchiveFormat,
+
+    /// The compression level of the profile archive, 0 to 9 for gzip and 1 to 22 for zstd.
+    /// Defaults to 6 for gzip and 3 for zstd
+    #[arg(long)]
+    pub archive_compression_level: Option<i32>,
+
+    /// The number of archive parts uploaded concurrently, when the upload endpoint requires a
+    /// multipart upload
+    #[arg(long, default_value = "4")]
+    pub upload_concurrency: usize,
+
+    /// Compress the profile of each benchmark process as soon as it exits, while the benchmarks
+    /// are still running
+    #[arg(long, default_value = "false")]
+    pub pipelined_archive: bool,
+
+    /// Empty the profile of each benchmark process once compressed by the pipelined archive, for
+    /// the profiles not to be held on disk twice. The deduplicated upload hashes the profiles
+    /// after the run, so it is not supported
+    #[arg(
+        long,
+        default_value = "false",
+        requires = "pipelined_archive",
+        conflicts_with = "deduplicated_upload"
+    )]
+    pub remove_archived_profiles: bool,
+
+    /// The directory of the profile folder. Defaults to /dev/shm when it has at least 16 GiB
+    /// available and TMPDIR is unset, else to the temporary directory. The files of /dev/shm are
+    /// held in memory, so the profile folder is removed after the upload unless it is in this
+    /// directory
+    #[arg(long)]
+    pub profile_dir: Option<PathBuf>,
+
+    /// Send the hash of each profile file with the upload metadata, and only upload the files
+    /// whose content is not already known by the upload endpoint
+    #[arg(long, default_value = "false")]
+    pub deduplicated_upload: bool,
+
+    /// The number of benchmark shards measured in parallel.
+    /// When greater than 1, each line of the bench command is a shard run in its own shell, so
+    /// each line must be a standalone benchmark command: the lines continued with `\` and the
+    /// bare `cd` or `export` lines are rejected, unlike `cd bench && pytest`. The shards are
+    /// measured one at a time in the perf-counters and walltime modes
+    #[arg(long, default_value = "1")]
+    pub jobs: usize,
+
+    /// The index of this CI job among the jobs the benchmarks are sharded across, starting at 0.
+    /// The lines of the bench command are distributed among the shards, each line being run in
+    /// its own shell like with --jobs
+    #[arg(long, requires = "shard_count")]
+    pub shard_index: Option<usize>,
+
+    /// The number of CI jobs the benchmarks are sharded across
+    #[arg(long, requires = "shard_index")]
+    pub shard_count: Option<usize>,
+
+    /// A JSON file mapping lines of the bench command to the source paths their benchmarks
+    /// depend on. On pull requests, the lines not affected by the changes since the base branch
+    /// are skipped and their results are reused from the base commit. Everything is run when a
+    /// changed file is in none of its paths, nor in its `ignoredPaths`
+    #[arg(long)]
+    pub benchmark_manifest: Option<PathBuf>,
+
+    /// A directory persisted across the runs to cache the valgrind-codspeed package or toolchain,
+    /// also read from the CODSPEED_CACHE_DIR environment variable
+    #[arg(long)]
+    pub cache_dir: Option<PathBuf>,
+
+    /// The engine measuring the benchmarks. perf-counters and walltime run the benchmarks
+    /// natively, the measurements covering the whole processes of each line of the bench command
+    #[arg(long, value_enum, default_value_t = MeasurementMode::Instrumentation)]
+    pub mode: MeasurementMode,
+
+    /// The caches simulated in instrumentation mode: default, host to detect the caches of the
+    /// machine, falling back to default when they cannot be simulated, zen4, or a custom geometry
+    /// like I1=32768,8,64:D1=49152,12,64:LL=33554432,16,64 with the size, associativity and line
+    /// size of each cache
+    #[arg(long, default_value = "default")]
+    pub cache_geometry: String,
+
+    /// Simulate another cache geometry, in an extra instrumented run of the benchmarks after the
+    /// main one. Takes a preset or a custom geometry, optionally labelled like
+    /// gen2=I1=32768,8,64:D1=49152,12,64:LL=33554432,16,64. Can be repeated
+    #[arg(long, value_name = "CACHE_GEOMETRY")]
+    pub extra_cache_geometry: Vec<String>,
+
+    /// Run the extra cache simulations in parallel with the main run. The runs share the working
+    /// directory, so the benchmarks must not write to the same files, e.g. build outputs, caches
+    /// or databases
+    #[arg(long, default_value = "false", requires = "extra_cache_geometry")]
+    pub parallel_cache_simulations: bool,
+
+    /// Whether callgrind collects the costs when the instrumentation starts, before any
+    /// --toggle-collect function is entered
+    #[arg(long)]
+    pub collect_atstart: Option<bool>,
+
+    /// Toggle the collection of the costs when entering and leaving the matching functions, e.g. to
+    /// exclude the fixture loading from the measurements. Can be repeated
+    #[arg(long, value_name = "FUNCTION_PATTERN")]
+    pub toggle_collect: Vec<String>,
+
+    /// Attribute the costs of the code of the matching shared objects to their callers, like the
+    /// interpreters by default. The costs are still measured, to exclude them use --toggle-collect
+    /// or --collect-atstart. Can be repeated
+    #[arg(long, value_name = "OBJECT_PATTERN")]
+    pub skip_object: Vec<String>,
+
+    /// Attribute the costs of the matching functions to their callers. The costs are still
+    /// measured, to exclude them use --toggle-collect or --collect-atstart. Can be repeated
+    #[arg(long, value_name = "FUNCTION_PATTERN")]
+    pub skip_function: Vec<String>,
+
+    /// The number of times each line of the bench command is run in walltime mode
+    #[arg(long, default_value = "10")]
+    pub walltime_samples: usize,
+
+    /// Sample the benchmarks until the 95% confidence interval of their median is within this
+    /// fraction of the median, e.g. 0.01, instead of a fixed number of times. The target is also
+    /// passed to the integrations in CODSPEED_TARGET_PRECISION. Only in the perf-counters and
+    /// walltime modes: in perf-counters mode, each bench command is run once and the target is
+    /// only passed to the integrations, so it has no effect unless they sample the benchmarks
+    #[arg(long, value_name = "FRACTION")]
+    pub target_precision: Option<f64>,
+
+    /// The time spent sampling each bench command before stopping, even if the target precision
+    /// is not reached, passed to the integrations in milliseconds in CODSPEED_TIME_BUDGET_MS.
+    /// [default: 60]
+    #[arg(long, value_name = "SECONDS", requires = "target_precision")]
+    pub time_budget: Option<f64>,
+
+    /// Deduplicate the symbols of the perf maps of the benchmark processes into a table shared by
+    /// the processes, to reduce the size of the profile archive. The perf maps of each extra
+    /// cache simulation get their own table
+    #[arg(long, default_value = "false")]
+    pub compact_perf_maps: bool,
+
+    /// Merge the profiles of the benchmark processes into a single compact profile before the
+    /// upload, the processes of each benchmark being combined
+    #[arg(long, default_value = "false", conflicts_with = "pipelined_archive")]
+    pub merge_profiles: bool,
+
+    /// Report the time and resources used by the runner in each phase of the run, in the profile
+    /// folder and the upload metadata
+    #[arg(long, default_value = "false")]
+    pub runner_telemetry: bool,
+
+    /// Record the costs of each thread of the benchmark processes separately, along with the
+    /// atomic instructions synchronizing them, for the reports to show the contended sections of
+    /// the multithreaded benchmarks. Only in instrumentation mode
+    #[arg(long, default_value = "false", conflicts_with = "merge_profiles")]
+    pub separate_threads: bool,
+
+    /// Run the benchmarks once more under the DHAT valgrind tool, recording the allocations and
+    /// the peak heap of each benchmark process in the profile folder
+    #[arg(long, default_value = "false")]
+    pub memory_profile: bool,
+
+    /// Run the benchmarks once more in the perf-counters and walltime modes, sampling the stacks
+    /// of their processes this many times per second of cpu time. The collapsed stacks are written
+    /// to the profile folder for the flamegraphs
+    #[arg(long)]
+    pub stack_sampling_frequency: Option<u64>,
+
+    /// Compare the costs of the benchmarks to the profiles of a baseline folder and print the
+    /// regressions, instead of uploading the results. Runs locally without a CI provider
+    #[arg(long)]
+    pub compare_to: Option<PathBuf>,
+
+    /// Save the profiles of the run to a baseline folder for the next --compare-to, instead of
+    /// uploading the results
+    #[arg(long)]
+    pub save_baseline: Option<PathBuf>,
+
+    /// Run as a daemon serving the runs sent to this unix socket, the system checks, the valgrind
+    /// installation and the connections to the upload endpoint being reused across the runs
+    #[arg(long, conflicts_with = "daemon_socket")]
+    pub serve: Option<PathBuf>,
+
+    /// Send the run to the runner daemon listening on this unix socket instead of running it in
+    /// this process, also read from the CODSPEED_DAEMON_SOCKET environment variable
+    #[arg(long)]
+    pub daemon_socket: Option<PathBuf>,
+
     /// Only for debugging purposes, skips the upload of the results
     #[arg(long, default_value = "false", hide = true)]
     pub skip_upload: bool,
@@ -46,26 +243,75 @@ pub struct AppArgs {
     pub command: Vec<String>,
 }
 
-pub async fn run() -> Result<()> {
-    let args = AppArgs::parse();
-    let config = Config::try_from(args)?;
-    let provider = ci_provider::get_provider(&config)?;
-
+/// Set the log level from the CODSPEED_LOG environment variable, info by default
+pub fn set_log_level() {
     let log_level = env::var("CODSPEED_LOG")
         .ok()
         .and_then(|log_level| log_level.parse::<log::LevelFilter>().ok())
         .unwrap_or(log::LevelFilter::Info);
     log::set_max_level(log_level);
-    provider.setup_logger()?;
+}
+
+pub async fn run() -> Result<()> {
+    let args = AppArgs::parse();
+    if let Some(socket_path) = &args.serve {
+        return daemon::serve(socket_path).await;
+    }
+    let daemon_socket = args
+        .daemon_socket
+        .clone()
+        .or_else(|| env::var("CODSPEED_DAEMON_SOCKET").ok().map(PathBuf::from));
+    if let Some(socket_path) = daemon_socket {
+        return daemon::send_run(&socket_path);
+    }
+    run_with_args(args).await
+}
+
+/// Run the benchmarks and upload the results, for the process or one of the runs served by the
+/// runner daemon
+pub async fn run_with_args(args: AppArgs) -> Result<()> {
+    let config = Config::try_from(args)?;
+    // the results are only uploaded from a CI provider, the local runs are logged as is
+    let provider = match ci_provider::get_provider(&config) {
+        Ok(provider) => Some(provider),
+        Err(_) if config.skip_upload => None,
+        Err(e) => return Err(e),
+    };
+
+    set_log_level();
+    match &provider {
+        Some(provider) => provider.setup_logger()?,
+        None => ci_provider::setup_local_logger()?,
+    }
 
     show_banner();
     debug!("config: {:#?}", config);
 
-    let run_data = runner::run(&config).await?;
-    if !config.skip_upload {
+    let profile_folder = runner::create_profile_folder(config.profile_dir.as_deref())?;
+    let archive_pipeline = (config.pipelined_archive && !config.skip_upload).then(|| {
+        uploader::ArchivePipeline::start(
+            &profile_folder,
+            config.archive_format,
+            config.archive_compression_level,
+            config.remove_archived_profiles,
+        )
+    });
+    let base_ref = provider
+        .as_ref()
+        .and_then(|provider| provider.get_base_ref());
+    let run_data = runner::run(&config, profile_folder, base_ref).await?;
+    if config.runner_telemetry {
+        telemetry::write_report(&run_data.profile_folder)?;
+    }
+    if let Some(provider) = provider.filter(|_| !config.skip_upload) {
         start_group!("Upload the results");
-        uploader::upload(&config, provider, &run_data).await?;
+        uploader::upload(&config, provider, &run_data, archive_pipeline).await?;
         end_group!();
+        // the folders of --profile-dir are left to their owner
+        if config.profile_dir.is_none() {
+            runner::remove_profile_folder(&run_data.profile_folder)?;
+        }
     }
+    debug!("Runner telemetry: {:#?}", telemetry::get_phases());
     Ok(())
 }
@@ -4,11 +4,14 @@ use lazy_static::lazy_static;
 use regex::Regex;
 
 use crate::{
-    ci_provider::provider::{CIProvider, CIProviderDetector},
+    ci_provider::{
+        logger::set_logger,
+        provider::{CIProvider, CIProviderDetector},
+    },
     config::Config,
     helpers::get_env_variable,
     prelude::*,
-    uploader::{RunEvent, Runner, UploadMetadata},
+    uploader::{ProfileArchive, RunEvent, Runner, UploadMetadata},
     VERSION,
 };
 
@@ -125,7 +128,7 @@ impl CIProviderDetector for BuildkiteProvider {
 
 impl CIProvider for BuildkiteProvider {
     fn setup_logger(&self) -> Result<()> {
-        log::set_logger(&BuildkiteLogger)?;
+        set_logger(&BuildkiteLogger)?;
         Ok(())
     }
 
@@ -137,7 +140,11 @@ impl CIProvider for BuildkiteProvider {
         "buildkite"
     }
 
-    fn get_upload_metadata(&self, _config: &Config, archive_hash: &str) -> Result<UploadMetadata> {
+    fn get_upload_metadata(
+        &self,
+        config: &Config,
+        archive: &ProfileArchive,
+    ) -> Result<UploadMetadata> {
         let upload_metadata = UploadMetadata {
             base_ref: self.base_ref.clone(),
             head_ref: self.head_ref.clone(),
@@ -157,11 +164,28 @@ impl CIProvider for BuildkiteProvider {
                 version: VERSION.to_string(),
             },
             version: Some(1),
-            profile_md5: archive_hash.to_string(),
+            profile_md5: archive.hash.clone(),
+            archive_format: archive.format,
+            archive_size: archive.size,
+            mode: config.mode,
+            cache_geometry: config.cache_geometry,
+            shard: self.get_shard_data(config)?,
+            skipped_bench_commands: vec![],
+            content_manifest: vec![],
+            runner_telemetry: vec![],
+            cache_simulations: config.cache_simulations.clone(),
         };
 
         Ok(upload_metadata)
     }
+
+    fn get_base_ref(&self) -> Option<&str> {
+        self.base_ref.as_deref()
+    }
+
+    fn get_run_identity(&self) -> Result<String> {
+        get_env_variable("BUILDKITE_BUILD_ID")
+    }
 }
 
 #[cfg(test)]
@@ -305,7 +329,11 @@ mod tests {
                     ..Config::test()
                 };
                 let provider = BuildkiteProvider::try_from(&config).unwrap();
-                let upload_metadata = provider.get_upload_metadata(&config, "abc123").unwrap();
+                let archive = ProfileArchive {
+                    hash: "abc123".into(),
+                    ..ProfileArchive::test()
+                };
+                let upload_metadata = provider.get_upload_metadata(&config, &archive).unwrap();
 
                 assert_json_snapshot!(upload_metadata, {
                     ".runner.version" => insta::dynamic_redaction(|value,_path| {
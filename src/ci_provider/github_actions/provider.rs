@@ -5,11 +5,14 @@ use regex::Regex;
 use serde_json::Value;
 
 use crate::{
-    ci_provider::provider::{CIProvider, CIProviderDetector},
+    ci_provider::{
+        logger::set_logger,
+        provider::{CIProvider, CIProviderDetector},
+    },
     config::Config,
     helpers::get_env_variable,
     prelude::*,
-    uploader::{GhData, RunEvent, Runner, Sender, UploadMetadata},
+    uploader::{GhData, ProfileArchive, RunEvent, Runner, Sender, UploadMetadata},
     VERSION,
 };
 
@@ -116,7 +119,7 @@ impl CIProviderDetector for GitHubActionsProvider {
 
 impl CIProvider for GitHubActionsProvider {
     fn setup_logger(&self) -> Result<()> {
-        log::set_logger(&GithubActionLogger)?;
+        set_logger(&GithubActionLogger)?;
         // since TRACE and DEBUG use ::debug::, we always enable them and let GitHub handle the filtering
         // thanks to https://docs.github.com/en/actions/monitoring-and-troubleshooting-workflows/enabling-debug-logging#enabling-step-debug-logging
         log::set_max_level(log::LevelFilter::Trace);
@@ -131,7 +134,11 @@ impl CIProvider for GitHubActionsProvider {
         "github-actions"
     }
 
-    fn get_upload_metadata(&self, config: &Config, archive_hash: &str) -> Result<UploadMetadata> {
+    fn get_upload_metadata(
+        &self,
+        config: &Config,
+        archive: &ProfileArchive,
+    ) -> Result<UploadMetadata> {
         let upload_metadata = UploadMetadata {
             base_ref: self.base_ref.clone(),
             head_ref: self.head_ref.clone(),
@@ -151,11 +158,31 @@ impl CIProvider for GitHubActionsProvider {
             },
             tokenless: config.token.is_none(),
             version: Some(1),
-            profile_md5: archive_hash.to_string(),
+            profile_md5: archive.hash.clone(),
+            archive_format: archive.format,
+            archive_size: archive.size,
+            mode: config.mode,
+            cache_geometry: config.cache_geometry,
+            shard: self.get_shard_data(config)?,
+            skipped_bench_commands: vec![],
+            content_manifest: vec![],
+            runner_telemetry: vec![],
+            cache_simulations: config.cache_simulations.clone(),
         };
 
         Ok(upload_metadata)
     }
+
+    fn get_base_ref(&self) -> Option<&str> {
+        self.base_ref.as_deref()
+    }
+
+    fn get_run_identity(&self) -> Result<String> {
+        // re-running the failed jobs of a workflow keeps the run id but not the attempt, so the
+        // shards uploaded by the different attempts share the identity, the latest upload of each
+        // shard index being kept
+        Ok(self.gh_data.run_id.to_string())
+    }
 }
 
 #[cfg(test)]
@@ -264,7 +291,7 @@ mod tests {
                 };
                 let github_actions_provider = GitHubActionsProvider::try_from(&config).unwrap();
                 let upload_metadata = github_actions_provider
-                    .get_upload_metadata(&config, "archive_hash")
+                    .get_upload_metadata(&config, &ProfileArchive::test())
                     .unwrap();
 
                 assert_json_snapshot!(upload_metadata, {
@@ -314,7 +341,7 @@ mod tests {
                 };
                 let github_actions_provider = GitHubActionsProvider::try_from(&config).unwrap();
                 let upload_metadata = github_actions_provider
-                    .get_upload_metadata(&config, "archive_hash")
+                    .get_upload_metadata(&config, &ProfileArchive::test())
                     .unwrap();
 
                 assert_eq!(upload_metadata.owner, "my-org");
@@ -0,0 +1,53 @@
+use log::*;
+
+use crate::ci_provider::logger::{get_group_event, set_logger, GroupEvent};
+use anyhow::Result;
+
+/// A logger for the runs outside of a CI provider, e.g. the local comparisons to a baseline
+pub struct LocalLogger;
+
+impl Log for LocalLogger {
+    fn enabled(&self, _metadata: &Metadata) -> bool {
+        true
+    }
+
+    fn log(&self, record: &Record) {
+        let level = record.level();
+        let message = record.args();
+
+        if let Some(group_event) = get_group_event(record) {
+            match group_event {
+                GroupEvent::Start(name) | GroupEvent::StartOpened(name) => {
+                    println!("==> {}", name);
+                }
+                GroupEvent::End => {}
+            }
+            return;
+        }
+
+        match level {
+            Level::Error => {
+                eprintln!("[ERROR] {}", message);
+            }
+            Level::Warn => {
+                eprintln!("[WARN] {}", message);
+            }
+            Level::Info => {
+                println!("{}", message);
+            }
+            Level::Debug => {
+                println!("[DEBUG] {}", message);
+            }
+            Level::Trace => {
+                println!("[TRACE] {}", message);
+            }
+        }
+    }
+
+    fn flush(&self) {}
+}
+
+pub fn setup_local_logger() -> Result<()> {
+    set_logger(&LocalLogger)?;
+    Ok(())
+}
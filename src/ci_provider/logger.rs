@@ -1,9 +1,13 @@
+use anyhow::Result;
+use std::sync::RwLock;
+
 /// This target is used exclusively to handle group events.
 pub const GROUP_TARGET: &str = "codspeed::group";
 pub const OPENED_GROUP_TARGET: &str = "codspeed::group::opened";
 
 #[macro_export]
 /// Start a new log group. All logs between this and the next `end_group!` will be grouped together.
+/// The resources used by the runner during the group are recorded by the runner telemetry.
 ///
 /// # Example
 ///
@@ -14,7 +18,9 @@ pub const OPENED_GROUP_TARGET: &str = "codspeed::group::opened";
 /// ```
 macro_rules! start_group {
     ($name:expr) => {
-        log::log!(target: $crate::ci_provider::logger::GROUP_TARGET, log::Level::Info, "{}", $name);
+        let name = $name;
+        $crate::telemetry::start_phase(&name.to_string());
+        log::log!(target: $crate::ci_provider::logger::GROUP_TARGET, log::Level::Info, "{}", name);
     };
 }
 
@@ -30,7 +36,9 @@ macro_rules! start_group {
 /// ```
 macro_rules! start_opened_group {
     ($name:expr) => {
-        log::log!(target: $crate::ci_provider::logger::OPENED_GROUP_TARGET, log::Level::Info, "{}", $name);
+        let name = $name;
+        $crate::telemetry::start_phase(&name.to_string());
+        log::log!(target: $crate::ci_provider::logger::OPENED_GROUP_TARGET, log::Level::Info, "{}", name);
     };
 }
 
@@ -40,6 +48,7 @@ macro_rules! start_opened_group {
 macro_rules! end_group {
     () => {
         log::log!(target: $crate::ci_provider::logger::GROUP_TARGET, log::Level::Info, "");
+        $crate::telemetry::end_phase();
     };
 }
 
@@ -71,3 +80,41 @@ pub(super) fn get_group_event(record: &log::Record) -> Option<GroupEvent> {
         _ => None,
     }
 }
+
+/// The logger of the current run, replaced by each run of the runner daemon
+static RUN_LOGGER: RwLock<Option<&'static dyn log::Log>> = RwLock::new(None);
+
+/// Forwards the logs to the logger of the current run
+struct RunLogger;
+
+impl log::Log for RunLogger {
+    fn enabled(&self, metadata: &log::Metadata) -> bool {
+        RUN_LOGGER
+            .read()
+            .unwrap()
+            .is_some_and(|logger| logger.enabled(metadata))
+    }
+
+    fn log(&self, record: &log::Record) {
+        if let Some(logger) = *RUN_LOGGER.read().unwrap() {
+            logger.log(record);
+        }
+    }
+
+    fn flush(&self) {
+        if let Some(logger) = *RUN_LOGGER.read().unwrap() {
+            logger.flush();
+        }
+    }
+}
+
+/// Register the logger of the current run. Unlike `log::set_logger`, it can be called again,
+/// the runner daemon serving the runs of different CI providers.
+pub(super) fn set_logger(logger: &'static dyn log::Log) -> Result<()> {
+    let mut run_logger = RUN_LOGGER.write().unwrap();
+    if run_logger.is_none() {
+        log::set_logger(&RunLogger)?;
+    }
+    *run_logger = Some(logger);
+    Ok(())
+}
@@ -1,3 +1,4 @@
+mod local_logger;
 pub mod logger;
 mod provider;
 
@@ -7,6 +8,7 @@ use crate::ci_provider::provider::CIProviderDetector;
 use crate::config::Config;
 use crate::prelude::*;
 
+pub use self::local_logger::setup_local_logger;
 pub use self::provider::CIProvider;
 
 // Provider implementations
@@ -1,6 +1,6 @@
 use crate::config::Config;
 use crate::prelude::*;
-use crate::uploader::UploadMetadata;
+use crate::uploader::{ProfileArchive, ShardData, UploadMetadata};
 
 pub trait CIProviderDetector {
     /// Detects if the current environment is running inside the CI provider.
@@ -37,14 +37,44 @@ pub trait CIProvider {
     /// # Arguments
     ///
     /// * `config` - A reference to the configuration.
-    /// * `archive_hash` - The hash of the archive to be uploaded.
+    /// * `archive` - The profile archive to be uploaded.
     ///
     /// # Example
     ///
     /// ```
     /// let provider = MyCIProvider::new();
     /// let config = Config::new();
-    /// let metadata = provider.get_upload_metadata(&config, "abc123").unwrap();
+    /// let archive = create_profile_archive(&profile_folder, ArchiveFormat::Gzip, None).await?;
+    /// let metadata = provider.get_upload_metadata(&config, &archive).unwrap();
     /// ```
-    fn get_upload_metadata(&self, config: &Config, archive_hash: &str) -> Result<UploadMetadata>;
+    fn get_upload_metadata(
+        &self,
+        config: &Config,
+        archive: &ProfileArchive,
+    ) -> Result<UploadMetadata>;
+
+    /// Returns the base branch of the pull request being benchmarked, if any.
+    fn get_base_ref(&self) -> Option<&str>;
+
+    /// Returns an identifier shared by all the jobs of the current CI run.
+    ///
+    /// It is used to group the partial results uploaded by the shards of a run. It must not change
+    /// when some jobs are re-run, the shards uploaded again replacing the previous uploads of the
+    /// same shard index.
+    fn get_run_identity(&self) -> Result<String>;
+
+    /// Returns the shard data of the upload metadata, when the benchmarks are sharded across
+    /// several CI jobs.
+    fn get_shard_data(&self, config: &Config) -> Result<Option<ShardData>> {
+        config
+            .shard
+            .map(|shard| {
+                Ok(ShardData {
+                    index: shard.index,
+                    count: shard.count,
+                    run_identity: self.get_run_identity()?,
+                })
+            })
+            .transpose()
+    }
 }
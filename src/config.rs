@@ -1,9 +1,57 @@
-use std::env;
+use std::{env, path::PathBuf, time::Duration};
 
 use crate::prelude::*;
+use clap::ValueEnum;
+use serde::{Deserialize, Serialize};
 use url::Url;
 
 use crate::app::AppArgs;
+use crate::runner::{resolve_cache_geometry, resolve_cache_simulation};
+use crate::uploader::{ArchiveFormat, CacheGeometry, CacheSimulation};
+
+/// The engine measuring the benchmarks
+#[derive(Deserialize, Serialize, Debug, Clone, Copy, PartialEq, ValueEnum)]
+#[serde(rename_all = "kebab-case")]
+pub enum MeasurementMode {
+    // Count the instructions with callgrind, simulating the CPU caches
+    Instrumentation,
+    // Run the benchmarks natively, counting the instructions and cycles with the perf_event
+    // hardware counters
+    PerfCounters,
+    // Run the benchmarks natively several times, pinned to the isolated cpus, and record the
+    // distribution of their wall time
+    Walltime,
+}
+
+impl MeasurementMode {
+    /// The name of the mode, as exposed to the benchmark processes
+    pub fn name(&self) -> &'static str {
+        match self {
+            MeasurementMode::Instrumentation => "instrumentation",
+            MeasurementMode::PerfCounters => "perf-counters",
+            MeasurementMode::Walltime => "walltime",
+        }
+    }
+}
+
+/// The part of the benchmarks run by this CI job, when they are sharded across several jobs
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Shard {
+    pub index: usize,
+    pub count: usize,
+}
+
+/// The benchmarks are sampled until the confidence interval of their median is within the target
+/// precision, or until their time budget is spent
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct AdaptiveSampling {
+    /// The half-width of the 95% confidence interval of the median, relative to the median
+    pub target_precision: f64,
+    pub time_budget: Duration,
+}
+
+/// The time budget of each bench command when only the target precision is given
+const DEFAULT_TIME_BUDGET: Duration = Duration::from_secs(60);
 
 #[derive(Debug)]
 pub struct Config {
@@ -11,6 +59,40 @@ pub struct Config {
     pub token: Option<String>,
     pub working_directory: Option<String>,
     pub command: String,
+    pub mode: MeasurementMode,
+    pub walltime_samples: usize,
+    /// Only set in the native modes
+    pub adaptive_sampling: Option<AdaptiveSampling>,
+    /// The caches simulated by callgrind, only set in instrumentation mode
+    pub cache_geometry: Option<CacheGeometry>,
+    /// The cache geometries simulated by extra instrumented runs
+    pub cache_simulations: Vec<CacheSimulation>,
+    pub parallel_cache_simulations: bool,
+    pub collect_atstart: Option<bool>,
+    pub toggle_collect: Vec<String>,
+    pub skipped_objects: Vec<String>,
+    pub skipped_functions: Vec<String>,
+    pub archive_format: ArchiveFormat,
+    pub archive_compression_level: Option<i32>,
+    pub upload_concurrency: usize,
+    pub pipelined_archive: bool,
+    pub remove_archived_profiles: bool,
+    pub profile_dir: Option<PathBuf>,
+    pub deduplicated_upload: bool,
+    pub jobs: usize,
+    pub shard: Option<Shard>,
+    pub benchmark_manifest: Option<PathBuf>,
+    pub cache_dir: Option<PathBuf>,
+    pub compact_perf_maps: bool,
+    pub merge_profiles: bool,
+    pub separate_threads: bool,
+    pub runner_telemetry: bool,
+    pub memory_profile: bool,
+    /// The frequency of the stack samples recorded in the native modes, if enabled
+    pub stack_sampling_frequency: Option<u64>,
+    /// The profile folder the benchmarks are compared to, locally instead of uploading them
+    pub compare_to: Option<PathBuf>,
+    pub save_baseline: Option<PathBuf>,
 
     pub skip_upload: bool,
     pub skip_setup: bool,
@@ -25,6 +107,35 @@ impl Config {
             token: None,
             working_directory: None,
             command: "".into(),
+            mode: MeasurementMode::Instrumentation,
+            walltime_samples: 1,
+            adaptive_sampling: None,
+            cache_geometry: Some(resolve_cache_geometry("default").unwrap()),
+            cache_simulations: vec![],
+            parallel_cache_simulations: false,
+            collect_atstart: None,
+            toggle_collect: vec![],
+            skipped_objects: vec![],
+            skipped_functions: vec![],
+            archive_format: ArchiveFormat::Gzip,
+            archive_compression_level: None,
+            upload_concurrency: 1,
+            pipelined_archive: false,
+            remove_archived_profiles: false,
+            profile_dir: None,
+            deduplicated_upload: false,
+            jobs: 1,
+            shard: None,
+            benchmark_manifest: None,
+            cache_dir: None,
+            compact_perf_maps: false,
+            merge_profiles: false,
+            separate_threads: false,
+            runner_telemetry: false,
+            memory_profile: false,
+            stack_sampling_frequency: None,
+            compare_to: None,
+            save_baseline: None,
             skip_upload: false,
             skip_setup: false,
         }
@@ -39,13 +150,130 @@ impl TryFrom<AppArgs> for Config {
         let raw_upload_url = args.upload_url.unwrap_or_else(|| DEFAULT_UPLOAD_URL.into());
         let upload_url = Url::parse(&raw_upload_url)
             .map_err(|e| anyhow!("Invalid upload URL: {}, {}", raw_upload_url, e))?;
-        let skip_upload = args.skip_upload || env::var("CODSPEED_SKIP_UPLOAD") == Ok("true".into());
+        let is_local_run = args.compare_to.is_some() || args.save_baseline.is_some();
+        if is_local_run && args.mode != MeasurementMode::Instrumentation {
+            bail!("The comparison to a baseline is only supported in instrumentation mode");
+        }
+        let skip_upload = args.skip_upload
+            || is_local_run
+            || env::var("CODSPEED_SKIP_UPLOAD") == Ok("true".into());
         let token = args.token.or_else(|| env::var("CODSPEED_TOKEN").ok());
+        let cache_dir = args
+            .cache_dir
+            .or_else(|| env::var("CODSPEED_CACHE_DIR").ok().map(PathBuf::from));
+        if let Some(level) = args.archive_compression_level {
+            let valid_levels = match args.archive_format {
+                ArchiveFormat::Gzip => 0..=9,
+                ArchiveFormat::Zstd => 1..=22,
+            };
+            if !valid_levels.contains(&level) {
+                bail!(
+                    "Invalid archive compression level: {}, expected a level between {} and {} for {:?}",
+                    level,
+                    valid_levels.start(),
+                    valid_levels.end(),
+                    args.archive_format
+                );
+            }
+        }
+        let shard = match (args.shard_index, args.shard_count) {
+            (Some(index), Some(count)) => {
+                if index >= count {
+                    bail!(
+                        "Invalid shard index: {}, expected an index lower than the shard count {}",
+                        index,
+                        count
+                    );
+                }
+                Some(Shard { index, count })
+            }
+            _ => None,
+        };
+        if args.stack_sampling_frequency.is_some() && args.mode == MeasurementMode::Instrumentation
+        {
+            bail!("The stack sampling is only supported in the perf-counters and walltime modes");
+        }
+        if args.separate_threads && args.mode != MeasurementMode::Instrumentation {
+            bail!("The threads are only measured separately in instrumentation mode");
+        }
+        let adaptive_sampling = match args.target_precision {
+            Some(target_precision) => {
+                if args.mode == MeasurementMode::Instrumentation {
+                    bail!("The adaptive sampling is only supported in the perf-counters and walltime modes");
+                }
+                if !(target_precision > 0.0 && target_precision < 1.0) {
+                    bail!("Invalid target precision: {}", target_precision);
+                }
+                let time_budget = match args.time_budget {
+                    Some(time_budget) if time_budget > 0.0 => Duration::from_secs_f64(time_budget),
+                    Some(time_budget) => bail!("Invalid time budget: {}", time_budget),
+                    None => DEFAULT_TIME_BUDGET,
+                };
+                Some(AdaptiveSampling {
+                    target_precision,
+                    time_budget,
+                })
+            }
+            None => None,
+        };
+        if args.stack_sampling_frequency == Some(0) {
+            bail!("Invalid stack sampling frequency: 0");
+        }
+        let cache_geometry = match args.mode {
+            MeasurementMode::Instrumentation => Some(resolve_cache_geometry(&args.cache_geometry)?),
+            _ => None,
+        };
+        let cache_simulations = args
+            .extra_cache_geometry
+            .iter()
+            .enumerate()
+            .map(|(index, spec)| resolve_cache_simulation(spec, index))
+            .collect::<Result<Vec<_>>>()?;
+        if !cache_simulations.is_empty() && args.mode != MeasurementMode::Instrumentation {
+            bail!("The extra cache geometries are only simulated in instrumentation mode");
+        }
+        if let Some(label) = cache_simulations
+            .iter()
+            .map(|simulation| &simulation.label)
+            .duplicates()
+            .next()
+        {
+            bail!("Duplicate cache simulation label: {}", label);
+        }
         Ok(Self {
             upload_url,
             token,
             working_directory: args.working_directory,
             command: args.command.join(" "),
+            mode: args.mode,
+            walltime_samples: args.walltime_samples.max(1),
+            adaptive_sampling,
+            cache_geometry,
+            cache_simulations,
+            parallel_cache_simulations: args.parallel_cache_simulations,
+            collect_atstart: args.collect_atstart,
+            toggle_collect: args.toggle_collect,
+            skipped_objects: args.skip_object,
+            skipped_functions: args.skip_function,
+            archive_format: args.archive_format,
+            archive_compression_level: args.archive_compression_level,
+            upload_concurrency: args.upload_concurrency.max(1),
+            pipelined_archive: args.pipelined_archive,
+            remove_archived_profiles: args.remove_archived_profiles,
+            profile_dir: args.profile_dir,
+            deduplicated_upload: args.deduplicated_upload,
+            jobs: args.jobs.max(1),
+            shard,
+            benchmark_manifest: args.benchmark_manifest,
+            cache_dir,
+            compact_perf_maps: args.compact_perf_maps,
+            merge_profiles: args.merge_profiles,
+            separate_threads: args.separate_threads,
+            runner_telemetry: args.runner_telemetry,
+            memory_profile: args.memory_profile,
+            stack_sampling_frequency: args.stack_sampling_frequency,
+            compare_to: args.compare_to,
+            save_baseline: args.save_baseline,
             skip_upload,
             skip_setup: args.skip_setup,
         })
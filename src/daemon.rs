@@ -0,0 +1,357 @@
+use crate::{
+    app::{self, AppArgs},
+    ci_provider,
+    prelude::*,
+    telemetry,
+};
+use clap::Parser;
+use serde::{Deserialize, Serialize};
+use std::{
+    env,
+    ffi::OsString,
+    fs,
+    io::{self, BufRead, BufReader, Write},
+    mem,
+    os::{
+        fd::{AsRawFd, FromRawFd, OwnedFd, RawFd},
+        unix::fs::PermissionsExt,
+        unix::net::{UnixListener, UnixStream},
+    },
+    path::{Path, PathBuf},
+    ptr,
+};
+
+/// The stdout and stderr of the client, passed to the daemon with the run request
+const CLIENT_FD_COUNT: usize = 2;
+
+/// A run sent to the runner daemon, with the context of the client process
+#[derive(Deserialize, Serialize, Debug)]
+#[serde(rename_all = "camelCase")]
+struct RunRequest {
+    args: Vec<OsString>,
+    env: Vec<(OsString, OsString)>,
+    working_directory: PathBuf,
+}
+
+#[derive(Deserialize, Serialize, Debug)]
+#[serde(rename_all = "camelCase")]
+struct RunResponse {
+    error: Option<String>,
+}
+
+/// Returns the size of the control message carrying the file descriptors, in u64 words for the
+/// buffer to be aligned for `cmsghdr`
+fn get_control_words() -> usize {
+    let fds_size = mem::size_of::<[RawFd; CLIENT_FD_COUNT]>() as u32;
+    // SAFETY: CMSG_SPACE only computes a size
+    let control_size = unsafe { libc::CMSG_SPACE(fds_size) } as usize;
+    control_size.div_ceil(mem::size_of::<u64>())
+}
+
+/// Send the file descriptors over the socket, along with a single byte of payload
+fn send_fds(stream: &UnixStream, fds: [RawFd; CLIENT_FD_COUNT]) -> io::Result<()> {
+    let payload = [0u8; 1];
+    let mut iov = libc::iovec {
+        iov_base: payload.as_ptr() as *mut _,
+        iov_len: payload.len(),
+    };
+    let mut control = vec![0u64; get_control_words()];
+    let fds_size = mem::size_of_val(&fds) as u32;
+    // SAFETY: the message points to the payload and control buffers, alive for the whole call,
+    // and the control buffer is large enough for a header and the file descriptors
+    unsafe {
+        let mut message: libc::msghdr = mem::zeroed();
+        message.msg_iov = &mut iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.as_mut_ptr() as *mut _;
+        message.msg_controllen = mem::size_of_val(control.as_slice()) as _;
+        let header = libc::CMSG_FIRSTHDR(&message);
+        (*header).cmsg_level = libc::SOL_SOCKET;
+        (*header).cmsg_type = libc::SCM_RIGHTS;
+        (*header).cmsg_len = libc::CMSG_LEN(fds_size) as _;
+        ptr::copy_nonoverlapping(
+            fds.as_ptr() as *const u8,
+            libc::CMSG_DATA(header),
+            fds_size as usize,
+        );
+        if libc::sendmsg(stream.as_raw_fd(), &message, 0) < 0 {
+            return Err(io::Error::last_os_error());
+        }
+    }
+    Ok(())
+}
+
+/// Receive the file descriptors sent by `send_fds`
+fn receive_fds(stream: &UnixStream) -> Result<[OwnedFd; CLIENT_FD_COUNT]> {
+    let mut payload = [0u8; 1];
+    let mut iov = libc::iovec {
+        iov_base: payload.as_mut_ptr() as *mut _,
+        iov_len: payload.len(),
+    };
+    let mut control = vec![0u64; get_control_words()];
+    let mut fds: [RawFd; CLIENT_FD_COUNT] = [-1; CLIENT_FD_COUNT];
+    // SAFETY: same as in send_fds, the received descriptors being copied out of the control
+    // buffer before it is dropped
+    unsafe {
+        let mut message: libc::msghdr = mem::zeroed();
+        message.msg_iov = &mut iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.as_mut_ptr() as *mut _;
+        message.msg_controllen = mem::size_of_val(control.as_slice()) as _;
+        // the descriptors must not leak into the benchmark processes other than as their stdio
+        if libc::recvmsg(stream.as_raw_fd(), &mut message, libc::MSG_CMSG_CLOEXEC) <= 0 {
+            bail!(
+                "Failed to receive the run request: {}",
+                io::Error::last_os_error()
+            );
+        }
+        let header = libc::CMSG_FIRSTHDR(&message);
+        ensure!(
+            !header.is_null()
+                && (*header).cmsg_level == libc::SOL_SOCKET
+                && (*header).cmsg_type == libc::SCM_RIGHTS
+                && (*header).cmsg_len as usize
+                    >= libc::CMSG_LEN(mem::size_of_val(&fds) as u32) as usize,
+            "The run request does not carry the stdout and stderr of the client"
+        );
+        ptr::copy_nonoverlapping(
+            libc::CMSG_DATA(header),
+            fds.as_mut_ptr() as *mut u8,
+            mem::size_of_val(&fds),
+        );
+        Ok(fds.map(|fd| OwnedFd::from_raw_fd(fd)))
+    }
+}
+
+/// Redirects the stdout and stderr of the daemon, inherited by the benchmark processes, to the
+/// ones of the client until dropped
+struct StdioRedirection {
+    saved_fds: [OwnedFd; CLIENT_FD_COUNT],
+}
+
+impl StdioRedirection {
+    fn new(client_fds: &[OwnedFd; CLIENT_FD_COUNT]) -> io::Result<Self> {
+        let mut saved_fds = vec![];
+        for target_fd in [libc::STDOUT_FILENO, libc::STDERR_FILENO] {
+            // SAFETY: the standard descriptors stay open, so the duplicate is a valid descriptor
+            let saved_fd = unsafe { libc::fcntl(target_fd, libc::F_DUPFD_CLOEXEC, 0) };
+            if saved_fd < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            saved_fds.push(unsafe { OwnedFd::from_raw_fd(saved_fd) });
+        }
+        io::stdout().flush()?;
+        for (target_fd, client_fd) in [libc::STDOUT_FILENO, libc::STDERR_FILENO]
+            .into_iter()
+            .zip(client_fds)
+        {
+            if unsafe { libc::dup2(client_fd.as_raw_fd(), target_fd) } < 0 {
+                return Err(io::Error::last_os_error());
+            }
+        }
+        Ok(Self {
+            saved_fds: saved_fds.try_into().unwrap(),
+        })
+    }
+}
+
+impl Drop for StdioRedirection {
+    fn drop(&mut self) {
+        let _ = io::stdout().flush();
+        for (target_fd, saved_fd) in [libc::STDOUT_FILENO, libc::STDERR_FILENO]
+            .into_iter()
+            .zip(&self.saved_fds)
+        {
+            unsafe { libc::dup2(saved_fd.as_raw_fd(), target_fd) };
+        }
+    }
+}
+
+/// Replace the environment and working directory of the daemon with the ones of the client, for
+/// the CI provider and the bench command to see the context of the client run
+fn enter_client_context(request: &RunRequest) -> Result<()> {
+    for (name, _) in env::vars_os() {
+        env::remove_var(name);
+    }
+    for (name, value) in &request.env {
+        env::set_var(name, value);
+    }
+    env::set_current_dir(&request.working_directory).map_err(|e| {
+        anyhow!(
+            "Failed to enter working directory: {}, {}",
+            request.working_directory.display(),
+            e
+        )
+    })
+}
+
+/// Returns the uid of the process connected to the other end of the socket
+fn get_peer_uid(stream: &UnixStream) -> io::Result<libc::uid_t> {
+    // SAFETY: ucred is a plain struct, valid when zeroed, and getsockopt writes at most its size
+    let mut credentials: libc::ucred = unsafe { mem::zeroed() };
+    let mut length = mem::size_of::<libc::ucred>() as libc::socklen_t;
+    if unsafe {
+        libc::getsockopt(
+            stream.as_raw_fd(),
+            libc::SOL_SOCKET,
+            libc::SO_PEERCRED,
+            &mut credentials as *mut _ as *mut _,
+            &mut length,
+        )
+    } < 0
+    {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(credentials.uid)
+}
+
+/// Bind the socket readable and writable by the user of the daemon only, the runs being executed
+/// with its privileges
+fn bind_private_socket(socket_path: &Path) -> Result<UnixListener> {
+    // the socket is created with the permissions left by the umask, restricted before binding for
+    // the socket never to be reachable by the other users
+    let previous_umask = unsafe { libc::umask(0o177) };
+    let listener = UnixListener::bind(socket_path);
+    unsafe { libc::umask(previous_umask) };
+    let listener =
+        listener.map_err(|e| anyhow!("Failed to bind socket: {}, {}", socket_path.display(), e))?;
+    fs::set_permissions(socket_path, fs::Permissions::from_mode(0o600))?;
+    Ok(listener)
+}
+
+async fn serve_run(stream: UnixStream) -> Result<()> {
+    let peer_uid = get_peer_uid(&stream)?;
+    // SAFETY: geteuid has no failure case
+    let daemon_uid = unsafe { libc::geteuid() };
+    ensure!(
+        peer_uid == daemon_uid,
+        "Rejected run sent by uid {}, the daemon only serves uid {}",
+        peer_uid,
+        daemon_uid
+    );
+
+    let client_fds = receive_fds(&stream)?;
+    let mut request_line = String::new();
+    BufReader::new(&stream).read_line(&mut request_line)?;
+    let request: RunRequest =
+        serde_json::from_str(&request_line).map_err(|e| anyhow!("Invalid run request: {}", e))?;
+    debug!("Serving run: {:?}", request.args);
+
+    let result = {
+        let _redirection = StdioRedirection::new(&client_fds)?;
+        telemetry::reset();
+        match enter_client_context(&request)
+            .and_then(|_| AppArgs::try_parse_from(&request.args).map_err(Error::from))
+        {
+            Ok(args) => app::run_with_args(args).await,
+            Err(e) => Err(e),
+        }
+    };
+    // the logger of the run is replaced by the one of the daemon
+    ci_provider::setup_local_logger()?;
+    app::set_log_level();
+    match &result {
+        Ok(()) => info!("Served run: {:?}", request.args),
+        Err(e) => warn!("Failed run: {:?}, {}", request.args, e),
+    }
+
+    let response = RunResponse {
+        error: result.err().map(|e| e.to_string()),
+    };
+    let mut stream = &stream;
+    writeln!(stream, "{}", serde_json::to_string(&response)?)?;
+    Ok(())
+}
+
+/// Serve the runs sent to the socket one at a time, for their measurements not to disturb each
+/// other. Only the runs sent by the user of the daemon are served. The state warmed by a run, e.g.
+/// the prepared environment and the connection pool of the request client, is reused by the next
+/// ones.
+pub async fn serve(socket_path: &Path) -> Result<()> {
+    ci_provider::setup_local_logger()?;
+    app::set_log_level();
+    // the socket of a previous daemon is left behind when it is killed
+    if socket_path.exists() {
+        fs::remove_file(socket_path)?;
+    }
+    let listener = bind_private_socket(socket_path)?;
+    info!("Serving the runs sent to {}", socket_path.display());
+    loop {
+        let accepting_listener = listener.try_clone()?;
+        let (stream, _) =
+            tokio::task::spawn_blocking(move || accepting_listener.accept()).await??;
+        if let Err(e) = serve_run(stream).await {
+            warn!("Failed to serve run: {}", e);
+        }
+    }
+}
+
+/// Send the run of this process to the runner daemon, the logs of the run and the output of the
+/// benchmarks being written to the stdout and stderr of this process
+pub fn send_run(socket_path: &Path) -> Result<()> {
+    let stream = UnixStream::connect(socket_path).map_err(|e| {
+        anyhow!(
+            "Failed to connect to the runner daemon: {}, {}",
+            socket_path.display(),
+            e
+        )
+    })?;
+    send_fds(&stream, [libc::STDOUT_FILENO, libc::STDERR_FILENO])?;
+    let request = RunRequest {
+        args: env::args_os().collect(),
+        env: env::vars_os().collect(),
+        working_directory: env::current_dir()?,
+    };
+    let mut request_stream = &stream;
+    writeln!(request_stream, "{}", serde_json::to_string(&request)?)?;
+
+    let mut response_line = String::new();
+    BufReader::new(&stream).read_line(&mut response_line)?;
+    ensure!(
+        !response_line.is_empty(),
+        "The runner daemon stopped before the end of the run"
+    );
+    let response: RunResponse = serde_json::from_str(&response_line)
+        .map_err(|e| anyhow!("Invalid runner daemon response: {}", e))?;
+    match response.error {
+        Some(error) => bail!("{}", error),
+        None => Ok(()),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_send_fds() -> Result<()> {
+        let (client, daemon) = UnixStream::pair()?;
+        let (read_end, write_end) = UnixStream::pair()?;
+
+        send_fds(&client, [write_end.as_raw_fd(), write_end.as_raw_fd()])?;
+        let [stdout, _] = receive_fds(&daemon)?;
+        let mut received_stdout = UnixStream::from(stdout);
+        received_stdout.write_all(b"benchmark output\n")?;
+
+        let mut output = String::new();
+        BufReader::new(&read_end).read_line(&mut output)?;
+        assert_eq!(output, "benchmark output\n");
+        Ok(())
+    }
+
+    #[test]
+    fn test_private_socket() -> Result<()> {
+        let socket_path = env::temp_dir().join("codspeed_test_daemon.sock");
+        let _ = fs::remove_file(&socket_path);
+        let _listener = bind_private_socket(&socket_path)?;
+        assert_eq!(
+            fs::metadata(&socket_path)?.permissions().mode() & 0o777,
+            0o600
+        );
+
+        let (client, _) = UnixStream::pair()?;
+        assert_eq!(get_peer_uid(&client)?, unsafe { libc::geteuid() });
+        fs::remove_file(&socket_path)?;
+        Ok(())
+    }
+}
@@ -1,16 +1,26 @@
 mod app;
 mod ci_provider;
 mod config;
+mod daemon;
 mod helpers;
 mod prelude;
 mod request_client;
 mod runner;
+mod telemetry;
 mod uploader;
 
 pub const VERSION: &str = env!("CARGO_PKG_VERSION");
 
+fn main() {
+    // the runner replaces node while measuring the benchmarks
+    if runner::is_node_shim_invocation() {
+        runner::run_node_shim();
+    }
+    run();
+}
+
 #[tokio::main(flavor = "current_thread")]
-async fn main() {
+async fn run() {
     let res = crate::app::run().await;
     if let Err(err) = res {
         eprintln!("Error: {}", err);
@@ -1,9 +1,9 @@
 use lazy_static::lazy_static;
-use reqwest::ClientBuilder;
+use reqwest::{Client, ClientBuilder};
 use reqwest_middleware::{ClientBuilder as ClientWithMiddlewareBuilder, ClientWithMiddleware};
 use reqwest_retry::{policies::ExponentialBackoff, RetryTransientMiddleware};
 
-const UPLOAD_RETRY_COUNT: u32 = 3;
+pub const UPLOAD_RETRY_COUNT: u32 = 3;
 
 lazy_static! {
     pub static ref REQUEST_CLIENT: ClientWithMiddleware = ClientWithMiddlewareBuilder::new(
@@ -16,4 +16,11 @@ lazy_static! {
         ExponentialBackoff::builder().build_with_max_retries(UPLOAD_RETRY_COUNT)
     ))
     .build();
+
+    /// A client without the retry middleware, for requests with a streamed body that cannot be
+    /// cloned and have to be retried by the caller
+    pub static ref STREAMING_CLIENT: Client = ClientBuilder::new()
+        .user_agent("codspeed-runner")
+        .build()
+        .unwrap();
 }
@@ -1,4 +1,4 @@
-use std::process::Command;
+use std::{env::consts::ARCH, process::Command};
 
 use crate::prelude::*;
 
@@ -22,39 +22,30 @@ fn get_os_details() -> Result<(String, String)> {
     Ok((os.to_string(), os_version.to_string()))
 }
 
-/// NOTE: Since this relies on `dpkg` this will only work on Debian based systems
-fn get_arch() -> Result<String> {
-    let arch_output = Command::new("dpkg")
-        .args(["--print-architecture"])
-        .output()
-        .map_err(|_| anyhow!("Failed to get architecture info"))?;
-    if !arch_output.status.success() {
-        bail!("Failed to get architecture info");
-    }
-    let output_str = String::from_utf8(arch_output.stdout)
-        .map_err(|_| anyhow!("Failed to parse architecture info"))?;
-    Ok(output_str.trim().to_string())
-}
-
 pub struct SystemInfo {
     pub os: String,
     pub os_version: String,
     pub arch: String,
 }
 
+impl SystemInfo {
+    /// Returns true if valgrind-codspeed is packaged for the system
+    pub fn is_deb_supported(&self) -> bool {
+        self.os == "Ubuntu" && ["20.04", "22.04"].contains(&self.os_version.as_str())
+    }
+}
+
 pub fn check_system() -> Result<SystemInfo> {
-    let (os, os_version) = get_os_details()?;
+    // lsb_release is missing on the systems the valgrind-codspeed packages are not built for
+    let (os, os_version) = get_os_details().unwrap_or_else(|e| {
+        debug!("{}", e);
+        ("unknown".into(), "unknown".into())
+    });
     debug!("OS: {}, Version: {}", os, os_version);
-    if os != "Ubuntu" {
-        bail!("Only Ubuntu is supported at the moment");
-    }
-    if !["20.04", "22.04"].contains(&os_version.as_str()) {
-        bail!("Only Ubuntu 20.04 and 22.04 are supported at the moment");
-    }
-    let arch = get_arch()?;
+    let arch = ARCH.to_string();
     debug!("Arch: {}", arch);
-    if arch != "amd64" {
-        bail!("Only amd64 is supported at the moment");
+    if arch != "x86_64" {
+        bail!("Only x86_64 is supported at the moment");
     }
     Ok(SystemInfo {
         os,
@@ -0,0 +1,279 @@
+use super::merge_profiles::{parse_profiles, ParsedProfile};
+use crate::prelude::*;
+use std::{
+    collections::BTreeMap,
+    fs,
+    path::{Path, PathBuf},
+};
+
+/// The relative increase of the cost of a benchmark reported as a regression
+const REGRESSION_THRESHOLD: f64 = 0.05;
+/// The cost estimated from the instructions and the simulated cache misses
+const ESTIMATED_CYCLES_EVENT: &str = "EstimatedCycles";
+const CLIENT_REQUEST_TRIGGER_PREFIX: &str = "Client Request: ";
+
+/// The self costs of each benchmark summed over its processes, by event
+type BenchmarkCosts = BTreeMap<String, BTreeMap<String, u64>>;
+
+fn list_profiles(folder: &Path) -> Result<Vec<PathBuf>> {
+    let profile_paths = fs::read_dir(folder)
+        .map_err(|e| anyhow!("Failed to read folder: {}, {}", folder.display(), e))?
+        .filter_map(|entry| entry.ok())
+        .map(|entry| entry.path())
+        .filter(|path| path.extension().unwrap_or_default() == "out")
+        .sorted()
+        .collect_vec();
+    Ok(profile_paths)
+}
+
+/// Estimate the cycles like the L1 hits, plus 5 cycles per last level cache hit and 35 cycles
+/// per memory access, when the caches are simulated
+fn get_estimated_cycles(costs: &BTreeMap<String, u64>) -> Option<u64> {
+    let get = |event: &str| costs.get(event).copied();
+    let accesses = get("Ir")? + get("Dr")? + get("Dw")?;
+    let l1_misses = get("I1mr")? + get("D1mr")? + get("D1mw")?;
+    let ll_misses = get("ILmr")? + get("DLmr")? + get("DLmw")?;
+    let l1_hits = accesses.saturating_sub(l1_misses);
+    let ll_hits = l1_misses.saturating_sub(ll_misses);
+    Some(l1_hits + 5 * ll_hits + 35 * ll_misses)
+}
+
+fn sum_benchmark_costs(profiles: Vec<ParsedProfile>) -> BenchmarkCosts {
+    let mut benchmark_costs = BenchmarkCosts::new();
+    for profile in profiles {
+        for (trigger, records) in profile.parts {
+            let name = trigger
+                .strip_prefix(CLIENT_REQUEST_TRIGGER_PREFIX)
+                .unwrap_or(&trigger);
+            let costs = benchmark_costs.entry(name.to_string()).or_default();
+            // the inclusive costs of the calls are already counted by the self costs of the callees
+            for record in records
+                .iter()
+                .filter(|(key, _)| key.callee.is_none())
+                .map(|(_, record)| record)
+            {
+                for (event, cost) in profile.events.iter().zip(&record.costs) {
+                    *costs.entry(event.clone()).or_default() += cost;
+                }
+            }
+        }
+    }
+    for costs in benchmark_costs.values_mut() {
+        if let Some(estimated_cycles) = get_estimated_cycles(costs) {
+            costs.insert(ESTIMATED_CYCLES_EVENT.to_string(), estimated_cycles);
+        }
+    }
+    benchmark_costs
+}
+
+fn get_benchmark_costs(folder: &Path) -> Result<BenchmarkCosts> {
+    let profile_paths = list_profiles(folder)?;
+    ensure!(
+        !profile_paths.is_empty(),
+        "No callgrind profile found in {}",
+        folder.display()
+    );
+    Ok(sum_benchmark_costs(parse_profiles(&profile_paths)?))
+}
+
+/// The cost of a benchmark in the baseline and the current run
+#[derive(Debug, PartialEq)]
+struct Comparison {
+    benchmark: String,
+    event: String,
+    baseline: Option<u64>,
+    current: Option<u64>,
+}
+
+impl Comparison {
+    /// The relative change of the cost, when the benchmark is in both runs
+    fn change(&self) -> Option<f64> {
+        match (self.baseline, self.current) {
+            (Some(0), Some(0)) => Some(0.0),
+            (Some(baseline), Some(current)) if baseline > 0 => {
+                Some((current as f64 - baseline as f64) / baseline as f64)
+            }
+            _ => None,
+        }
+    }
+}
+
+/// Compare each benchmark on the estimated cycles when both runs simulated the caches, on the
+/// instructions otherwise
+fn compare_costs(baseline: &BenchmarkCosts, current: &BenchmarkCosts) -> Vec<Comparison> {
+    let mut names = baseline.keys().chain(current.keys()).collect_vec();
+    names.sort();
+    names.dedup();
+    names
+        .into_iter()
+        .map(|name| {
+            let (baseline_costs, current_costs) = (baseline.get(name), current.get(name));
+            let has_event = |event: &str| {
+                [baseline_costs, current_costs]
+                    .iter()
+                    .flatten()
+                    .all(|costs| costs.contains_key(event))
+            };
+            let event = if has_event(ESTIMATED_CYCLES_EVENT) {
+                ESTIMATED_CYCLES_EVENT
+            } else {
+                "Ir"
+            };
+            Comparison {
+                benchmark: name.clone(),
+                event: event.to_string(),
+                baseline: baseline_costs.and_then(|costs| costs.get(event).copied()),
+                current: current_costs.and_then(|costs| costs.get(event).copied()),
+            }
+        })
+        .collect()
+}
+
+/// Diff the costs of the benchmarks of the profile folder against the profiles of a baseline
+/// folder, e.g. saved with `--save-baseline`, logging the regressions without any upload
+pub fn compare_to_baseline(profile_folder: &Path, baseline_folder: &Path) -> Result<()> {
+    let baseline = get_benchmark_costs(baseline_folder)
+        .map_err(|e| anyhow!("Failed to read the baseline: {}", e))?;
+    let current = get_benchmark_costs(profile_folder)?;
+
+    let mut regressions = 0;
+    let mut improvements = 0;
+    for comparison in compare_costs(&baseline, &current) {
+        let Comparison {
+            benchmark,
+            event,
+            baseline,
+            current,
+        } = &comparison;
+        match (baseline, current, comparison.change()) {
+            (Some(baseline), Some(current), Some(change)) => {
+                let message = format!(
+                    "{}: {} -> {} {} ({:+.2}%)",
+                    benchmark,
+                    baseline,
+                    current,
+                    event,
+                    change * 100.0
+                );
+                if change > REGRESSION_THRESHOLD {
+                    regressions += 1;
+                    warn!("Regression: {}", message);
+                } else {
+                    if change < -REGRESSION_THRESHOLD {
+                        improvements += 1;
+                    }
+                    info!("{}", message);
+                }
+            }
+            (None, Some(current), _) => info!("{}: {} {} (new)", benchmark, current, event),
+            (Some(baseline), None, _) => {
+                info!("{}: {} {} (not run)", benchmark, baseline, event)
+            }
+            _ => info!("{}: no {} cost to compare", benchmark, event),
+        }
+    }
+    info!(
+        "Compared to {}: {} regressions and {} improvements over {:.0}%",
+        baseline_folder.display(),
+        regressions,
+        improvements,
+        REGRESSION_THRESHOLD * 100.0
+    );
+    Ok(())
+}
+
+/// Replace the profiles of the baseline folder with the profiles of this run
+pub fn save_baseline(profile_folder: &Path, baseline_folder: &Path) -> Result<()> {
+    fs::create_dir_all(baseline_folder).map_err(|e| {
+        anyhow!(
+            "Failed to create folder: {}, {}",
+            baseline_folder.display(),
+            e
+        )
+    })?;
+    for previous_profile in list_profiles(baseline_folder)? {
+        fs::remove_file(&previous_profile)?;
+    }
+    let profile_paths = list_profiles(profile_folder)?;
+    for profile_path in &profile_paths {
+        let baseline_path = baseline_folder.join(profile_path.file_name().unwrap_or_default());
+        fs::copy(profile_path, &baseline_path).map_err(|e| {
+            anyhow!(
+                "Failed to copy profile: {} to {}: {}",
+                profile_path.display(),
+                baseline_folder.display(),
+                e
+            )
+        })?;
+    }
+    info!(
+        "Saved {} profiles as the baseline in {}",
+        profile_paths.len(),
+        baseline_folder.display()
+    );
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::merge_profiles::parse_profile_content;
+    use super::*;
+
+    fn get_profile(pid: u32, benchmark: &str, ir: u64) -> String {
+        format!(
+            "version: 1
+pid: {}
+desc: Trigger: Client Request: {}
+events: Ir Dr Dw I1mr D1mr D1mw ILmr DLmr DLmw
+fl=(1) bench.js
+fn=(1) run
+1 {} 20 10 4 2 1 1 1 0
+cfn=(2) add
+calls=1 0
+1 100 0 0 0 0 0 0 0 0
+fn=(2)
+2 100
+",
+            pid, benchmark, ir
+        )
+    }
+
+    fn get_costs(profiles: &[(u32, &str, u64)]) -> BenchmarkCosts {
+        sum_benchmark_costs(
+            profiles
+                .iter()
+                .map(|(pid, benchmark, ir)| {
+                    parse_profile_content(*pid, &get_profile(*pid, benchmark, *ir)).unwrap()
+                })
+                .collect(),
+        )
+    }
+
+    #[test]
+    fn test_sum_benchmark_costs() {
+        let costs = get_costs(&[(1, "fib", 100), (2, "fib", 100)]);
+        let fib_costs = &costs["fib"];
+        assert_eq!(fib_costs["Ir"], 400);
+        assert_eq!(fib_costs["D1mr"], 4);
+        // 460 accesses, 14 L1 misses and 4 LL misses
+        assert_eq!(fib_costs[ESTIMATED_CYCLES_EVENT], 446 + 5 * 10 + 35 * 4);
+    }
+
+    #[test]
+    fn test_compare_costs() {
+        let baseline = get_costs(&[(1, "fib", 100), (2, "removed", 100)]);
+        let current = get_costs(&[(3, "fib", 150), (4, "added", 100)]);
+
+        let comparisons = compare_costs(&baseline, &current);
+
+        assert_eq!(
+            comparisons.iter().map(|c| &c.benchmark).collect_vec(),
+            ["added", "fib", "removed"]
+        );
+        let fib = &comparisons[1];
+        assert_eq!(fib.event, ESTIMATED_CYCLES_EVENT);
+        assert_eq!((fib.baseline, fib.current), (Some(318), Some(368)));
+        assert!(fib.change().unwrap() > REGRESSION_THRESHOLD);
+        assert_eq!(comparisons[0].change(), None);
+    }
+}
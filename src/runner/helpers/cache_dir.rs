@@ -0,0 +1,22 @@
+use crate::config::Config;
+use std::{
+    env,
+    path::{Path, PathBuf},
+};
+
+/// The cache directory used when none is configured, following the XDG base directory spec
+pub fn get_default_cache_dir() -> PathBuf {
+    env::var("XDG_CACHE_HOME")
+        .map(PathBuf::from)
+        .or_else(|_| env::var("HOME").map(|home| Path::new(&home).join(".cache")))
+        .unwrap_or_else(|_| env::temp_dir())
+        .join("codspeed")
+}
+
+/// The directory persisting the toolchain and the introspection results across runs
+pub fn get_cache_dir(config: &Config) -> PathBuf {
+    config
+        .cache_dir
+        .clone()
+        .unwrap_or_else(get_default_cache_dir)
+}
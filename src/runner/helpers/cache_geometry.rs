@@ -0,0 +1,295 @@
+use crate::{
+    prelude::*,
+    uploader::{CacheGeometry, CacheLevel, CacheSimulation},
+};
+use std::{
+    fs,
+    path::{Path, PathBuf},
+};
+
+const SYSFS_CACHE_PATH: &str = "/sys/devices/system/cpu/cpu0/cache";
+
+const fn cache_level(size: u64, assoc: u64, line_size: u64) -> CacheLevel {
+    CacheLevel {
+        size,
+        assoc,
+        line_size,
+    }
+}
+
+/// The geometry used when none is configured, kept so that the results stay comparable with the
+/// previous runs
+const DEFAULT_CACHE_GEOMETRY: CacheGeometry = CacheGeometry {
+    i1: cache_level(32768, 8, 64),
+    d1: cache_level(32768, 8, 64),
+    ll: cache_level(8388608, 16, 64),
+};
+
+/// AMD Zen 3 and Zen 4 cores, the last level cache being the L3 of a CCX
+const ZEN4_CACHE_GEOMETRY: CacheGeometry = CacheGeometry {
+    i1: cache_level(32768, 8, 64),
+    d1: cache_level(32768, 8, 64),
+    ll: cache_level(33554432, 16, 64),
+};
+
+impl CacheLevel {
+    fn sets(&self) -> u64 {
+        self.size / (self.assoc * self.line_size)
+    }
+
+    /// Callgrind only simulates caches with a power of two number of sets, so the number of sets
+    /// is rounded down and the associativity raised to keep the size of the cache close. Returns
+    /// None for the caches without a whole set, e.g. the fully associative ones reported with
+    /// an associativity of 0 by sysfs.
+    fn to_simulable(self) -> Option<Self> {
+        if self.assoc == 0 || self.line_size == 0 || self.sets() == 0 {
+            return None;
+        }
+        if self.sets().is_power_of_two() {
+            return Some(self);
+        }
+        let sets = 1 << self.sets().ilog2();
+        let assoc = self.size / (sets * self.line_size);
+        Some(Self {
+            size: sets * assoc * self.line_size,
+            assoc,
+            line_size: self.line_size,
+        })
+    }
+
+    fn parse(spec: &str) -> Result<Self> {
+        let values = spec
+            .split(',')
+            .map(|value| value.trim().parse::<u64>())
+            .collect::<Result<Vec<_>, _>>()
+            .map_err(|e| anyhow!("Invalid cache geometry: {}, {}", spec, e))?;
+        let [size, assoc, line_size] = values[..] else {
+            bail!(
+                "Invalid cache geometry: {}, expected <size>,<assoc>,<line_size>",
+                spec
+            );
+        };
+        let level = cache_level(size, assoc, line_size);
+        ensure!(
+            assoc > 0 && line_size > 0 && level.sets().is_power_of_two(),
+            "Invalid cache geometry: {}, the number of sets must be a power of two",
+            spec
+        );
+        Ok(level)
+    }
+}
+
+impl CacheGeometry {
+    pub fn valgrind_args(&self) -> Vec<String> {
+        [("I1", self.i1), ("D1", self.d1), ("LL", self.ll)]
+            .iter()
+            .map(|(name, level)| {
+                format!(
+                    "--{}={},{},{}",
+                    name, level.size, level.assoc, level.line_size
+                )
+            })
+            .collect()
+    }
+}
+
+/// Parse a custom geometry, e.g. `I1=32768,8,64:D1=49152,12,64:LL=33554432,16,64`
+fn parse_cache_geometry(spec: &str) -> Result<CacheGeometry> {
+    let mut geometry = DEFAULT_CACHE_GEOMETRY;
+    let mut defined_levels = vec![];
+    for level_spec in spec.split(':') {
+        let (name, level) = level_spec.split_once('=').ok_or_else(|| {
+            anyhow!(
+                "Invalid cache geometry: {}, expected a preset or I1=...:D1=...:LL=...",
+                spec
+            )
+        })?;
+        let level = CacheLevel::parse(level)?;
+        match name.trim() {
+            "I1" => geometry.i1 = level,
+            "D1" => geometry.d1 = level,
+            "LL" => geometry.ll = level,
+            name => bail!("Unknown cache: {}, expected I1, D1 or LL", name),
+        }
+        defined_levels.push(name.trim());
+    }
+    ensure!(
+        defined_levels.iter().sorted().eq(["D1", "I1", "LL"].iter()),
+        "Invalid cache geometry: {}, I1, D1 and LL must each be defined once",
+        spec
+    );
+    Ok(geometry)
+}
+
+/// Parse a cache size as written in sysfs, e.g. `48K`
+fn parse_sysfs_size(size: &str) -> Result<u64> {
+    let size = size.trim();
+    let (value, unit) = match size.find(|c: char| !c.is_ascii_digit()) {
+        Some(i) => size.split_at(i),
+        None => (size, ""),
+    };
+    let multiplier = match unit {
+        "" => 1,
+        "K" => 1024,
+        "M" => 1024 * 1024,
+        "G" => 1024 * 1024 * 1024,
+        _ => bail!("Invalid cache size: {}", size),
+    };
+    Ok(value.parse::<u64>()? * multiplier)
+}
+
+fn read_sysfs_value(cache_index: &Path, name: &str) -> Result<String> {
+    let path = cache_index.join(name);
+    Ok(fs::read_to_string(&path)
+        .map_err(|e| anyhow!("Failed to read {}, {}", path.display(), e))?
+        .trim()
+        .to_string())
+}
+
+/// Detect the cache hierarchy of the first cpu from sysfs, the last level cache being the
+/// highest level data or unified cache
+fn detect_host_cache_geometry() -> Result<CacheGeometry> {
+    let mut i1 = None;
+    let mut d1 = None;
+    let mut ll: Option<(u32, CacheLevel)> = None;
+    for entry in fs::read_dir(SYSFS_CACHE_PATH)
+        .map_err(|e| anyhow!("Failed to detect the host caches: {}", e))?
+    {
+        let cache_index = entry?.path();
+        if !cache_index
+            .file_name()
+            .unwrap_or_default()
+            .to_string_lossy()
+            .starts_with("index")
+        {
+            continue;
+        }
+        let level_number: u32 = read_sysfs_value(&cache_index, "level")?.parse()?;
+        let cache_type = read_sysfs_value(&cache_index, "type")?;
+        let host_level = cache_level(
+            parse_sysfs_size(&read_sysfs_value(&cache_index, "size")?)?,
+            read_sysfs_value(&cache_index, "ways_of_associativity")?.parse()?,
+            read_sysfs_value(&cache_index, "coherency_line_size")?.parse()?,
+        );
+        let level = host_level.to_simulable().ok_or_else(|| {
+            anyhow!(
+                "Failed to detect the host caches: the L{} {} cache cannot be simulated: {:?}",
+                level_number,
+                cache_type,
+                host_level
+            )
+        })?;
+        match (level_number, cache_type.as_str()) {
+            (1, "Instruction") => i1 = Some(level),
+            (1, "Data") => d1 = Some(level),
+            _ => {}
+        }
+        let is_higher_level = !ll.is_some_and(|(ll_number, _)| ll_number >= level_number);
+        if cache_type != "Instruction" && is_higher_level {
+            ll = Some((level_number, level));
+        }
+    }
+    match (i1, d1, ll) {
+        (Some(i1), Some(d1), Some((_, ll))) => Ok(CacheGeometry { i1, d1, ll }),
+        _ => bail!("Failed to detect the host caches: missing I1, D1 or last level cache"),
+    }
+}
+
+/// Resolve the cache geometry simulated by callgrind: `default`, `host` to detect the caches of
+/// the machine, a preset, or a custom geometry
+pub fn resolve_cache_geometry(spec: &str) -> Result<CacheGeometry> {
+    let geometry = match spec {
+        "default" => DEFAULT_CACHE_GEOMETRY,
+        "zen4" => ZEN4_CACHE_GEOMETRY,
+        "host" => detect_host_cache_geometry().unwrap_or_else(|e| {
+            warn!("{}, using the default cache geometry", e);
+            DEFAULT_CACHE_GEOMETRY
+        }),
+        custom => parse_cache_geometry(custom)?,
+    };
+    debug!("Cache geometry: {:?}", geometry);
+    Ok(geometry)
+}
+
+/// Resolve a cache geometry simulated in addition to the main one, e.g. `zen4` or
+/// `gen2=I1=32768,8,64:D1=49152,12,64:LL=33554432,16,64`. A custom geometry without a label is
+/// labelled by its position among the extra geometries.
+pub fn resolve_cache_simulation(spec: &str, index: usize) -> Result<CacheSimulation> {
+    let (label, geometry_spec) = match spec.split_once('=') {
+        Some((label, geometry_spec)) if !["I1", "D1", "LL"].contains(&label.trim()) => {
+            (label.trim().to_string(), geometry_spec)
+        }
+        _ if spec.contains('=') => (format!("custom-{}", index + 1), spec),
+        _ => (spec.to_string(), spec),
+    };
+    ensure!(
+        !label.is_empty()
+            && label
+                .chars()
+                .all(|c| c.is_ascii_alphanumeric() || c == '-' || c == '_'),
+        "Invalid cache simulation label: {}, expected letters, digits, - or _",
+        label
+    );
+    Ok(CacheSimulation {
+        label,
+        cache_geometry: resolve_cache_geometry(geometry_spec)?,
+    })
+}
+
+/// The folder of the profiles of an extra cache simulation, in the profile folder
+pub fn get_cache_simulation_folder(profile_folder: &Path, simulation: &CacheSimulation) -> PathBuf {
+    profile_folder
+        .join("cache-simulations")
+        .join(&simulation.label)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_cache_geometry() {
+        let geometry =
+            parse_cache_geometry("I1=32768,8,64:D1=49152,12,64:LL=33554432,16,64").unwrap();
+        assert_eq!(geometry.d1, cache_level(49152, 12, 64));
+        assert_eq!(
+            geometry.valgrind_args(),
+            ["--I1=32768,8,64", "--D1=49152,12,64", "--LL=33554432,16,64"]
+        );
+        assert!(parse_cache_geometry("I1=32768,8,64:D1=49152,12,64").is_err());
+        assert!(parse_cache_geometry("I1=32768,8,64:D1=49152,12,64:LL=100000,3,64").is_err());
+    }
+
+    #[test]
+    fn test_resolve_cache_simulation() {
+        let simulation = resolve_cache_simulation("zen4", 0).unwrap();
+        assert_eq!(simulation.label, "zen4");
+        assert_eq!(simulation.cache_geometry, ZEN4_CACHE_GEOMETRY);
+        let simulation =
+            resolve_cache_simulation("gen2=I1=32768,8,64:D1=49152,12,64:LL=33554432,16,64", 0)
+                .unwrap();
+        assert_eq!(simulation.label, "gen2");
+        assert_eq!(simulation.cache_geometry.d1, cache_level(49152, 12, 64));
+        let simulation =
+            resolve_cache_simulation("I1=32768,8,64:D1=49152,12,64:LL=33554432,16,64", 1).unwrap();
+        assert_eq!(simulation.label, "custom-2");
+        assert!(resolve_cache_simulation("gen/2=zen4", 0).is_err());
+    }
+
+    #[test]
+    fn test_to_simulable() {
+        assert_eq!(parse_sysfs_size("107520K").unwrap(), 110100480);
+        // 114688 sets are rounded down to 65536
+        assert_eq!(
+            cache_level(110100480, 15, 64).to_simulable(),
+            Some(cache_level(109051904, 26, 64))
+        );
+        assert_eq!(
+            cache_level(49152, 12, 64).to_simulable(),
+            Some(cache_level(49152, 12, 64))
+        );
+        // fully associative, and smaller than a set
+        assert_eq!(cache_level(4096, 0, 64).to_simulable(), None);
+        assert_eq!(cache_level(512, 16, 64).to_simulable(), None);
+    }
+}
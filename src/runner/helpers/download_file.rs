@@ -1,30 +1,250 @@
 use crate::{prelude::*, request_client::REQUEST_CLIENT};
-use std::path::Path;
+use futures::{future::try_join_all, StreamExt};
+use reqwest::{header, StatusCode};
+use sha2::{Digest, Sha256};
+use std::{io::SeekFrom, ops::Range, path::Path, time::Duration};
+use tokio::{
+    fs::{File, OpenOptions},
+    io::{AsyncSeekExt, AsyncWriteExt},
+};
 
 use url::Url;
 
-pub async fn download_file(url: &Url, path: &Path) -> Result<()> {
-    debug!("Downloading file: {}", url);
-    let response = REQUEST_CLIENT
-        .get(url.clone())
-        .send()
-        .await
-        .map_err(|e| anyhow!("Failed to download file: {}", e))?;
+/// Number of times an interrupted download is resumed
+const DOWNLOAD_RETRY_COUNT: u32 = 3;
+/// Files from this size are downloaded in several ranges in parallel, if the server supports it
+const PARALLEL_DOWNLOAD_MIN_SIZE: u64 = 16 * 1024 * 1024;
+const PARALLEL_DOWNLOAD_PARTS: u64 = 4;
+
+/// Returns the size of the file if the server supports range requests
+async fn get_rangeable_size(url: &Url) -> Option<u64> {
+    let response = REQUEST_CLIENT.head(url.clone()).send().await.ok()?;
     if !response.status().is_success() {
-        bail!("Failed to download file: {}", response.status());
+        return None;
     }
-    let mut file = std::fs::File::create(path)
-        .map_err(|e| anyhow!("Failed to create file: {}, {}", path.display(), e))?;
-    let content = response
-        .bytes()
+    let headers = response.headers();
+    let accepts_ranges = headers
+        .get(header::ACCEPT_RANGES)
+        .is_some_and(|accept_ranges| accept_ranges == "bytes");
+    if !accepts_ranges {
+        return None;
+    }
+    // the body of a HEAD response is empty, so the size is read from the header
+    headers
+        .get(header::CONTENT_LENGTH)?
+        .to_str()
+        .ok()?
+        .parse()
+        .ok()
+}
+
+/// Stream `range` of the file, or the whole file, to the same offset of `path`, resuming the
+/// download from the last received byte after a transient failure
+async fn download_part(
+    url: &Url,
+    path: &Path,
+    range: Option<Range<u64>>,
+    mut hasher: Option<&mut Sha256>,
+) -> Result<()> {
+    let mut file = OpenOptions::new()
+        .write(true)
+        .open(path)
         .await
-        .map_err(|e| anyhow!("Failed to read response: {}", e))?;
-    std::io::copy(&mut content.as_ref(), &mut file).map_err(|e| {
-        anyhow!(
-            "Failed to write to file: {}, {}",
-            path.display(),
-            e.to_string()
-        )
-    })?;
+        .map_err(|e| anyhow!("Failed to open file: {}, {}", path.display(), e))?;
+    let start = range.as_ref().map_or(0, |range| range.start);
+    let mut offset = start;
+    let mut attempt = 0;
+    loop {
+        let mut request = REQUEST_CLIENT.get(url.clone());
+        let is_range_request = range.is_some() || offset != start;
+        if is_range_request {
+            let end = range
+                .as_ref()
+                .map(|range| (range.end - 1).to_string())
+                .unwrap_or_default();
+            request = request.header(header::RANGE, format!("bytes={}-{}", offset, end));
+        }
+        let error = match request.send().await {
+            Ok(response) => {
+                if !response.status().is_success() {
+                    bail!("Failed to download file: {}", response.status());
+                }
+                if is_range_request && response.status() != StatusCode::PARTIAL_CONTENT {
+                    bail!("Failed to download file: the server does not support range requests");
+                }
+
+                file.seek(SeekFrom::Start(offset)).await?;
+                let mut body = response.bytes_stream();
+                loop {
+                    match body.next().await {
+                        Some(Ok(chunk)) => {
+                            file.write_all(&chunk).await.map_err(|e| {
+                                anyhow!("Failed to write to file: {}, {}", path.display(), e)
+                            })?;
+                            if let Some(hasher) = &mut hasher {
+                                hasher.update(&chunk);
+                            }
+                            offset += chunk.len() as u64;
+                        }
+                        Some(Err(e)) => break reqwest_middleware::Error::from(e),
+                        None => {
+                            file.flush().await?;
+                            if let Some(range) = &range {
+                                ensure!(
+                                    offset == range.end,
+                                    "Failed to download file: received {} bytes instead of {}",
+                                    offset - range.start,
+                                    range.end - range.start
+                                );
+                            }
+                            return Ok(());
+                        }
+                    }
+                }
+            }
+            // the connection errors are as transient as the interrupted bodies
+            Err(e) => e,
+        };
+
+        attempt += 1;
+        if attempt > DOWNLOAD_RETRY_COUNT {
+            bail!("Failed to download file: {}", error);
+        }
+        warn!(
+            "Download interrupted after {} bytes: {}, resuming",
+            offset - start,
+            error
+        );
+        tokio::time::sleep(Duration::from_secs(1 << attempt)).await;
+    }
+}
+
+/// Returns the SHA-256 digest of a file, in lowercase hexadecimal
+pub async fn hash_file(path: &Path) -> Result<String> {
+    let path = path.to_path_buf();
+    tokio::task::spawn_blocking(move || {
+        let mut hasher = Sha256::new();
+        std::io::copy(&mut std::fs::File::open(&path)?, &mut hasher)?;
+        Ok(format!("{:x}", hasher.finalize()))
+    })
+    .await?
+}
+
+/// Download a file, streaming it to disk.
+///
+/// Large files are downloaded in several ranges in parallel when the server supports range
+/// requests. When `expected_sha256` is given, it is checked against the digest of the file.
+pub async fn download_file(url: &Url, path: &Path, expected_sha256: Option<&str>) -> Result<()> {
+    debug!("Downloading file: {}", url);
+    let file = File::create(path)
+        .await
+        .map_err(|e| anyhow!("Failed to create file: {}, {}", path.display(), e))?;
+
+    let digest = match get_rangeable_size(url).await {
+        Some(size) if size >= PARALLEL_DOWNLOAD_MIN_SIZE => {
+            debug!(
+                "Downloading {} bytes in {} parts",
+                size, PARALLEL_DOWNLOAD_PARTS
+            );
+            file.set_len(size).await?;
+            let part_size = size.div_ceil(PARALLEL_DOWNLOAD_PARTS);
+            try_join_all((0..size).step_by(part_size as usize).map(|start| {
+                download_part(url, path, Some(start..(start + part_size).min(size)), None)
+            }))
+            .await?;
+            // the parts are received out of order, so the digest is computed once they are done
+            hash_file(path).await?
+        }
+        _ => {
+            let mut hasher = Sha256::new();
+            download_part(url, path, None, Some(&mut hasher)).await?;
+            format!("{:x}", hasher.finalize())
+        }
+    };
+    debug!("Downloaded file sha256: {}", digest);
+
+    if let Some(expected_sha256) = expected_sha256 {
+        if !digest.eq_ignore_ascii_case(expected_sha256) {
+            bail!(
+                "Checksum mismatch for {}: expected {}, got {}",
+                url,
+                expected_sha256,
+                digest
+            );
+        }
+    }
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::uploader::mock_server::{download_byte, MockUploadServer};
+    use serde_json::json;
+
+    fn get_download_sha256(size: u64) -> String {
+        let mut hasher = Sha256::new();
+        hasher.update((0..size).map(download_byte).collect_vec());
+        format!("{:x}", hasher.finalize())
+    }
+
+    fn get_download_ranges(server: &MockUploadServer) -> Vec<Option<String>> {
+        server
+            .requests()
+            .iter()
+            .filter(|request| request.method == "GET")
+            .map(|request| request.headers.get("range").cloned())
+            .sorted()
+            .collect()
+    }
+
+    #[tokio::test]
+    async fn test_download_file_resumed() -> Result<()> {
+        let server = MockUploadServer::start(json!({})).await?;
+        let size = 256 * 1024;
+        let interrupt = 100 * 1024;
+        let url = server
+            .upload_url
+            .join(&format!("/download/{}?interrupt={}", size, interrupt))?;
+        let path = std::env::temp_dir().join("codspeed_test_download_resumed");
+
+        download_file(&url, &path, Some(&get_download_sha256(size))).await?;
+
+        assert_eq!(std::fs::metadata(&path)?.len(), size);
+        assert_eq!(
+            get_download_ranges(&server),
+            [None, Some(format!("bytes={}-", interrupt))]
+        );
+        std::fs::remove_file(&path)?;
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_download_file_in_parts() -> Result<()> {
+        let server = MockUploadServer::start(json!({})).await?;
+        let size = PARALLEL_DOWNLOAD_MIN_SIZE;
+        let url = server.upload_url.join(&format!("/download/{}", size))?;
+        let path = std::env::temp_dir().join("codspeed_test_download_in_parts");
+
+        download_file(&url, &path, Some(&get_download_sha256(size))).await?;
+
+        assert_eq!(std::fs::metadata(&path)?.len(), size);
+        let part_size = size / PARALLEL_DOWNLOAD_PARTS;
+        assert_eq!(
+            get_download_ranges(&server),
+            (0..PARALLEL_DOWNLOAD_PARTS)
+                .map(|i| Some(format!(
+                    "bytes={}-{}",
+                    i * part_size,
+                    (i + 1) * part_size - 1
+                )))
+                .sorted()
+                .collect_vec()
+        );
+        assert!(download_file(&url, &path, Some(&get_download_sha256(1)))
+            .await
+            .is_err());
+        std::fs::remove_file(&path)?;
+        Ok(())
+    }
+}
@@ -0,0 +1,160 @@
+use crate::prelude::*;
+use std::{fs, path::Path};
+
+const PT_LOAD: u32 = 1;
+const SHT_SYMTAB: u32 = 2;
+const SHT_DYNSYM: u32 = 11;
+const STT_FUNC: u8 = 2;
+
+fn read_u16(data: &[u8], offset: usize) -> Option<u16> {
+    Some(u16::from_le_bytes(
+        data.get(offset..offset + 2)?.try_into().ok()?,
+    ))
+}
+
+fn read_u32(data: &[u8], offset: usize) -> Option<u32> {
+    Some(u32::from_le_bytes(
+        data.get(offset..offset + 4)?.try_into().ok()?,
+    ))
+}
+
+fn read_u64(data: &[u8], offset: usize) -> Option<u64> {
+    Some(u64::from_le_bytes(
+        data.get(offset..offset + 8)?.try_into().ok()?,
+    ))
+}
+
+fn read_name(data: &[u8], offset: usize) -> Option<&str> {
+    let name = data.get(offset..)?;
+    let end = name.iter().position(|&c| c == 0)?;
+    std::str::from_utf8(&name[..end]).ok()
+}
+
+/// A loadable segment, mapping the file offsets to the virtual addresses of the symbols
+struct Segment {
+    offset: u64,
+    vaddr: u64,
+    size: u64,
+}
+
+/// The function symbols of a 64-bit little-endian ELF file, from its symbol table or, when it is
+/// stripped, its dynamic symbol table
+pub struct ElfSymbols {
+    segments: Vec<Segment>,
+    /// The start address, size and name of the functions, sorted by address
+    functions: Vec<(u64, u64, String)>,
+}
+
+impl ElfSymbols {
+    pub fn read(path: &Path) -> Result<Self> {
+        let data =
+            fs::read(path).map_err(|e| anyhow!("Failed to read: {}, {}", path.display(), e))?;
+        Self::parse(&data).ok_or_else(|| anyhow!("Invalid ELF file: {}", path.display()))
+    }
+
+    fn parse(data: &[u8]) -> Option<Self> {
+        // 64-bit, little-endian
+        if data.get(..6)? != b"\x7fELF\x02\x01" {
+            return None;
+        }
+        let program_headers_offset = read_u64(data, 0x20)? as usize;
+        let section_headers_offset = read_u64(data, 0x28)? as usize;
+        let program_header_size = read_u16(data, 0x36)? as usize;
+        let program_header_count = read_u16(data, 0x38)? as usize;
+        let section_header_size = read_u16(data, 0x3a)? as usize;
+        let section_header_count = read_u16(data, 0x3c)? as usize;
+
+        let mut segments = vec![];
+        for i in 0..program_header_count {
+            let header = program_headers_offset + i * program_header_size;
+            if read_u32(data, header)? == PT_LOAD {
+                segments.push(Segment {
+                    offset: read_u64(data, header + 8)?,
+                    vaddr: read_u64(data, header + 16)?,
+                    size: read_u64(data, header + 32)?,
+                });
+            }
+        }
+
+        let section = |index: usize| section_headers_offset + index * section_header_size;
+        let symbol_tables = (0..section_header_count)
+            .filter_map(|i| Some((i, read_u32(data, section(i) + 4)?)))
+            .filter(|(_, section_type)| [SHT_SYMTAB, SHT_DYNSYM].contains(section_type))
+            .collect_vec();
+        // the dynamic symbols are a subset of the symbol table, when it is not stripped
+        let symbol_table = symbol_tables
+            .iter()
+            .find(|(_, section_type)| *section_type == SHT_SYMTAB)
+            .or_else(|| symbol_tables.first());
+
+        let mut functions = vec![];
+        if let Some((index, _)) = symbol_table {
+            let header = section(*index);
+            let symbols_offset = read_u64(data, header + 24)? as usize;
+            let symbols_size = read_u64(data, header + 32)? as usize;
+            let symbol_size = (read_u64(data, header + 56)? as usize).max(24);
+            let names_offset = read_u64(data, section(read_u32(data, header + 40)? as usize) + 24)?;
+            for i in 0..symbols_size / symbol_size {
+                let symbol = symbols_offset + i * symbol_size;
+                let (Some(name), Some(info), Some(value), Some(size)) = (
+                    read_u32(data, symbol),
+                    data.get(symbol + 4),
+                    read_u64(data, symbol + 8),
+                    read_u64(data, symbol + 16),
+                ) else {
+                    break;
+                };
+                if info & 0xf != STT_FUNC || value == 0 {
+                    continue;
+                }
+                if let Some(name) = read_name(data, names_offset as usize + name as usize) {
+                    functions.push((value, size, name.to_string()));
+                }
+            }
+        }
+        functions.sort();
+        functions.dedup_by_key(|(value, _, _)| *value);
+        Some(Self {
+            segments,
+            functions,
+        })
+    }
+
+    /// Returns the name of the function containing the code at this offset of the file
+    pub fn lookup(&self, file_offset: u64) -> Option<&str> {
+        let segment = self.segments.iter().find(|segment| {
+            segment.offset <= file_offset && file_offset < segment.offset + segment.size
+        })?;
+        let address = file_offset - segment.offset + segment.vaddr;
+        let index = self
+            .functions
+            .partition_point(|(value, _, _)| *value <= address)
+            .checked_sub(1)?;
+        let (value, size, name) = &self.functions[index];
+        // the assembly functions may have no size
+        (*size == 0 || address < value + size).then_some(name.as_str())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_read_elf_symbols() -> Result<()> {
+        let symbols = ElfSymbols::read(&std::env::current_exe()?)?;
+        let (value, _, name) = symbols
+            .functions
+            .iter()
+            .find(|(_, _, name)| name.contains("test_read_elf_symbols"))
+            .unwrap();
+        let segment = symbols
+            .segments
+            .iter()
+            .find(|segment| segment.vaddr <= *value && *value < segment.vaddr + segment.size)
+            .unwrap();
+        let file_offset = value - segment.vaddr + segment.offset;
+        assert_eq!(symbols.lookup(file_offset + 1), Some(name.as_str()));
+        Ok(())
+    }
+}
@@ -0,0 +1,22 @@
+use std::{
+    env,
+    os::unix::fs::PermissionsExt,
+    path::{Path, PathBuf},
+};
+
+fn is_executable(path: &Path) -> bool {
+    path.metadata()
+        .is_ok_and(|metadata| metadata.is_file() && metadata.permissions().mode() & 0o111 != 0)
+}
+
+/// Find an executable in the directories of `path`, the way a shell would
+pub fn find_executable_in(name: &str, path: &str) -> Option<PathBuf> {
+    env::split_paths(path)
+        .map(|dir| dir.join(name))
+        .find(|candidate| is_executable(candidate))
+}
+
+/// Find an executable in the PATH of the runner
+pub fn find_executable(name: &str) -> Option<PathBuf> {
+    find_executable_in(name, &env::var("PATH").unwrap_or_default())
+}
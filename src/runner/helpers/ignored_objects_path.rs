@@ -1,8 +1,32 @@
 use crate::prelude::*;
-use std::process::Command;
+use std::{
+    collections::HashMap,
+    fs,
+    path::{Path, PathBuf},
+    process::Command,
+    time::UNIX_EPOCH,
+};
 
-fn get_python_objects() -> Vec<String> {
-    let output = Command::new("python")
+use super::find_executable::find_executable;
+
+const INTERPRETER_OBJECTS_CACHE_FILE: &str = "interpreter_objects.json";
+
+/// The objects of an interpreter only change with its binary, so they are cached by the canonical
+/// path, size and modification time of the binary
+fn get_interpreter_key(interpreter_path: &Path) -> Option<String> {
+    let interpreter_path = fs::canonicalize(interpreter_path).ok()?;
+    let metadata = interpreter_path.metadata().ok()?;
+    let mtime = metadata.modified().ok()?.duration_since(UNIX_EPOCH).ok()?;
+    Some(format!(
+        "{}:{}:{}",
+        interpreter_path.display(),
+        metadata.len(),
+        mtime.as_nanos()
+    ))
+}
+
+fn get_python_objects(python_path: &Path) -> Vec<String> {
+    let output = Command::new(python_path)
         .arg("-c")
         .arg("import sysconfig; print('/'.join(sysconfig.get_config_vars('LIBDIR', 'INSTSONAME')))")
         .output();
@@ -21,8 +45,8 @@ fn get_python_objects() -> Vec<String> {
     vec![so_output]
 }
 
-fn get_node_objects() -> Vec<String> {
-    let output = Command::new("node")
+fn get_node_objects(node_path: &Path) -> Vec<String> {
+    let output = Command::new(node_path)
         .arg("-e")
         .arg("console.log(process.execPath);")
         .output();
@@ -40,10 +64,112 @@ fn get_node_objects() -> Vec<String> {
     vec![so_output]
 }
 
-pub fn get_objects_path_to_ignore() -> Vec<String> {
+/// The objects of the interpreters introspected in the previous runs, by interpreter key
+struct InterpreterObjectsCache {
+    path: PathBuf,
+    entries: HashMap<String, Vec<String>>,
+    is_dirty: bool,
+}
+
+impl InterpreterObjectsCache {
+    fn load(cache_dir: &Path) -> Self {
+        let path = cache_dir.join(INTERPRETER_OBJECTS_CACHE_FILE);
+        let entries = fs::read_to_string(&path)
+            .ok()
+            .and_then(|content| serde_json::from_str(&content).ok())
+            .unwrap_or_default();
+        Self {
+            path,
+            entries,
+            is_dirty: false,
+        }
+    }
+
+    /// Returns the objects of the interpreter found in the PATH, introspecting it on a cache miss
+    fn get(&mut self, name: &str, introspect: fn(&Path) -> Vec<String>) -> Vec<String> {
+        let Some(interpreter_path) = find_executable(name) else {
+            debug!("{} not found in PATH, no shared objects to ignore", name);
+            return vec![];
+        };
+        let Some(key) = get_interpreter_key(&interpreter_path) else {
+            return introspect(&interpreter_path);
+        };
+        if let Some(objects) = self.entries.get(&key) {
+            debug!("Using the cached {} shared objects: {}", name, key);
+            return objects.clone();
+        }
+        let objects = introspect(&interpreter_path);
+        // failed introspections are not cached, so that they are retried on the next run
+        if !objects.is_empty() {
+            self.entries.insert(key, objects.clone());
+            self.is_dirty = true;
+        }
+        objects
+    }
+
+    /// Write the cache, replacing it atomically since several runners may share the directory
+    fn save(&self) -> Result<()> {
+        if !self.is_dirty {
+            return Ok(());
+        }
+        let cache_dir = self.path.parent().unwrap();
+        fs::create_dir_all(cache_dir).map_err(|e| {
+            anyhow!(
+                "Failed to create cache directory: {}, {}",
+                cache_dir.display(),
+                e
+            )
+        })?;
+        let partial_path = self
+            .path
+            .with_extension(format!("{}.partial", std::process::id()));
+        fs::write(&partial_path, serde_json::to_string(&self.entries)?).map_err(|e| {
+            anyhow!(
+                "Failed to write interpreter cache: {}, {}",
+                partial_path.display(),
+                e
+            )
+        })?;
+        fs::rename(&partial_path, &self.path).map_err(|e| {
+            anyhow!(
+                "Failed to write interpreter cache: {}, {}",
+                self.path.display(),
+                e
+            )
+        })
+    }
+}
+
+pub fn get_objects_path_to_ignore(cache_dir: &Path) -> Vec<String> {
+    let mut cache = InterpreterObjectsCache::load(cache_dir);
     let mut objects_path_to_ignore = vec![];
-    objects_path_to_ignore.extend(get_python_objects());
-    objects_path_to_ignore.extend(get_node_objects());
+    objects_path_to_ignore.extend(cache.get("python", get_python_objects));
+    objects_path_to_ignore.extend(cache.get("node", get_node_objects));
+    if let Err(e) = cache.save() {
+        debug!("{}", e);
+    }
     debug!("objects_path_to_ignore: {:?}", objects_path_to_ignore);
     objects_path_to_ignore
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_interpreter_objects_cache() {
+        let cache_dir = std::env::temp_dir().join("codspeed_test_interpreter_cache");
+        let _ = fs::remove_dir_all(&cache_dir);
+        let mut cache = InterpreterObjectsCache::load(&cache_dir);
+        let objects = cache.get("sh", |_| vec!["/lib/libsh.so".into()]);
+        assert_eq!(objects, vec!["/lib/libsh.so"]);
+        cache.save().unwrap();
+
+        let mut cache = InterpreterObjectsCache::load(&cache_dir);
+        let objects = cache.get("sh", |_| panic!("the cached objects should be used"));
+        assert_eq!(objects, vec!["/lib/libsh.so"]);
+        assert!(!cache.is_dirty);
+
+        fs::remove_dir_all(&cache_dir).unwrap();
+    }
+}
@@ -1,19 +1,280 @@
 use crate::prelude::*;
-use std::{env, fs::File, io::Write, os::unix::fs::PermissionsExt, path::PathBuf};
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::{
+    env,
+    ffi::{OsStr, OsString},
+    fs,
+    os::unix::{
+        ffi::OsStrExt,
+        process::{CommandExt, ExitStatusExt},
+    },
+    path::{Path, PathBuf},
+    process::{self, Command, ExitStatus},
+    time::UNIX_EPOCH,
+};
 
-const INTROSPECTED_NODE_SCRIPT: &str = include_str!("node.sh");
+use super::find_executable::find_executable_in;
 
-/// Creates the node script that will replace the node binary while running
-/// Returns the path to the script folder, which should be added to the PATH environment variable
+const SHIM_FOLDER_NAME: &str = "codspeed_introspected_node";
+const INTROSPECTION_PATH_ENV: &str = "__CODSPEED_NODE_CORE_INTROSPECTION_PATH__";
+/// The files rewritten by the package managers when the installed packages change
+const DEPENDENCY_STATE_FILES: [&str; 8] = [
+    "package.json",
+    "package-lock.json",
+    "yarn.lock",
+    "pnpm-lock.yaml",
+    "bun.lockb",
+    "node_modules/.package-lock.json",
+    "node_modules/.modules.yaml",
+    "node_modules/.yarn-state.yml",
+];
+/// The directory where the shim caches the introspected flags
+pub const FLAGS_CACHE_DIR_ENV: &str = "__CODSPEED_NODE_FLAGS_CACHE_DIR__";
+
+/// Creates the node shim that will replace the node binary while running, to run it with the V8
+/// flags provided by the CodSpeed integration through an introspection file. The shim is the
+/// runner binary itself, invoked through a `node` symlink.
+/// Returns the path to the shim folder, which should be added to the PATH environment variable
 pub fn setup_introspected_node() -> Result<PathBuf> {
-    let script_folder = env::temp_dir().join("codspeed_introspected_node");
-    std::fs::create_dir_all(&script_folder)?;
-    let script_path = script_folder.join("node");
-    let mut script_file = File::create(script_path)?;
-    script_file.write_all(INTROSPECTED_NODE_SCRIPT.as_bytes())?;
-    // Make the script executable
-    let mut perms = script_file.metadata()?.permissions();
-    perms.set_mode(0o755);
-    script_file.set_permissions(perms)?;
-    Ok(script_folder)
+    let shim_folder = env::temp_dir().join(SHIM_FOLDER_NAME);
+    fs::create_dir_all(&shim_folder)?;
+    // the symlink is replaced atomically since several runners may share the folder
+    let partial_link_path = shim_folder.join(format!("node.{}.partial", process::id()));
+    let _ = fs::remove_file(&partial_link_path);
+    std::os::unix::fs::symlink(env::current_exe()?, &partial_link_path)?;
+    fs::rename(&partial_link_path, shim_folder.join("node"))?;
+    Ok(shim_folder)
+}
+
+/// Whether the runner was invoked through the node shim
+pub fn is_node_shim_invocation() -> bool {
+    env::args_os()
+        .next()
+        .is_some_and(|arg0| Path::new(&arg0).file_name() == Some(OsStr::new("node")))
+}
+
+/// Run node as the node shim, and exit with its exit code.
+///
+/// The introspected flags are cached, so that node is only run twice, once to introspect the
+/// flags and once with them, the first time a command is run.
+pub fn run_node_shim() -> ! {
+    match node_shim() {
+        Ok(status) => process::exit(
+            status
+                .code()
+                .unwrap_or_else(|| 128 + status.signal().unwrap_or_default()),
+        ),
+        Err(e) => {
+            eprintln!("Error: {}", e);
+            process::exit(1);
+        }
+    }
+}
+
+fn echo_debug(message: &str) {
+    if env::var("CODSPEED_DEBUG").is_ok_and(|debug| debug == "true") {
+        println!("::debug:: {}", message);
+    }
+}
+
+#[derive(Serialize, Deserialize, Debug, PartialEq)]
+struct IntrospectionData {
+    flags: Vec<String>,
+}
+
+/// Read the flags from an introspection file, the file being empty when the introspection didn't
+/// happen
+fn read_flags(path: &Path) -> Option<Vec<String>> {
+    let content = fs::read_to_string(path).ok()?;
+    if content.trim().is_empty() {
+        return None;
+    }
+    match serde_json::from_str::<IntrospectionData>(&content) {
+        Ok(data) => Some(data.flags),
+        Err(e) => {
+            echo_debug(&format!(
+                "Invalid introspection file: {}, {}",
+                path.display(),
+                e
+            ));
+            None
+        }
+    }
+}
+
+fn write_flags(path: &Path, flags: &[String]) -> Result<()> {
+    fs::create_dir_all(path.parent().unwrap())?;
+    let partial_path = path.with_extension(format!("{}.partial", process::id()));
+    fs::write(
+        &partial_path,
+        serde_json::to_string(&IntrospectionData {
+            flags: flags.to_vec(),
+        })?,
+    )?;
+    fs::rename(&partial_path, path)?;
+    Ok(())
+}
+
+/// Retrieve the original PATH by removing the shim folder from it
+fn get_original_path(path: &str) -> String {
+    path.split(':')
+        .filter(|dir| !dir.contains(SHIM_FOLDER_NAME))
+        .join(":")
+}
+
+fn get_mtime_nanos(path: &Path) -> Option<u128> {
+    Some(
+        path.metadata()
+            .ok()?
+            .modified()
+            .ok()?
+            .duration_since(UNIX_EPOCH)
+            .ok()?
+            .as_nanos(),
+    )
+}
+
+/// Hash the state of the packages installed for the directory and its parents, the manifests,
+/// lockfiles and install markers being rewritten when the integration is installed, upgraded or
+/// removed
+fn hash_dependency_state(hasher: &mut Sha256, directory: &Path) {
+    for ancestor in directory.ancestors() {
+        for file_name in DEPENDENCY_STATE_FILES {
+            let path = ancestor.join(file_name);
+            if let Some(mtime) = get_mtime_nanos(&path) {
+                hasher.update(path.as_os_str().as_bytes());
+                hasher.update(mtime.to_le_bytes());
+            }
+        }
+    }
+}
+
+/// The flags of a command only change with the node binary, its arguments, its working directory
+/// and the packages installed for it, e.g. the version of the integration
+fn get_flags_key(real_node_path: &Path, args: &[OsString]) -> Option<String> {
+    let real_node_path = fs::canonicalize(real_node_path).ok()?;
+    let mtime = get_mtime_nanos(&real_node_path)?;
+    let current_dir = env::current_dir().ok()?;
+    let mut hasher = Sha256::new();
+    hasher.update(real_node_path.as_os_str().as_bytes());
+    hasher.update(mtime.to_le_bytes());
+    hasher.update(current_dir.as_os_str().as_bytes());
+    hash_dependency_state(&mut hasher, &current_dir);
+    for arg in args {
+        // the separator keeps `a b` and `ab` apart
+        hasher.update([0]);
+        hasher.update(arg.as_bytes());
+    }
+    Some(format!("{:x}", hasher.finalize()))
+}
+
+fn exec_node(real_node_path: &Path, flags: &[String], args: &[OsString]) -> anyhow::Error {
+    echo_debug(&format!(
+        "Running the node command: {} {} {}",
+        real_node_path.display(),
+        flags.join(" "),
+        args.iter().map(|arg| arg.to_string_lossy()).join(" ")
+    ));
+    let error = Command::new(real_node_path).args(flags).args(args).exec();
+    anyhow!("Failed to execute {}: {}", real_node_path.display(), error)
+}
+
+fn node_shim() -> Result<ExitStatus> {
+    let args = env::args_os().skip(1).collect_vec();
+    // to avoid setting the variable for the children processes, remove it before running node
+    env::remove_var(INTROSPECTION_PATH_ENV);
+
+    let original_path = get_original_path(&env::var("PATH").unwrap_or_default());
+    let real_node_path = find_executable_in("node", &original_path).ok_or_else(|| {
+        anyhow!("node not found in PATH. There might be a problem with the node installation.")
+    })?;
+
+    let flags_cache_path = env::var_os(FLAGS_CACHE_DIR_ENV)
+        .zip(get_flags_key(&real_node_path, &args))
+        .map(|(cache_dir, key)| PathBuf::from(cache_dir).join(format!("{}.json", key)));
+    if let Some(flags) = flags_cache_path.as_deref().and_then(read_flags) {
+        echo_debug(&format!(
+            "V8 flags read from the cache: {}",
+            flags.join(" ")
+        ));
+        return Err(exec_node(&real_node_path, &flags, &args));
+    }
+
+    let introspection_path = env::temp_dir().join(format!(
+        "codspeed_node_introspection.{}.json",
+        process::id()
+    ));
+    let _ = fs::remove_file(&introspection_path);
+    echo_debug(&format!(
+        "Introspection file: {}",
+        introspection_path.display()
+    ));
+    let status = Command::new(&real_node_path)
+        .args(&args)
+        .env(INTROSPECTION_PATH_ENV, &introspection_path)
+        .status()
+        .map_err(|e| anyhow!("Failed to execute {}: {}", real_node_path.display(), e))?;
+    let flags = read_flags(&introspection_path);
+    let _ = fs::remove_file(&introspection_path);
+
+    // without introspection, the benchmarks already ran with the first command
+    let Some(flags) = flags.filter(|_| status.success()) else {
+        echo_debug("No introspection detected (no introspection file found)");
+        return Ok(status);
+    };
+    echo_debug(&format!(
+        "V8 flags harvested from introspection: {}",
+        flags.join(" ")
+    ));
+    if let Some(flags_cache_path) = &flags_cache_path {
+        if let Err(e) = write_flags(flags_cache_path, &flags) {
+            echo_debug(&format!("Failed to cache the V8 flags: {}", e));
+        }
+    }
+    Err(exec_node(&real_node_path, &flags, &args))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_get_original_path() {
+        assert_eq!(
+            get_original_path("/tmp/codspeed_introspected_node:/usr/local/bin:/usr/bin"),
+            "/usr/local/bin:/usr/bin"
+        );
+    }
+
+    #[test]
+    fn test_flags_cache() {
+        let cache_path = env::temp_dir().join("codspeed_test_node_flags/flags.json");
+        let flags = vec!["--hash-seed=1".to_string(), "--predictable".into()];
+        write_flags(&cache_path, &flags).unwrap();
+        assert_eq!(read_flags(&cache_path), Some(flags));
+        fs::write(&cache_path, "").unwrap();
+        assert_eq!(read_flags(&cache_path), None);
+        fs::remove_dir_all(cache_path.parent().unwrap()).unwrap();
+    }
+
+    #[test]
+    fn test_hash_dependency_state() {
+        let project_dir = env::temp_dir().join("codspeed_test_node_dependencies/packages/bench");
+        fs::create_dir_all(&project_dir).unwrap();
+        let get_digest = || {
+            let mut hasher = Sha256::new();
+            hash_dependency_state(&mut hasher, &project_dir);
+            format!("{:x}", hasher.finalize())
+        };
+        let initial_digest = get_digest();
+        // the lockfile of a workspace is at its root
+        fs::write(
+            project_dir.join("../../package-lock.json"),
+            r#"{"packages":{}}"#,
+        )
+        .unwrap();
+        assert_ne!(get_digest(), initial_digest);
+        fs::remove_dir_all(env::temp_dir().join("codspeed_test_node_dependencies")).unwrap();
+    }
 }
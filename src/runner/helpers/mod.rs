@@ -1,4 +1,8 @@
+pub mod cache_dir;
+pub mod cache_geometry;
 pub mod download_file;
+pub mod elf_symbols;
+pub mod find_executable;
 pub mod ignored_objects_path;
 pub mod introspected_node;
 pub mod perf_maps;
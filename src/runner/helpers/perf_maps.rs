@@ -1,44 +1,61 @@
 use crate::prelude::*;
-use lazy_static::lazy_static;
-use regex::Regex;
-use std::collections::HashSet;
-use std::fs;
-use std::path::Path;
+use std::collections::{HashMap, HashSet};
+use std::fs::{self, File};
+use std::io::{self, BufRead, BufReader, BufWriter, Write};
+use std::os::fd::AsRawFd;
+use std::path::{Path, PathBuf};
 
-lazy_static! {
-    static ref PERF_MAP_REGEX: Regex = Regex::new(r"perf-(\d+)\.map").unwrap();
+/// The directory where the JIT runtimes write their perf maps
+const PERF_MAP_DIR: &str = "/tmp";
+/// The folder of the profile folder holding the compacted perf maps
+const COMPACT_PERF_MAPS_DIR: &str = "perf-maps";
+/// Shares the extents of a file with another file of the same filesystem
+const FICLONE: u64 = 0x40049409;
+
+fn reflink(source_path: &Path, dest_path: &Path) -> io::Result<()> {
+    let source = File::open(source_path)?;
+    let dest = File::create(dest_path)?;
+    // SAFETY: both file descriptors are valid for the duration of the call
+    if unsafe { libc::ioctl(dest.as_raw_fd(), FICLONE as _, source.as_raw_fd()) } < 0 {
+        let error = io::Error::last_os_error();
+        let _ = fs::remove_file(dest_path);
+        return Err(error);
+    }
+    Ok(())
 }
 
-pub fn harvest_perf_maps(profile_folder: &Path) -> Result<()> {
-    // Get profile files (files with .out extension)
-    let profile_files = fs::read_dir(profile_folder)?
+/// Link the perf map into the profile folder without copying its content when possible: hard
+/// links need the same filesystem and may be denied by `fs.protected_hardlinks` for the files of
+/// other users, reflinks need a filesystem supporting them, and the file is copied otherwise
+fn link_perf_map(source_path: &Path, dest_path: &Path) -> io::Result<()> {
+    match fs::hard_link(source_path, dest_path) {
+        Ok(()) => return Ok(()),
+        Err(e) => debug!("Failed to hard link {}: {}", source_path.display(), e),
+    }
+    match reflink(source_path, dest_path) {
+        Ok(()) => return Ok(()),
+        Err(e) => debug!("Failed to reflink {}: {}", source_path.display(), e),
+    }
+    fs::copy(source_path, dest_path).map(|_| ())
+}
+
+pub fn harvest_perf_maps_from(perf_map_dir: &Path, profile_folder: &Path) -> Result<()> {
+    // Get the pids of the profile files (files with .out extension)
+    let pids = fs::read_dir(profile_folder)?
         .filter_map(|entry| entry.ok())
         .map(|entry| entry.path())
         .filter(|path| path.extension().unwrap_or_default() == "out")
-        .collect_vec();
-
-    let pids = profile_files
-        .iter()
-        .filter_map(|path| path.file_stem())
-        .map(|pid| pid.to_str().unwrap())
+        .filter_map(|path| path.file_stem()?.to_str().map(|pid| pid.to_string()))
         .collect::<HashSet<_>>();
 
-    let perf_map_files = fs::read_dir("/tmp")?
-        .filter_map(|entry| entry.ok())
-        .map(|entry| entry.path())
-        .filter(|path| {
-            path.file_name()
-                .and_then(|name| name.to_str())
-                .and_then(|name| PERF_MAP_REGEX.captures(name))
-                .and_then(|captures| captures.get(1))
-                .map(|pid| pids.contains(pid.as_str()))
-                .unwrap_or(false)
-        });
-
-    for perf_map_file in perf_map_files {
-        let source_path = perf_map_file.clone();
-        let dest_path = profile_folder.join(perf_map_file.file_name().unwrap());
-        fs::copy(source_path, dest_path).map_err(|e| {
+    // the maps are looked up by pid, since the perf map directory may hold many other files
+    for pid in pids {
+        let perf_map_name = format!("perf-{}.map", pid);
+        let perf_map_file = perf_map_dir.join(&perf_map_name);
+        if !perf_map_file.is_file() {
+            continue;
+        }
+        link_perf_map(&perf_map_file, &profile_folder.join(&perf_map_name)).map_err(|e| {
             anyhow!(
                 "Failed to copy perf map file: {} to {}: {}",
                 perf_map_file.display(),
@@ -50,3 +67,205 @@ pub fn harvest_perf_maps(profile_folder: &Path) -> Result<()> {
 
     Ok(())
 }
+
+pub fn harvest_perf_maps(profile_folder: &Path) -> Result<()> {
+    harvest_perf_maps_from(Path::new(PERF_MAP_DIR), profile_folder)
+}
+
+/// A symbol of a perf map: the start address and size of the jitted code, and its name
+pub type PerfMapSymbol = (u64, u64, String);
+
+fn parse_perf_map_line(line: &str) -> Option<PerfMapSymbol> {
+    let mut parts = line.splitn(3, ' ');
+    let parse_hex = |value: &str| u64::from_str_radix(value.trim_start_matches("0x"), 16).ok();
+    let start = parse_hex(parts.next()?)?;
+    let size = parse_hex(parts.next()?)?;
+    Some((start, size, parts.next()?.to_string()))
+}
+
+fn read_perf_map(path: &Path) -> Result<Vec<PerfMapSymbol>> {
+    let file = File::open(path)
+        .map_err(|e| anyhow!("Failed to read perf map: {}, {}", path.display(), e))?;
+    let mut symbols = vec![];
+    for line in BufReader::new(file).lines() {
+        let line = line?;
+        match parse_perf_map_line(&line) {
+            Some(symbol) => symbols.push(symbol),
+            None => debug!("Invalid perf map line in {}: {}", path.display(), line),
+        }
+    }
+    Ok(symbols)
+}
+
+/// Returns the symbols written by the process to its perf map, sorted by address, if any
+pub fn read_process_perf_map(pid: u32) -> Vec<PerfMapSymbol> {
+    let perf_map_file = Path::new(PERF_MAP_DIR).join(format!("perf-{}.map", pid));
+    if !perf_map_file.is_file() {
+        return vec![];
+    }
+    let mut symbols = read_perf_map(&perf_map_file).unwrap_or_else(|e| {
+        debug!("{}", e);
+        vec![]
+    });
+    symbols.sort();
+    symbols
+}
+
+/// Format sorted indices as ranges, e.g. `0-2,5` for `[0, 1, 2, 5]`
+fn format_index_ranges(sorted_indices: &[usize]) -> String {
+    let mut ranges: Vec<(usize, usize)> = vec![];
+    for &index in sorted_indices {
+        match ranges.last_mut() {
+            Some((_, end)) if *end + 1 == index => *end = index,
+            _ => ranges.push((index, index)),
+        }
+    }
+    ranges
+        .iter()
+        .map(|(start, end)| {
+            if start == end {
+                start.to_string()
+            } else {
+                format!("{}-{}", start, end)
+            }
+        })
+        .join(",")
+}
+
+/// Deduplicate the symbols of the harvested perf maps, the processes forked from the same
+/// interpreter writing nearly identical maps.
+///
+/// The symbols of all the maps are written to `perf-maps/symbols.map`, a perf map sorted by
+/// address, and each `perf-<pid>.map` is replaced by `perf-maps/<pid>.idx`, the ranges of the
+/// indices of its symbols in the shared table.
+pub fn compact_perf_maps(profile_folder: &Path) -> Result<()> {
+    let perf_maps: Vec<(String, PathBuf)> = fs::read_dir(profile_folder)?
+        .filter_map(|entry| entry.ok())
+        .map(|entry| entry.path())
+        .filter_map(|path| {
+            let name = path.file_name()?.to_str()?;
+            let pid = name.strip_prefix("perf-")?.strip_suffix(".map")?;
+            pid.chars()
+                .all(|c| c.is_ascii_digit())
+                .then(|| (pid.to_string(), path.clone()))
+        })
+        .collect();
+    if perf_maps.is_empty() {
+        return Ok(());
+    }
+
+    // each map is read once, since the runtimes of the harvested maps may still append to them:
+    // only the deduplicated symbols and the ids of the symbols of each map are kept in memory
+    let mut symbol_ids: HashMap<PerfMapSymbol, usize> = HashMap::new();
+    let mut map_symbol_ids = Vec::with_capacity(perf_maps.len());
+    let mut symbol_count = 0;
+    for (_, path) in &perf_maps {
+        let map_symbols = read_perf_map(path)?;
+        symbol_count += map_symbols.len();
+        let ids = map_symbols
+            .into_iter()
+            .map(|symbol| {
+                let next_id = symbol_ids.len();
+                *symbol_ids.entry(symbol).or_insert(next_id)
+            })
+            .collect_vec();
+        map_symbol_ids.push(ids);
+    }
+    // the table is sorted by address, the ids being mapped to the indices in the table
+    let mut symbols = symbol_ids.into_iter().collect_vec();
+    symbols.sort_unstable();
+    let mut symbol_indices = vec![0; symbols.len()];
+    for (index, (_, id)) in symbols.iter().enumerate() {
+        symbol_indices[*id] = index;
+    }
+
+    let compact_dir = profile_folder.join(COMPACT_PERF_MAPS_DIR);
+    fs::create_dir_all(&compact_dir)
+        .map_err(|e| anyhow!("Failed to create folder: {}, {}", compact_dir.display(), e))?;
+    let symbols_path = compact_dir.join("symbols.map");
+    let mut symbols_file = BufWriter::new(
+        File::create(&symbols_path)
+            .map_err(|e| anyhow!("Failed to create file: {}, {}", symbols_path.display(), e))?,
+    );
+    for ((start, size, name), _) in &symbols {
+        writeln!(symbols_file, "{:x} {:x} {}", start, size, name)?;
+    }
+    symbols_file.flush()?;
+
+    for ((pid, path), ids) in perf_maps.iter().zip(map_symbol_ids) {
+        let indices = ids
+            .into_iter()
+            .map(|id| symbol_indices[id])
+            .sorted_unstable()
+            .dedup()
+            .collect_vec();
+        let index_path = compact_dir.join(format!("{}.idx", pid));
+        fs::write(&index_path, format_index_ranges(&indices))
+            .map_err(|e| anyhow!("Failed to write file: {}, {}", index_path.display(), e))?;
+        fs::remove_file(path)?;
+    }
+    info!(
+        "Compacted {} perf maps: {} symbols deduplicated into {}",
+        perf_maps.len(),
+        symbol_count,
+        symbols.len()
+    );
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_harvest_perf_maps() -> Result<()> {
+        let test_dir = std::env::temp_dir().join("codspeed_test_perf_maps");
+        let _ = fs::remove_dir_all(&test_dir);
+        let (perf_map_dir, profile_folder) = (test_dir.join("tmp"), test_dir.join("profile"));
+        fs::create_dir_all(&perf_map_dir)?;
+        fs::create_dir_all(&profile_folder)?;
+        fs::write(profile_folder.join("42.out"), "")?;
+        fs::write(perf_map_dir.join("perf-42.map"), "1000 10 jitted")?;
+        fs::write(perf_map_dir.join("perf-43.map"), "2000 10 other")?;
+
+        harvest_perf_maps_from(&perf_map_dir, &profile_folder)?;
+
+        assert_eq!(
+            fs::read_to_string(profile_folder.join("perf-42.map"))?,
+            "1000 10 jitted"
+        );
+        assert!(!profile_folder.join("perf-43.map").exists());
+        fs::remove_dir_all(&test_dir)?;
+        Ok(())
+    }
+
+    #[test]
+    fn test_compact_perf_maps() -> Result<()> {
+        let profile_folder = std::env::temp_dir().join("codspeed_test_compact_perf_maps");
+        let _ = fs::remove_dir_all(&profile_folder);
+        fs::create_dir_all(&profile_folder)?;
+        fs::write(
+            profile_folder.join("perf-1.map"),
+            "2000 10 LazyCompile:~run bench.js:1\n1000 20 Builtin:ArgumentsAdaptorTrampoline\n",
+        )?;
+        fs::write(
+            profile_folder.join("perf-2.map"),
+            "1000 20 Builtin:ArgumentsAdaptorTrampoline\n3000 10 LazyCompile:~fib bench.js:4\n",
+        )?;
+
+        compact_perf_maps(&profile_folder)?;
+
+        let compact_dir = profile_folder.join(COMPACT_PERF_MAPS_DIR);
+        assert_eq!(
+            fs::read_to_string(compact_dir.join("symbols.map"))?,
+            "1000 20 Builtin:ArgumentsAdaptorTrampoline\n\
+             2000 10 LazyCompile:~run bench.js:1\n\
+             3000 10 LazyCompile:~fib bench.js:4\n"
+        );
+        assert_eq!(fs::read_to_string(compact_dir.join("1.idx"))?, "0-1");
+        assert_eq!(fs::read_to_string(compact_dir.join("2.idx"))?, "0,2");
+        assert!(!profile_folder.join("perf-1.map").exists());
+        fs::remove_dir_all(&profile_folder)?;
+        Ok(())
+    }
+}
@@ -3,15 +3,56 @@ use crate::prelude::*;
 use rand::distributions::Alphanumeric;
 use rand::distributions::DistString;
 use std::env;
+use std::ffi::CString;
 use std::fs;
-use std::path::PathBuf;
+use std::os::unix::ffi::OsStrExt;
+use std::path::{Path, PathBuf};
 
-pub fn create_profile_folder() -> Result<PathBuf> {
+const SHM_DIR: &str = "/dev/shm";
+/// The room left on the shared memory filesystem for the profile folder to be created there. Its
+/// files are held in memory, so it is only used on machines where the profiles cannot compete
+/// with the benchmarks for the memory
+const MIN_SHM_AVAILABLE_BYTES: u64 = 16 * 1024 * 1024 * 1024;
+
+/// Returns the space available to unprivileged users on the filesystem of the path
+fn get_available_bytes(path: &Path) -> Option<u64> {
+    let path = CString::new(path.as_os_str().as_bytes()).ok()?;
+    // SAFETY: the path is a valid C string and statvfs only writes the returned struct
+    let mut stats: libc::statvfs = unsafe { std::mem::zeroed() };
+    if unsafe { libc::statvfs(path.as_ptr(), &mut stats) } < 0 {
+        return None;
+    }
+    Some(stats.f_bavail * stats.f_frsize)
+}
+
+/// Returns the directory of the profile folder: the given one, else the shared memory
+/// filesystem when it has enough room, callgrind writing and the archive reading back every
+/// profile, else the temporary directory. A TMPDIR set explicitly is always used.
+fn get_profile_root(profile_dir: Option<&Path>) -> PathBuf {
+    if let Some(profile_dir) = profile_dir {
+        return profile_dir.to_path_buf();
+    }
+    if env::var_os("TMPDIR").is_none() {
+        let shm_dir = Path::new(SHM_DIR);
+        if let Some(available_bytes) = get_available_bytes(shm_dir) {
+            if available_bytes >= MIN_SHM_AVAILABLE_BYTES {
+                return shm_dir.to_path_buf();
+            }
+            debug!(
+                "Not enough room on {} for the profile folder: {} bytes available",
+                SHM_DIR, available_bytes
+            );
+        }
+    }
+    env::temp_dir()
+}
+
+pub fn create_profile_folder(profile_dir: Option<&Path>) -> Result<PathBuf> {
     let folder_name = format!(
         "profile.{}.out",
         Alphanumeric.sample_string(&mut rand::thread_rng(), 10)
     );
-    let mut folder_path = env::temp_dir();
+    let mut folder_path = get_profile_root(profile_dir);
     folder_path.push(folder_name);
     fs::create_dir_all(&folder_path).map_err(|e| {
         anyhow!(
@@ -24,15 +65,39 @@ pub fn create_profile_folder() -> Result<PathBuf> {
     Ok(folder_path)
 }
 
+/// Remove the profile folder once its profiles are uploaded, the shared memory filesystem
+/// holding them in memory until the machine reboots otherwise
+pub fn remove_profile_folder(profile_folder: &Path) -> Result<()> {
+    fs::remove_dir_all(profile_folder).map_err(|e| {
+        anyhow!(
+            "Failed to remove profile folder: {}, {}",
+            profile_folder.display(),
+            e
+        )
+    })?;
+    debug!("Removed profile folder: {}", profile_folder.display());
+    Ok(())
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
 
     #[test]
     fn test_create_profile_folder() -> Result<()> {
-        let folder_path = create_profile_folder()?;
+        let folder_path = create_profile_folder(None)?;
         assert!(folder_path.exists());
         assert!(folder_path.is_dir());
         Ok(())
     }
+
+    #[test]
+    fn test_create_profile_folder_in_profile_dir() -> Result<()> {
+        let profile_dir = env::temp_dir().join("codspeed_test_profile_dir");
+        let folder_path = create_profile_folder(Some(&profile_dir))?;
+        assert_eq!(folder_path.parent(), Some(profile_dir.as_path()));
+        assert!(folder_path.is_dir());
+        fs::remove_dir_all(&profile_dir)?;
+        Ok(())
+    }
 }
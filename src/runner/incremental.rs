@@ -0,0 +1,187 @@
+use crate::{config::Config, prelude::*};
+use serde::Deserialize;
+use std::{fs, path::Path, process::Command};
+
+use super::valgrind::{get_bench_shards, normalize_bench_command};
+
+/// Maps the lines of the bench command to the source paths their benchmarks depend on
+#[derive(Deserialize, Debug)]
+#[serde(rename_all = "camelCase")]
+struct BenchmarkManifest {
+    benchmarks: Vec<ManifestBenchmark>,
+    /// Path prefixes no benchmark depends on, e.g. the documentation
+    #[serde(default)]
+    ignored_paths: Vec<String>,
+}
+
+#[derive(Deserialize, Debug)]
+struct ManifestBenchmark {
+    /// A line of the bench command
+    command: String,
+    /// Path prefixes relative to the root of the repository
+    paths: Vec<String>,
+}
+
+fn read_manifest(manifest_path: &Path) -> Result<BenchmarkManifest> {
+    let manifest = fs::read_to_string(manifest_path).map_err(|e| {
+        anyhow!(
+            "Failed to read benchmark manifest: {}, {}",
+            manifest_path.display(),
+            e
+        )
+    })?;
+    serde_json::from_str(&manifest).map_err(|e| {
+        anyhow!(
+            "Failed to parse benchmark manifest: {}, {}",
+            manifest_path.display(),
+            e
+        )
+    })
+}
+
+/// Returns the files changed between the base branch and HEAD, relative to the repository root
+fn get_changed_files(config: &Config, base_ref: &str) -> Result<Vec<String>> {
+    let mut cmd = Command::new("git");
+    cmd.args(["diff", "--name-only"])
+        .arg(format!("origin/{}...HEAD", base_ref));
+    if let Some(cwd) = &config.working_directory {
+        cmd.current_dir(cwd);
+    }
+    let output = cmd
+        .output()
+        .map_err(|e| anyhow!("Failed to execute git diff: {}", e))?;
+    if !output.status.success() {
+        bail!(
+            "Failed to list the changes since {}: {}",
+            base_ref,
+            String::from_utf8_lossy(&output.stderr).trim()
+        );
+    }
+    Ok(String::from_utf8_lossy(&output.stdout)
+        .lines()
+        .map(|line| line.to_string())
+        .collect())
+}
+
+/// Returns whether the file is the path or in the directory of the path, e.g. `crates/parser`
+/// holding `crates/parser/src/lib.rs` but not `crates/parser-macros/src/lib.rs`
+fn is_in_path(file: &str, path: &str) -> bool {
+    let path = path.trim_end_matches('/');
+    path.is_empty()
+        || file
+            .strip_prefix(path)
+            .is_some_and(|rest| rest.is_empty() || rest.starts_with('/'))
+}
+
+/// Returns the lines of the bench command not affected by the changed files.
+///
+/// Lines missing from the manifest are never skipped, and nothing is skipped when a changed file
+/// is in none of the paths of the manifest, e.g. a lockfile or a build script shared by all the
+/// benchmarks.
+fn get_unaffected_lines(
+    lines: Vec<String>,
+    manifest: &BenchmarkManifest,
+    changed_files: &[String],
+) -> Vec<String> {
+    let unlisted_file = changed_files.iter().find(|changed_file| {
+        !manifest
+            .benchmarks
+            .iter()
+            .flat_map(|benchmark| &benchmark.paths)
+            .chain(&manifest.ignored_paths)
+            .any(|path| is_in_path(changed_file, path))
+    });
+    if let Some(unlisted_file) = unlisted_file {
+        info!(
+            "{} is not in the benchmark manifest, running all the benchmarks",
+            unlisted_file
+        );
+        return vec![];
+    }
+    lines
+        .into_iter()
+        .filter(|line| {
+            manifest
+                .benchmarks
+                .iter()
+                .find(|benchmark| normalize_bench_command(benchmark.command.trim()) == *line)
+                .is_some_and(|benchmark| {
+                    !benchmark.paths.iter().any(|path| {
+                        changed_files
+                            .iter()
+                            .any(|changed_file| is_in_path(changed_file, path))
+                    })
+                })
+        })
+        .collect()
+}
+
+/// Returns the lines of the bench command that can be skipped because none of the source paths
+/// they depend on changed since the base branch. Their results are reused from the base commit.
+///
+/// Everything is run when the changes cannot be listed.
+pub fn get_skipped_bench_lines(config: &Config, base_ref: Option<&str>) -> Result<Vec<String>> {
+    let Some(manifest_path) = &config.benchmark_manifest else {
+        return Ok(vec![]);
+    };
+    let Some(base_ref) = base_ref else {
+        debug!("Not running on a pull request, running all the benchmarks");
+        return Ok(vec![]);
+    };
+    let manifest = read_manifest(manifest_path)?;
+    let changed_files = match get_changed_files(config, base_ref) {
+        Ok(changed_files) => changed_files,
+        Err(e) => {
+            warn!("{}, running all the benchmarks", e);
+            return Ok(vec![]);
+        }
+    };
+    debug!("Changed files: {:#?}", changed_files);
+
+    let skipped_lines = get_unaffected_lines(get_bench_shards(config), &manifest, &changed_files);
+    for line in &skipped_lines {
+        info!("Skipping unaffected benchmarks: {}", line);
+    }
+    Ok(skipped_lines)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_get_unaffected_lines() {
+        let manifest: BenchmarkManifest = serde_json::from_str(
+            r#"{
+                "benchmarks": [
+                    { "command": "cargo codspeed bench -p parser", "paths": ["crates/parser/"] },
+                    { "command": "pytest tests/ --codspeed", "paths": ["python", "crates/bindings/"] }
+                ],
+                "ignoredPaths": ["docs/", "README.md"]
+            }"#,
+        )
+        .unwrap();
+        let lines = vec![
+            "cargo-codspeed bench -p parser".to_string(),
+            "pytest tests/ --codspeed".into(),
+            "pnpm vitest bench".into(),
+        ];
+
+        assert_eq!(
+            get_unaffected_lines(
+                lines.clone(),
+                &manifest,
+                &["crates/bindings/src/lib.rs".into(), "README.md".into()]
+            ),
+            vec!["cargo-codspeed bench -p parser"]
+        );
+        // the paths are matched on their components
+        assert!(is_in_path("python/setup.py", "python"));
+        assert!(is_in_path("crates/parser/src/lib.rs", "crates/parser/"));
+        assert!(!is_in_path(
+            "crates/parser-macros/src/lib.rs",
+            "crates/parser"
+        ));
+        assert!(get_unaffected_lines(lines, &manifest, &["Cargo.lock".into()]).is_empty());
+    }
+}
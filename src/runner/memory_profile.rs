@@ -0,0 +1,145 @@
+use crate::prelude::*;
+use serde::{Deserialize, Serialize};
+use std::{fs, path::Path};
+
+pub const DHAT_PROFILE_EXTENSION: &str = "dhat.json";
+const MEMORY_PROFILE_FILE: &str = "memory-profile.json";
+
+/// An allocation site of a DHAT profile
+#[derive(Deserialize)]
+struct DhatProgramPoint {
+    /// The bytes and blocks allocated at the site
+    tb: u64,
+    tbk: u64,
+    /// The bytes and blocks live at the global heap peak
+    #[serde(default)]
+    gb: u64,
+    #[serde(default)]
+    gbk: u64,
+    /// The bytes live at the exit of the process
+    #[serde(default)]
+    eb: u64,
+}
+
+/// The fields of the DHAT profiles used by the memory profile
+#[derive(Deserialize)]
+struct DhatProfile {
+    cmd: String,
+    pid: u32,
+    pps: Vec<DhatProgramPoint>,
+}
+
+/// The heap usage of a benchmark process
+#[derive(Serialize, Debug, PartialEq)]
+#[serde(rename_all = "camelCase")]
+pub struct ProcessMemoryProfile {
+    pub pid: u32,
+    pub command: String,
+    pub allocations: u64,
+    pub allocated_bytes: u64,
+    pub peak_heap_bytes: u64,
+    pub peak_heap_blocks: u64,
+    pub leaked_bytes: u64,
+}
+
+fn summarize_dhat_profile(content: &str) -> Result<ProcessMemoryProfile> {
+    let profile: DhatProfile = serde_json::from_str(content)?;
+    Ok(ProcessMemoryProfile {
+        pid: profile.pid,
+        command: profile.cmd,
+        allocations: profile.pps.iter().map(|pp| pp.tbk).sum(),
+        allocated_bytes: profile.pps.iter().map(|pp| pp.tb).sum(),
+        peak_heap_bytes: profile.pps.iter().map(|pp| pp.gb).sum(),
+        peak_heap_blocks: profile.pps.iter().map(|pp| pp.gbk).sum(),
+        leaked_bytes: profile.pps.iter().map(|pp| pp.eb).sum(),
+    })
+}
+
+/// Summarize the `<pid>.dhat.json` heap profiles of the benchmark processes in
+/// `memory-profile.json`, the allocation counts and the peak heap of each process. The DHAT
+/// profiles are kept for the allocation sites.
+pub fn write_memory_profile(profile_folder: &Path) -> Result<()> {
+    let dhat_profile_paths = fs::read_dir(profile_folder)?
+        .filter_map(|entry| entry.ok())
+        .map(|entry| entry.path())
+        .filter(|path| {
+            path.file_name()
+                .and_then(|name| name.to_str())
+                .is_some_and(|name| name.ends_with(&format!(".{}", DHAT_PROFILE_EXTENSION)))
+        })
+        .sorted()
+        .collect_vec();
+    let mut process_profiles = vec![];
+    for path in &dhat_profile_paths {
+        let content = fs::read_to_string(path)
+            .map_err(|e| anyhow!("Failed to read heap profile: {}, {}", path.display(), e))?;
+        process_profiles.push(
+            summarize_dhat_profile(&content)
+                .map_err(|e| anyhow!("Failed to parse heap profile: {}, {}", path.display(), e))?,
+        );
+    }
+    if process_profiles.is_empty() {
+        warn!("No heap profile was written by the benchmarks");
+        return Ok(());
+    }
+    for process_profile in &process_profiles {
+        debug!("Heap profile: {:?}", process_profile);
+    }
+    info!(
+        "Profiled the heap of {} processes: {} allocations, {} bytes allocated",
+        process_profiles.len(),
+        process_profiles
+            .iter()
+            .map(|profile| profile.allocations)
+            .sum::<u64>(),
+        process_profiles
+            .iter()
+            .map(|profile| profile.allocated_bytes)
+            .sum::<u64>()
+    );
+
+    let memory_profile_path = profile_folder.join(MEMORY_PROFILE_FILE);
+    fs::write(
+        &memory_profile_path,
+        serde_json::to_string_pretty(&process_profiles)?,
+    )
+    .map_err(|e| {
+        anyhow!(
+            "Failed to write memory profile: {}, {}",
+            memory_profile_path.display(),
+            e
+        )
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const DHAT_PROFILE: &str = r#"{
+"dhatFileVersion":2,"mode":"heap","verb":"Allocated","bklt":true,"bkacc":true,
+"tu":"instrs","Mtu":"instr","tuth":500,
+"cmd":"python bench.py","pid":4242,"te":1000,"tg":800,
+"pps":[
+ {"tb":1024,"tbk":4,"tl":100,"mb":1024,"mbk":4,"gb":512,"gbk":2,"eb":0,"ebk":0,"rb":10,"wb":10,"fs":[1]},
+ {"tb":64,"tbk":1,"tl":10,"mb":64,"mbk":1,"gb":64,"gbk":1,"eb":64,"ebk":1,"rb":0,"wb":0,"fs":[2]}
+],
+"ftbl":["[root]","0x1: malloc","0x2: calloc"]
+}"#;
+
+    #[test]
+    fn test_summarize_dhat_profile() {
+        assert_eq!(
+            summarize_dhat_profile(DHAT_PROFILE).unwrap(),
+            ProcessMemoryProfile {
+                pid: 4242,
+                command: "python bench.py".into(),
+                allocations: 5,
+                allocated_bytes: 1088,
+                peak_heap_bytes: 576,
+                peak_heap_blocks: 3,
+                leaked_bytes: 64,
+            }
+        );
+    }
+}
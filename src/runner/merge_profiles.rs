@@ -0,0 +1,514 @@
+use crate::prelude::*;
+use serde::Serialize;
+use std::{
+    collections::{BTreeSet, HashMap},
+    fs::{self, File},
+    io::{BufWriter, Write},
+    path::{Path, PathBuf},
+    thread,
+};
+
+const MERGED_PROFILE_FILE: &str = "profiles.merged.json";
+const MERGED_PROFILE_VERSION: u32 = 1;
+
+/// Identifies a cost record of a profile: a position in a function, or a call from it
+#[derive(Hash, PartialEq, Eq, PartialOrd, Ord, Clone, Debug)]
+pub(super) struct RecordKey<S> {
+    object: S,
+    file: S,
+    function: S,
+    /// The object, file and function called, for the inclusive costs of a call
+    pub(super) callee: Option<(S, S, S)>,
+    positions: Vec<u64>,
+}
+
+#[derive(Default, Debug, PartialEq)]
+pub(super) struct RecordCosts {
+    calls: u64,
+    pub(super) costs: Vec<u64>,
+}
+
+impl RecordCosts {
+    fn add(&mut self, calls: u64, costs: &[u64]) {
+        self.calls += calls;
+        if self.costs.len() < costs.len() {
+            self.costs.resize(costs.len(), 0);
+        }
+        for (total, cost) in self.costs.iter_mut().zip(costs) {
+            *total += cost;
+        }
+    }
+}
+
+pub(super) type Records<S> = HashMap<RecordKey<S>, RecordCosts>;
+
+/// The parts of a callgrind profile, with the trigger of their dump
+pub(super) struct ParsedProfile {
+    pub(super) pid: u32,
+    pub(super) events: Vec<String>,
+    pub(super) parts: Vec<(String, Records<String>)>,
+}
+
+/// The context set by the specification lines, e.g. `fn=`, applying to the following cost lines
+#[derive(Default)]
+struct ParserContext {
+    object: String,
+    file: String,
+    /// The file of the inlined code, set by `fi=` and `fe=`
+    inline_file: Option<String>,
+    function: String,
+    callee_object: Option<String>,
+    callee_file: Option<String>,
+    callee_function: Option<String>,
+    /// The call count of a `calls=` line, whose inclusive costs are on the next line
+    pending_calls: Option<u64>,
+    positions: Vec<u64>,
+}
+
+/// Resolve the compressed names, `(id) name` defining the name of the id and `(id)` referring to it
+fn resolve_name(names: &mut HashMap<String, String>, value: &str) -> String {
+    let value = value.trim();
+    let Some((id, name)) = value
+        .strip_prefix('(')
+        .and_then(|value| value.split_once(')'))
+    else {
+        return value.to_string();
+    };
+    let name = name.trim();
+    if name.is_empty() {
+        names.get(id).cloned().unwrap_or_default()
+    } else {
+        names.insert(id.to_string(), name.to_string());
+        name.to_string()
+    }
+}
+
+/// Parse a position, relative to the previous one when starting with `+`, `-` or `*`
+fn parse_position(field: &str, previous: u64) -> Result<u64> {
+    let parse = |value: &str| match value.strip_prefix("0x") {
+        Some(hex) => u64::from_str_radix(hex, 16),
+        None => value.parse(),
+    };
+    Ok(match field.as_bytes()[0] {
+        b'*' => previous,
+        b'+' => previous + parse(&field[1..])?,
+        b'-' => previous.saturating_sub(parse(&field[1..])?),
+        _ => parse(field)?,
+    })
+}
+
+pub(super) fn parse_profile_content(pid: u32, content: &str) -> Result<ParsedProfile> {
+    let mut events = vec![];
+    let mut position_count = 1;
+    let mut parts = vec![];
+    let mut trigger = String::new();
+    let mut records: Records<String> = HashMap::new();
+    // the object, file and function names are compressed separately
+    let mut object_names = HashMap::new();
+    let mut file_names = HashMap::new();
+    let mut function_names = HashMap::new();
+    let mut context = ParserContext::default();
+    let mut skip_next_line = false;
+
+    for line in content.lines() {
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        if skip_next_line {
+            skip_next_line = false;
+            continue;
+        }
+        if line.starts_with(|c: char| c.is_ascii_digit() || c == '+' || c == '-' || c == '*') {
+            let fields = line.split_whitespace().collect_vec();
+            ensure!(
+                fields.len() >= position_count,
+                "Invalid cost line: {}",
+                line
+            );
+            context.positions.resize(position_count, 0);
+            for (position, field) in context.positions.iter_mut().zip(&fields) {
+                *position = parse_position(field, *position)?;
+            }
+            let costs = fields[position_count..]
+                .iter()
+                .map(|cost| cost.parse::<u64>())
+                .collect::<Result<Vec<_>, _>>()
+                .map_err(|e| anyhow!("Invalid cost line: {}, {}", line, e))?;
+            let file = context.inline_file.as_ref().unwrap_or(&context.file);
+            let (calls, callee) = match context.pending_calls.take() {
+                Some(calls) => (
+                    calls,
+                    Some((
+                        context
+                            .callee_object
+                            .take()
+                            .unwrap_or_else(|| context.object.clone()),
+                        context.callee_file.take().unwrap_or_else(|| file.clone()),
+                        context.callee_function.take().unwrap_or_default(),
+                    )),
+                ),
+                None => (0, None),
+            };
+            let key = RecordKey {
+                object: context.object.clone(),
+                file: file.clone(),
+                function: context.function.clone(),
+                callee,
+                positions: context.positions.clone(),
+            };
+            records.entry(key).or_default().add(calls, &costs);
+            continue;
+        }
+        if let Some((key, value)) = line.split_once(':') {
+            if key.chars().all(|c| c.is_ascii_alphanumeric()) {
+                match key {
+                    "events" => events = value.split_whitespace().map(String::from).collect(),
+                    "positions" => position_count = value.split_whitespace().count().max(1),
+                    "part" => {
+                        if !records.is_empty() {
+                            parts
+                                .push((std::mem::take(&mut trigger), std::mem::take(&mut records)));
+                        }
+                        trigger.clear();
+                        context = ParserContext::default();
+                    }
+                    "desc" => {
+                        if let Some(value) = value.trim().strip_prefix("Trigger:") {
+                            trigger = value.trim().to_string();
+                        }
+                    }
+                    _ => {}
+                }
+                continue;
+            }
+        }
+        let Some((key, value)) = line.split_once('=') else {
+            bail!("Invalid profile line: {}", line);
+        };
+        match key {
+            "ob" => context.object = resolve_name(&mut object_names, value),
+            "fl" => {
+                context.file = resolve_name(&mut file_names, value);
+                context.inline_file = None;
+            }
+            "fi" | "fe" => context.inline_file = Some(resolve_name(&mut file_names, value)),
+            "fn" => {
+                context.function = resolve_name(&mut function_names, value);
+                context.inline_file = None;
+            }
+            "cob" => context.callee_object = Some(resolve_name(&mut object_names, value)),
+            "cfi" | "cfl" => context.callee_file = Some(resolve_name(&mut file_names, value)),
+            "cfn" => context.callee_function = Some(resolve_name(&mut function_names, value)),
+            "calls" => {
+                let count = value.split_whitespace().next().unwrap_or_default();
+                context.pending_calls = Some(
+                    count
+                        .parse()
+                        .map_err(|e| anyhow!("Invalid calls line: {}, {}", line, e))?,
+                );
+            }
+            // the jumps are not merged, and their next line holds the jump counts
+            "jump" | "jcnd" => skip_next_line = true,
+            _ => {}
+        }
+    }
+    if !records.is_empty() {
+        parts.push((trigger, records));
+    }
+    Ok(ParsedProfile { pid, events, parts })
+}
+
+fn parse_profile(path: &Path) -> Result<ParsedProfile> {
+    let pid = path
+        .file_stem()
+        .and_then(|pid| pid.to_str())
+        .and_then(|pid| pid.parse().ok())
+        .ok_or_else(|| anyhow!("Invalid profile name: {}", path.display()))?;
+    let content = fs::read_to_string(path)
+        .map_err(|e| anyhow!("Failed to read profile: {}, {}", path.display(), e))?;
+    parse_profile_content(pid, &content)
+        .map_err(|e| anyhow!("Failed to parse profile: {}, {}", path.display(), e))
+}
+
+/// Parse the profiles on all the cpus, keeping their order
+pub(super) fn parse_profiles(paths: &[PathBuf]) -> Result<Vec<ParsedProfile>> {
+    let thread_count = thread::available_parallelism().map_or(1, |count| count.get());
+    let chunk_size = paths.len().div_ceil(thread_count).max(1);
+    thread::scope(|scope| {
+        let handles = paths
+            .chunks(chunk_size)
+            .map(|chunk| {
+                scope.spawn(move || chunk.iter().map(|path| parse_profile(path)).collect_vec())
+            })
+            .collect_vec();
+        handles
+            .into_iter()
+            .flat_map(|handle| handle.join().unwrap())
+            .collect()
+    })
+}
+
+#[derive(Default)]
+struct Interner {
+    strings: Vec<String>,
+    ids: HashMap<String, u32>,
+}
+
+impl Interner {
+    fn intern(&mut self, string: String) -> u32 {
+        if let Some(id) = self.ids.get(&string) {
+            return *id;
+        }
+        let id = self.strings.len() as u32;
+        self.strings.push(string.clone());
+        self.ids.insert(string, id);
+        id
+    }
+}
+
+/// The records of a benchmark in columns, the strings being indices in the interned strings
+#[derive(Serialize, Default, Debug, PartialEq)]
+#[serde(rename_all = "camelCase")]
+struct CostTable {
+    objects: Vec<u32>,
+    files: Vec<u32>,
+    functions: Vec<u32>,
+    #[serde(skip_serializing_if = "Vec::is_empty")]
+    callee_objects: Vec<u32>,
+    #[serde(skip_serializing_if = "Vec::is_empty")]
+    callee_files: Vec<u32>,
+    #[serde(skip_serializing_if = "Vec::is_empty")]
+    callee_functions: Vec<u32>,
+    #[serde(skip_serializing_if = "Vec::is_empty")]
+    calls: Vec<u64>,
+    /// A column per position type, e.g. the line
+    positions: Vec<Vec<u64>>,
+    /// A column per event
+    costs: Vec<Vec<u64>>,
+}
+
+impl CostTable {
+    fn push(&mut self, key: &RecordKey<u32>, record: &RecordCosts, event_count: usize) {
+        self.objects.push(key.object);
+        self.files.push(key.file);
+        self.functions.push(key.function);
+        if let Some((object, file, function)) = key.callee {
+            self.callee_objects.push(object);
+            self.callee_files.push(file);
+            self.callee_functions.push(function);
+            self.calls.push(record.calls);
+        }
+        self.positions.resize(key.positions.len(), vec![]);
+        for (column, position) in self.positions.iter_mut().zip(&key.positions) {
+            column.push(*position);
+        }
+        self.costs.resize(event_count, vec![]);
+        for (i, column) in self.costs.iter_mut().enumerate() {
+            column.push(record.costs.get(i).copied().unwrap_or_default());
+        }
+    }
+}
+
+#[derive(Serialize, Debug, PartialEq)]
+#[serde(rename_all = "camelCase")]
+struct MergedBenchmark {
+    /// The trigger of the dumps, e.g. the client request of the benchmark
+    trigger: String,
+    pids: Vec<u32>,
+    /// The self costs of the benchmark, by event
+    totals: Vec<u64>,
+    self_costs: CostTable,
+    call_costs: CostTable,
+}
+
+#[derive(Serialize, Debug, PartialEq)]
+#[serde(rename_all = "camelCase")]
+struct MergedProfile {
+    version: u32,
+    events: Vec<String>,
+    strings: Vec<String>,
+    benchmarks: Vec<MergedBenchmark>,
+}
+
+/// Combine the parts of the profiles dumped by the same trigger, the cost of the records of the
+/// processes of a benchmark being summed
+fn merge_parsed_profiles(profiles: Vec<ParsedProfile>) -> Result<MergedProfile> {
+    let events = profiles
+        .first()
+        .map(|profile| profile.events.clone())
+        .unwrap_or_default();
+    let mut interner = Interner::default();
+    let mut benchmarks: Vec<(String, BTreeSet<u32>, Records<u32>)> = vec![];
+    let mut benchmark_indices: HashMap<String, usize> = HashMap::new();
+    for profile in profiles {
+        ensure!(
+            profile.events == events,
+            "Cannot merge the profile of {} with events {:?}, expected {:?}",
+            profile.pid,
+            profile.events,
+            events
+        );
+        for (trigger, records) in profile.parts {
+            let index = *benchmark_indices.entry(trigger.clone()).or_insert_with(|| {
+                benchmarks.push((trigger, BTreeSet::new(), HashMap::new()));
+                benchmarks.len() - 1
+            });
+            let (_, pids, benchmark_records) = &mut benchmarks[index];
+            pids.insert(profile.pid);
+            // the records are interned in order, for the strings to be deterministic
+            for (key, record) in records.into_iter().sorted_by(|(a, _), (b, _)| a.cmp(b)) {
+                let key = RecordKey {
+                    object: interner.intern(key.object),
+                    file: interner.intern(key.file),
+                    function: interner.intern(key.function),
+                    callee: key.callee.map(|(object, file, function)| {
+                        (
+                            interner.intern(object),
+                            interner.intern(file),
+                            interner.intern(function),
+                        )
+                    }),
+                    positions: key.positions,
+                };
+                benchmark_records
+                    .entry(key)
+                    .or_default()
+                    .add(record.calls, &record.costs);
+            }
+        }
+    }
+
+    let benchmarks = benchmarks
+        .into_iter()
+        .map(|(trigger, pids, records)| {
+            let mut totals = vec![0; events.len()];
+            let mut self_costs = CostTable::default();
+            let mut call_costs = CostTable::default();
+            for (key, record) in records.iter().sorted_by(|(a, _), (b, _)| a.cmp(b)) {
+                if key.callee.is_some() {
+                    call_costs.push(key, record, events.len());
+                } else {
+                    for (total, cost) in totals.iter_mut().zip(&record.costs) {
+                        *total += cost;
+                    }
+                    self_costs.push(key, record, events.len());
+                }
+            }
+            MergedBenchmark {
+                trigger,
+                pids: pids.into_iter().collect(),
+                totals,
+                self_costs,
+                call_costs,
+            }
+        })
+        .collect();
+    Ok(MergedProfile {
+        version: MERGED_PROFILE_VERSION,
+        events,
+        strings: interner.strings,
+        benchmarks,
+    })
+}
+
+/// Merge the `<pid>.out` callgrind profiles into a single columnar profile with interned strings,
+/// the processes of each benchmark being combined. The test runners forking workers produce
+/// thousands of small profiles, which archive and parse poorly as separate text files.
+pub fn merge_profiles(profile_folder: &Path) -> Result<()> {
+    let profile_paths = fs::read_dir(profile_folder)?
+        .filter_map(|entry| entry.ok())
+        .map(|entry| entry.path())
+        .filter(|path| path.extension().unwrap_or_default() == "out")
+        .sorted()
+        .collect_vec();
+    if profile_paths.is_empty() {
+        return Ok(());
+    }
+
+    let profiles = parse_profiles(&profile_paths)?;
+    let merged_profile = merge_parsed_profiles(profiles)?;
+    let merged_path = profile_folder.join(MERGED_PROFILE_FILE);
+    let mut merged_file = BufWriter::new(File::create(&merged_path).map_err(|e| {
+        anyhow!(
+            "Failed to create merged profile: {}, {}",
+            merged_path.display(),
+            e
+        )
+    })?);
+    serde_json::to_writer(&mut merged_file, &merged_profile)?;
+    merged_file.flush()?;
+    for profile_path in &profile_paths {
+        fs::remove_file(profile_path)?;
+    }
+    info!(
+        "Merged {} profiles into {} benchmarks",
+        profile_paths.len(),
+        merged_profile.benchmarks.len()
+    );
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const WORKER_PROFILE: &str = "# callgrind format
+version: 1
+creator: callgrind-3.21.0
+pid: 101
+cmd: node bench.js
+part: 1
+desc: Trigger: Client Request: bench.js::fib
+positions: line
+events: Ir
+fl=(1) bench.js
+fn=(1) fib
+4 10
++1 5
+cfn=(2) add
+calls=2 0
+* 20
+fn=(2)
+0 20
+";
+
+    #[test]
+    fn test_parse_profile_content() {
+        let profile = parse_profile_content(101, WORKER_PROFILE).unwrap();
+        assert_eq!(profile.events, vec!["Ir"]);
+        let (trigger, records) = &profile.parts[0];
+        assert_eq!(trigger, "Client Request: bench.js::fib");
+        let call_key = RecordKey {
+            object: String::new(),
+            file: "bench.js".to_string(),
+            function: "fib".to_string(),
+            callee: Some((String::new(), "bench.js".to_string(), "add".to_string())),
+            positions: vec![5],
+        };
+        assert_eq!(
+            records[&call_key],
+            RecordCosts {
+                calls: 2,
+                costs: vec![20]
+            }
+        );
+        assert_eq!(records.len(), 4);
+    }
+
+    #[test]
+    fn test_merge_parsed_profiles() {
+        let profiles = vec![
+            parse_profile_content(101, WORKER_PROFILE).unwrap(),
+            parse_profile_content(102, WORKER_PROFILE).unwrap(),
+        ];
+        let merged = merge_parsed_profiles(profiles).unwrap();
+        assert_eq!(merged.benchmarks.len(), 1);
+        let benchmark = &merged.benchmarks[0];
+        assert_eq!(benchmark.pids, vec![101, 102]);
+        assert_eq!(benchmark.totals, vec![70]);
+        assert_eq!(merged.strings, vec!["", "bench.js", "add", "fib"]);
+        assert_eq!(benchmark.self_costs.functions, vec![2, 3, 3]);
+        assert_eq!(benchmark.self_costs.costs, vec![vec![40, 20, 10]]);
+        assert_eq!(benchmark.call_costs.calls, vec![4]);
+    }
+}
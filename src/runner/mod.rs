@@ -1,8 +1,21 @@
 mod check_system;
+mod compare;
 mod helpers;
+mod incremental;
+mod memory_profile;
+mod merge_profiles;
+mod perf_counters;
 mod run;
 mod setup;
+mod stack_samples;
+mod thread_profiles;
 mod valgrind;
+mod walltime;
 
 pub use self::run::RunData;
+pub use helpers::cache_geometry::{resolve_cache_geometry, resolve_cache_simulation};
+pub use helpers::introspected_node::{is_node_shim_invocation, run_node_shim};
+pub use helpers::profile_folder::{create_profile_folder, remove_profile_folder};
+#[cfg(test)]
+pub use helpers::{download_file::download_file, perf_maps::harvest_perf_maps_from};
 pub use run::run;
@@ -0,0 +1,195 @@
+use crate::prelude::*;
+use serde::Serialize;
+use std::{
+    fs::{self, File},
+    io::{self, Read},
+    os::fd::{AsRawFd, FromRawFd},
+    path::Path,
+    process::{Command, ExitStatus},
+    time::Instant,
+};
+
+const PERF_TYPE_HARDWARE: u32 = 0;
+const PERF_COUNT_HW_CPU_CYCLES: u64 = 0;
+const PERF_COUNT_HW_INSTRUCTIONS: u64 = 1;
+
+pub(super) const PERF_ATTR_FLAG_DISABLED: u64 = 1 << 0;
+pub(super) const PERF_ATTR_FLAG_INHERIT: u64 = 1 << 1;
+pub(super) const PERF_ATTR_FLAG_EXCLUDE_KERNEL: u64 = 1 << 5;
+pub(super) const PERF_ATTR_FLAG_EXCLUDE_HV: u64 = 1 << 6;
+
+pub(super) const PERF_EVENT_IOC_ENABLE: u64 = 0x2400;
+pub(super) const PERF_EVENT_IOC_DISABLE: u64 = 0x2401;
+
+/// The first published version of `struct perf_event_attr`, accepted by all the kernels
+/// supporting perf_event
+#[repr(C)]
+#[derive(Default)]
+pub(super) struct PerfEventAttr {
+    pub(super) type_: u32,
+    pub(super) size: u32,
+    pub(super) config: u64,
+    /// The sample frequency instead, with the freq flag
+    pub(super) sample_period: u64,
+    pub(super) sample_type: u64,
+    pub(super) read_format: u64,
+    pub(super) flags: u64,
+    pub(super) wakeup_events: u32,
+    pub(super) bp_type: u32,
+    pub(super) config1: u64,
+}
+
+/// A hardware counter of the calling thread, also counting the processes it spawns once they exit
+struct Counter {
+    file: File,
+}
+
+impl Counter {
+    fn open(config: u64) -> io::Result<Self> {
+        let attr = PerfEventAttr {
+            type_: PERF_TYPE_HARDWARE,
+            size: std::mem::size_of::<PerfEventAttr>() as u32,
+            config,
+            // the kernel is excluded so that the counters are available to unprivileged users
+            flags: PERF_ATTR_FLAG_DISABLED
+                | PERF_ATTR_FLAG_INHERIT
+                | PERF_ATTR_FLAG_EXCLUDE_KERNEL
+                | PERF_ATTR_FLAG_EXCLUDE_HV,
+            ..Default::default()
+        };
+        // SAFETY: attr is a valid perf_event_attr, and the returned fd is owned by the counter
+        let fd = unsafe {
+            libc::syscall(
+                libc::SYS_perf_event_open,
+                &attr as *const PerfEventAttr,
+                0,  // the calling thread
+                -1, // any cpu
+                -1, // no group
+                0,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self {
+            file: unsafe { File::from_raw_fd(fd as i32) },
+        })
+    }
+
+    fn ioctl(&self, request: u64) -> io::Result<()> {
+        // SAFETY: the enable and disable requests take no argument
+        if unsafe { libc::ioctl(self.file.as_raw_fd(), request as _, 0) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    fn read(&mut self) -> io::Result<u64> {
+        let mut value = [0u8; 8];
+        self.file.read_exact(&mut value)?;
+        Ok(u64::from_ne_bytes(value))
+    }
+}
+
+pub struct CounterValues {
+    pub instructions: u64,
+    pub cycles: u64,
+    pub walltime_ns: u128,
+}
+
+/// Run the command natively, counting the instructions and cycles of all its processes.
+///
+/// The counters are attached to the calling thread and inherited by the spawned processes, so
+/// the commands run concurrently on other threads are not counted.
+pub fn run_with_counters(cmd: &mut Command) -> Result<(u32, ExitStatus, CounterValues)> {
+    let mut instructions = Counter::open(PERF_COUNT_HW_INSTRUCTIONS).map_err(|e| {
+        anyhow!(
+            "Failed to open the perf_event counters, check /proc/sys/kernel/perf_event_paranoid: {}",
+            e
+        )
+    })?;
+    let mut cycles = Counter::open(PERF_COUNT_HW_CPU_CYCLES)?;
+
+    instructions.ioctl(PERF_EVENT_IOC_ENABLE)?;
+    cycles.ioctl(PERF_EVENT_IOC_ENABLE)?;
+    let start = Instant::now();
+    let mut child = cmd
+        .spawn()
+        .map_err(|e| anyhow!("failed to execute the benchmark process. {}", e))?;
+    let status = child.wait()?;
+    let walltime = start.elapsed();
+    instructions.ioctl(PERF_EVENT_IOC_DISABLE)?;
+    cycles.ioctl(PERF_EVENT_IOC_DISABLE)?;
+
+    Ok((
+        child.id(),
+        status,
+        CounterValues {
+            instructions: instructions.read()?,
+            cycles: cycles.read()?,
+            walltime_ns: walltime.as_nanos(),
+        },
+    ))
+}
+
+/// The counts of the processes of a bench command
+#[derive(Serialize, Debug)]
+#[serde(rename_all = "camelCase")]
+struct PerfCountersResult<'a> {
+    command: &'a str,
+    instructions: u64,
+    cycles: u64,
+    walltime_ns: u64,
+}
+
+/// Write the counter values to `perf-counters-<pid>.json`. The counts cover whole processes, so
+/// they are kept apart from the callgrind profiles of the instrumentation mode.
+pub fn write_profile(
+    profile_folder: &Path,
+    pid: u32,
+    bench_command: &str,
+    values: &CounterValues,
+) -> Result<()> {
+    let profile_path = profile_folder.join(format!("perf-counters-{}.json", pid));
+    let result = PerfCountersResult {
+        command: bench_command,
+        instructions: values.instructions,
+        cycles: values.cycles,
+        walltime_ns: values.walltime_ns as u64,
+    };
+    fs::write(&profile_path, serde_json::to_string_pretty(&result)?)
+        .map_err(|e| anyhow!("Failed to write profile: {}, {}", profile_path.display(), e))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_write_profile() -> Result<()> {
+        let profile_folder = std::env::temp_dir().join("codspeed_test_perf_counters");
+        fs::create_dir_all(&profile_folder)?;
+        let values = CounterValues {
+            instructions: 1000,
+            cycles: 800,
+            walltime_ns: 500,
+        };
+        write_profile(&profile_folder, 42, "pytest tests/ --codspeed", &values)?;
+
+        let profile: serde_json::Value = serde_json::from_str(&fs::read_to_string(
+            profile_folder.join("perf-counters-42.json"),
+        )?)?;
+        assert_eq!(
+            profile,
+            serde_json::json!({
+                "command": "pytest tests/ --codspeed",
+                "instructions": 1000,
+                "cycles": 800,
+                "walltimeNs": 500,
+            })
+        );
+
+        fs::remove_dir_all(&profile_folder)?;
+        Ok(())
+    }
+}
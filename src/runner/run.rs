@@ -1,29 +1,119 @@
-use crate::{config::Config, prelude::*};
-use std::path::PathBuf;
+use crate::{
+    config::{Config, MeasurementMode},
+    prelude::*,
+    telemetry,
+};
+use lazy_static::lazy_static;
+use std::{collections::HashMap, path::PathBuf, sync::Mutex};
 
 use super::{
     check_system::check_system,
-    helpers::{perf_maps::harvest_perf_maps, profile_folder::create_profile_folder},
-    setup::setup,
+    compare::{compare_to_baseline, save_baseline},
+    helpers::{
+        cache_geometry::get_cache_simulation_folder,
+        perf_maps::{compact_perf_maps, harvest_perf_maps},
+    },
+    incremental::get_skipped_bench_lines,
+    memory_profile::write_memory_profile,
+    merge_profiles::merge_profiles,
+    setup::{is_valgrind_installed, setup},
     valgrind,
 };
 
 pub struct RunData {
     pub profile_folder: PathBuf,
+    /// The lines of the bench command skipped by an incremental run
+    pub skipped_bench_commands: Vec<String>,
+}
+
+lazy_static! {
+    /// The valgrind roots of the environments prepared by the previous runs of the process, by
+    /// cache directory, for the runner daemon to check the system and install valgrind once
+    static ref PREPARED_ENVIRONMENTS: Mutex<HashMap<Option<PathBuf>, Option<PathBuf>>> =
+        Mutex::new(HashMap::new());
 }
 
-pub async fn run(config: &Config) -> Result<RunData> {
-    if !config.skip_setup {
+pub async fn run(
+    config: &Config,
+    profile_folder: PathBuf,
+    base_ref: Option<&str>,
+) -> Result<RunData> {
+    let mut valgrind_root = None;
+    // valgrind is only needed to instrument the benchmarks or profile their heap
+    let needs_valgrind = config.mode == MeasurementMode::Instrumentation || config.memory_profile;
+    let prepared_valgrind_root = needs_valgrind
+        .then(|| {
+            PREPARED_ENVIRONMENTS
+                .lock()
+                .unwrap()
+                .get(&config.cache_dir)
+                .cloned()
+        })
+        .flatten();
+    if let Some(prepared_valgrind_root) = prepared_valgrind_root {
+        debug!("Reusing the environment prepared by a previous run");
+        valgrind_root = prepared_valgrind_root;
+    } else if !config.skip_setup && needs_valgrind {
         start_group!("Prepare the environment");
-        let system_info = check_system()?;
-        setup(&system_info).await?;
+        let system_info = {
+            let _phase = telemetry::phase("Check the system");
+            check_system()?
+        };
+        valgrind_root = {
+            let _phase = telemetry::phase("Install valgrind");
+            setup(&system_info, config.cache_dir.as_deref()).await?
+        };
+        PREPARED_ENVIRONMENTS
+            .lock()
+            .unwrap()
+            .insert(config.cache_dir.clone(), valgrind_root.clone());
         end_group!();
+    } else if needs_valgrind && !is_valgrind_installed() {
+        warn!("The valgrind version used by the runner is not installed, the measurements may be inaccurate");
     }
-    //TODO: add valgrind version check
     start_opened_group!("Run the benchmarks");
-    let profile_folder = create_profile_folder()?;
-    valgrind::measure(config, &profile_folder)?;
-    harvest_perf_maps(&profile_folder)?;
+    let skipped_bench_commands = get_skipped_bench_lines(config, base_ref)?;
+    {
+        let _phase = telemetry::phase("Measure the benchmarks");
+        valgrind::measure(
+            config,
+            &profile_folder,
+            &skipped_bench_commands,
+            valgrind_root.as_deref(),
+        )?;
+    }
+    if config.memory_profile {
+        write_memory_profile(&profile_folder)?;
+    }
+    {
+        let _phase = telemetry::phase("Harvest the perf maps");
+        harvest_perf_maps(&profile_folder)?;
+        for simulation in &config.cache_simulations {
+            harvest_perf_maps(&get_cache_simulation_folder(&profile_folder, simulation))?;
+        }
+        if config.compact_perf_maps {
+            compact_perf_maps(&profile_folder)?;
+            for simulation in &config.cache_simulations {
+                compact_perf_maps(&get_cache_simulation_folder(&profile_folder, simulation))?;
+            }
+        }
+    }
+    // the baseline is compared and saved before the profiles are merged
+    if let Some(baseline_folder) = &config.compare_to {
+        let _phase = telemetry::phase("Compare to the baseline");
+        compare_to_baseline(&profile_folder, baseline_folder)?;
+    }
+    if let Some(baseline_folder) = &config.save_baseline {
+        let _phase = telemetry::phase("Save the baseline");
+        save_baseline(&profile_folder, baseline_folder)?;
+    }
+    if config.merge_profiles {
+        let _phase = telemetry::phase("Merge the profiles");
+        merge_profiles(&profile_folder)?;
+    }
     end_group!();
-    Ok(RunData { profile_folder })
+    Ok(RunData {
+        profile_folder,
+        skipped_bench_commands,
+    })
 }
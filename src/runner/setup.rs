@@ -1,25 +1,45 @@
 use std::{
-    env,
+    env, fs,
+    path::{Path, PathBuf},
     process::{Command, Stdio},
 };
 
+use flate2::read::GzDecoder;
 use url::Url;
 
-use super::{check_system::SystemInfo, helpers::download_file::download_file};
+use super::{
+    check_system::SystemInfo,
+    helpers::{
+        cache_dir::get_default_cache_dir,
+        download_file::{download_file, hash_file},
+    },
+};
 use crate::prelude::*;
 
 const VALGRIND_CODSPEED_VERSION: &str = "3.21.0-0codspeed1";
+/// The SHA-256 digests of the release assets of VALGRIND_CODSPEED_VERSION, by asset name, to be
+/// updated with the version from the `sha256sum` of the published assets
+const VALGRIND_CODSPEED_SHA256: &[(&str, &str)] = &[];
 
-/// Run a command with sudo if available
-fn run_with_sudo(command_args: &[&str]) -> Result<()> {
-    let use_sudo = Command::new("sudo")
+fn is_sudo_available() -> bool {
+    Command::new("sudo")
         // `sudo true` will fail if sudo does not exist or the current user does not have sudo privileges
         .arg("true")
         .stdout(Stdio::null())
+        .stderr(Stdio::null())
         .status()
-        .is_ok_and(|status| status.success());
+        .is_ok_and(|status| status.success())
+}
+
+fn is_root() -> bool {
+    // SAFETY: geteuid has no failure case
+    unsafe { libc::geteuid() == 0 }
+}
+
+/// Run a command with sudo if available
+fn run_with_sudo(command_args: &[&str]) -> Result<()> {
     let mut command_args: Vec<&str> = command_args.into();
-    if use_sudo {
+    if is_sudo_available() {
         command_args.insert(0, "sudo");
     }
 
@@ -39,14 +59,207 @@ fn run_with_sudo(command_args: &[&str]) -> Result<()> {
     Ok(())
 }
 
-pub async fn setup(system_info: &SystemInfo) -> Result<()> {
-    let valgrind_deb_url = format!("https://github.com/CodSpeedHQ/valgrind-codspeed/releases/download/{}/valgrind_{}_ubuntu-{}_amd64.deb", VALGRIND_CODSPEED_VERSION, VALGRIND_CODSPEED_VERSION, system_info.os_version);
-    let deb_path = env::temp_dir().join("valgrind-codspeed.deb");
-    download_file(&Url::parse(valgrind_deb_url.as_str()).unwrap(), &deb_path).await?;
+/// Returns the pinned digest of a release asset, the downloads of the assets without one not
+/// being verified
+fn get_pinned_sha256(asset_name: &str) -> Option<&'static str> {
+    let sha256 = VALGRIND_CODSPEED_SHA256
+        .iter()
+        .find(|(name, _)| *name == asset_name)
+        .map(|(_, sha256)| *sha256);
+    if sha256.is_none() {
+        warn!(
+            "No pinned checksum for {}, the package is not verified",
+            asset_name
+        );
+    }
+    sha256
+}
 
-    run_with_sudo(&["apt-get", "update"])?;
-    run_with_sudo(&["apt-get", "install", "-y", deb_path.to_str().unwrap()])?;
+/// Returns the version of the installed valgrind package, if any
+fn get_installed_valgrind_version() -> Option<String> {
+    let output = Command::new("dpkg-query")
+        .args(["--show", "--showformat=${Version}", "valgrind"])
+        .output()
+        .ok()?;
+    if !output.status.success() {
+        return None;
+    }
+    Some(String::from_utf8_lossy(&output.stdout).trim().to_string())
+}
 
-    info!("Environment ready");
+/// Returns true if the valgrind-codspeed version used by the runner is installed
+pub fn is_valgrind_installed() -> bool {
+    let installed_version = get_installed_valgrind_version();
+    debug!("Installed valgrind version: {:?}", installed_version);
+    installed_version.is_some_and(|version| version == VALGRIND_CODSPEED_VERSION)
+}
+
+/// Download the valgrind-codspeed package, or reuse it from the cache directory.
+///
+/// Release assets are immutable, so the package is cached under its asset name, and reused only
+/// if it still matches its pinned digest.
+async fn get_valgrind_deb(system_info: &SystemInfo, cache_dir: Option<&Path>) -> Result<PathBuf> {
+    let deb_name = format!(
+        "valgrind_{}_ubuntu-{}_amd64.deb",
+        VALGRIND_CODSPEED_VERSION, system_info.os_version
+    );
+    let expected_sha256 = get_pinned_sha256(&deb_name);
+    let deb_path = match cache_dir {
+        Some(cache_dir) => {
+            let deb_path = cache_dir.join(&deb_name);
+            if deb_path.exists() {
+                let is_intact = match expected_sha256 {
+                    Some(expected_sha256) => hash_file(&deb_path)
+                        .await
+                        .is_ok_and(|sha256| sha256.eq_ignore_ascii_case(expected_sha256)),
+                    None => true,
+                };
+                if is_intact {
+                    debug!("Using cached valgrind package: {}", deb_path.display());
+                    return Ok(deb_path);
+                }
+                warn!(
+                    "The cached valgrind package does not match its checksum, downloading it again"
+                );
+            }
+            fs::create_dir_all(cache_dir).map_err(|e| {
+                anyhow!(
+                    "Failed to create cache directory: {}, {}",
+                    cache_dir.display(),
+                    e
+                )
+            })?;
+            deb_path
+        }
+        None => env::temp_dir().join("valgrind-codspeed.deb"),
+    };
+
+    let valgrind_deb_url = format!(
+        "https://github.com/CodSpeedHQ/valgrind-codspeed/releases/download/{}/{}",
+        VALGRIND_CODSPEED_VERSION, deb_name
+    );
+    // download next to the final path so that an interrupted download is never reused
+    let download_path = deb_path.with_extension("deb.partial");
+    let valgrind_deb_url = Url::parse(valgrind_deb_url.as_str()).unwrap();
+    download_file(&valgrind_deb_url, &download_path, expected_sha256).await?;
+    fs::rename(&download_path, &deb_path)
+        .map_err(|e| anyhow!("Failed to move file: {}, {}", deb_path.display(), e))?;
+    Ok(deb_path)
+}
+
+async fn install_valgrind_deb(system_info: &SystemInfo, cache_dir: Option<&Path>) -> Result<()> {
+    if is_valgrind_installed() {
+        info!(
+            "valgrind-codspeed {} is already installed",
+            VALGRIND_CODSPEED_VERSION
+        );
+        return Ok(());
+    }
+
+    let deb_path = get_valgrind_deb(system_info, cache_dir).await?;
+    let install_args = ["apt-get", "install", "-y", deb_path.to_str().unwrap()];
+    // the package lists are only refreshed when the dependencies cannot be installed without it
+    if run_with_sudo(&install_args).is_err() {
+        run_with_sudo(&["apt-get", "update"])?;
+        run_with_sudo(&install_args)?;
+    }
     Ok(())
 }
+
+/// Returns the root of the relocatable valgrind-codspeed toolchain, downloading and unpacking it
+/// in the cache directory if it is not there yet
+async fn install_relocatable_valgrind(
+    system_info: &SystemInfo,
+    cache_dir: &Path,
+) -> Result<PathBuf> {
+    let valgrind_root = cache_dir.join(format!("valgrind-codspeed-{}", VALGRIND_CODSPEED_VERSION));
+    if valgrind_root.join("bin/valgrind").exists() {
+        info!(
+            "Using cached valgrind-codspeed {} toolchain",
+            VALGRIND_CODSPEED_VERSION
+        );
+        return Ok(valgrind_root);
+    }
+    fs::create_dir_all(cache_dir).map_err(|e| {
+        anyhow!(
+            "Failed to create cache directory: {}, {}",
+            cache_dir.display(),
+            e
+        )
+    })?;
+
+    let tarball_name = format!(
+        "valgrind-codspeed_{}_linux-{}.tar.gz",
+        VALGRIND_CODSPEED_VERSION, system_info.arch
+    );
+    let tarball_url = format!(
+        "https://github.com/CodSpeedHQ/valgrind-codspeed/releases/download/{}/{}",
+        VALGRIND_CODSPEED_VERSION, tarball_name
+    );
+    let tarball_path = cache_dir.join(format!("{}.partial", tarball_name));
+    // the toolchain is unpacked and run as is, so it is only used once verified
+    let tarball_url = Url::parse(tarball_url.as_str()).unwrap();
+    download_file(
+        &tarball_url,
+        &tarball_path,
+        get_pinned_sha256(&tarball_name),
+    )
+    .await?;
+
+    // unpack next to the final path so that an interrupted extraction is never reused
+    let unpack_path = valgrind_root.with_extension("partial");
+    let thread_unpack_path = unpack_path.clone();
+    let thread_tarball_path = tarball_path.clone();
+    tokio::task::spawn_blocking(move || -> Result<()> {
+        if thread_unpack_path.exists() {
+            fs::remove_dir_all(&thread_unpack_path)?;
+        }
+        let tarball = fs::File::open(&thread_tarball_path)?;
+        tar::Archive::new(GzDecoder::new(tarball))
+            .unpack(&thread_unpack_path)
+            .map_err(|e| {
+                anyhow!(
+                    "Failed to unpack valgrind toolchain: {}, {}",
+                    thread_tarball_path.display(),
+                    e
+                )
+            })
+    })
+    .await??;
+    if !unpack_path.join("bin/valgrind").exists() {
+        bail!("The valgrind toolchain archive does not contain bin/valgrind");
+    }
+    fs::rename(&unpack_path, &valgrind_root).map_err(|e| {
+        anyhow!(
+            "Failed to move directory: {}, {}",
+            valgrind_root.display(),
+            e
+        )
+    })?;
+    fs::remove_file(&tarball_path)?;
+    Ok(valgrind_root)
+}
+
+/// Install valgrind-codspeed.
+///
+/// On the systems it is packaged for, the package is installed system-wide when the user can
+/// install packages. Otherwise, a relocatable toolchain is unpacked in the cache directory and its
+/// root is returned.
+pub async fn setup(system_info: &SystemInfo, cache_dir: Option<&Path>) -> Result<Option<PathBuf>> {
+    let valgrind_root = if system_info.is_deb_supported() && (is_root() || is_sudo_available()) {
+        install_valgrind_deb(system_info, cache_dir).await?;
+        None
+    } else {
+        debug!(
+            "Cannot install the valgrind-codspeed package on {} {}, using the relocatable toolchain",
+            system_info.os, system_info.os_version
+        );
+        let cache_dir = cache_dir
+            .map(Path::to_path_buf)
+            .unwrap_or_else(get_default_cache_dir);
+        Some(install_relocatable_valgrind(system_info, &cache_dir).await?)
+    };
+
+    info!("Environment ready");
+    Ok(valgrind_root)
+}
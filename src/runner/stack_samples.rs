@@ -0,0 +1,557 @@
+use super::{
+    helpers::{
+        elf_symbols::ElfSymbols,
+        perf_maps::{read_process_perf_map, PerfMapSymbol},
+    },
+    perf_counters::{
+        PerfEventAttr, PERF_ATTR_FLAG_DISABLED, PERF_ATTR_FLAG_EXCLUDE_HV,
+        PERF_ATTR_FLAG_EXCLUDE_KERNEL, PERF_ATTR_FLAG_INHERIT,
+    },
+};
+use crate::prelude::*;
+use std::{
+    collections::HashMap,
+    fs::File,
+    io::{self, BufWriter, Write},
+    os::fd::{AsRawFd, FromRawFd},
+    path::Path,
+    process::{Command, ExitStatus},
+    ptr,
+    sync::atomic::{fence, Ordering},
+    thread,
+    time::Duration,
+};
+
+const PERF_TYPE_SOFTWARE: u32 = 1;
+const PERF_COUNT_SW_CPU_CLOCK: u64 = 0;
+
+const PERF_SAMPLE_TID: u64 = 1 << 1;
+const PERF_SAMPLE_TIME: u64 = 1 << 2;
+const PERF_SAMPLE_CALLCHAIN: u64 = 1 << 5;
+
+const PERF_ATTR_FLAG_MMAP: u64 = 1 << 8;
+const PERF_ATTR_FLAG_COMM: u64 = 1 << 9;
+const PERF_ATTR_FLAG_FREQ: u64 = 1 << 10;
+const PERF_ATTR_FLAG_ENABLE_ON_EXEC: u64 = 1 << 12;
+const PERF_ATTR_FLAG_TASK: u64 = 1 << 13;
+const PERF_ATTR_FLAG_SAMPLE_ID_ALL: u64 = 1 << 18;
+const PERF_ATTR_FLAG_EXCLUDE_CALLCHAIN_KERNEL: u64 = 1 << 21;
+const PERF_ATTR_FLAG_MMAP2: u64 = 1 << 23;
+const PERF_ATTR_FLAG_COMM_EXEC: u64 = 1 << 24;
+
+const PERF_RECORD_LOST: u32 = 2;
+const PERF_RECORD_COMM: u32 = 3;
+const PERF_RECORD_FORK: u32 = 7;
+const PERF_RECORD_SAMPLE: u32 = 9;
+const PERF_RECORD_MMAP2: u32 = 10;
+const PERF_RECORD_MISC_COMM_EXEC: u16 = 1 << 13;
+/// The callchain entries from this value are context markers, e.g. PERF_CONTEXT_USER
+const PERF_CONTEXT_MAX: u64 = -4095i64 as u64;
+
+/// The offsets of the fields of `struct perf_event_mmap_page` used to read the ring buffer
+const DATA_HEAD_OFFSET: usize = 1024;
+const DATA_TAIL_OFFSET: usize = 1032;
+/// The data pages of each ring buffer, a power of two
+const RING_BUFFER_DATA_PAGES: usize = 64;
+const DRAIN_INTERVAL: Duration = Duration::from_millis(10);
+
+fn read_u32(data: &[u8], offset: usize) -> Option<u32> {
+    Some(u32::from_ne_bytes(
+        data.get(offset..offset + 4)?.try_into().ok()?,
+    ))
+}
+
+fn read_u64(data: &[u8], offset: usize) -> Option<u64> {
+    Some(u64::from_ne_bytes(
+        data.get(offset..offset + 8)?.try_into().ok()?,
+    ))
+}
+
+fn read_string(data: &[u8], offset: usize) -> String {
+    let data = data.get(offset..).unwrap_or_default();
+    let end = data.iter().position(|&c| c == 0).unwrap_or(data.len());
+    String::from_utf8_lossy(&data[..end]).into_owned()
+}
+
+/// An event of the sampled processes, in the order of their timestamps
+#[derive(Debug, PartialEq)]
+enum SampleEvent {
+    Fork {
+        pid: u32,
+        parent_pid: u32,
+    },
+    Comm {
+        pid: u32,
+        name: String,
+        exec: bool,
+    },
+    Mmap {
+        pid: u32,
+        mapping: Mapping,
+    },
+    Sample {
+        pid: u32,
+        /// The user instruction pointers, the innermost frame first
+        ips: Vec<u64>,
+    },
+}
+
+/// Parse a record of the ring buffer into its time and event. Every record ends with the pid,
+/// tid and time of the sample_id, given sample_id_all.
+fn parse_record(record_type: u32, misc: u16, body: &[u8]) -> Option<(u64, SampleEvent)> {
+    let trailing_time = || read_u64(body, body.len().checked_sub(8)?);
+    match record_type {
+        PERF_RECORD_SAMPLE => {
+            let count = read_u64(body, 16)? as usize;
+            let ips = (0..count)
+                .filter_map(|i| read_u64(body, 24 + i * 8))
+                .filter(|ip| *ip < PERF_CONTEXT_MAX)
+                .collect();
+            let pid = read_u32(body, 0)?;
+            Some((read_u64(body, 8)?, SampleEvent::Sample { pid, ips }))
+        }
+        PERF_RECORD_FORK => Some((
+            trailing_time()?,
+            SampleEvent::Fork {
+                pid: read_u32(body, 0)?,
+                parent_pid: read_u32(body, 4)?,
+            },
+        )),
+        PERF_RECORD_COMM => Some((
+            trailing_time()?,
+            SampleEvent::Comm {
+                pid: read_u32(body, 0)?,
+                name: read_string(body, 8),
+                exec: misc & PERF_RECORD_MISC_COMM_EXEC != 0,
+            },
+        )),
+        PERF_RECORD_MMAP2 => {
+            let start = read_u64(body, 8)?;
+            Some((
+                trailing_time()?,
+                SampleEvent::Mmap {
+                    pid: read_u32(body, 0)?,
+                    mapping: Mapping {
+                        start,
+                        end: start + read_u64(body, 16)?,
+                        file_offset: read_u64(body, 24)?,
+                        path: read_string(body, 64),
+                    },
+                },
+            ))
+        }
+        _ => None,
+    }
+}
+
+/// A ring buffer receiving the samples of the calling thread and its children on a cpu
+struct RingBuffer {
+    /// The event writing to the buffer, closed when the buffer is dropped
+    _file: File,
+    base: *mut u8,
+    page_size: usize,
+}
+
+impl RingBuffer {
+    fn open(attr: &PerfEventAttr, cpu: i32) -> io::Result<Self> {
+        // SAFETY: attr is a valid perf_event_attr, and the returned fd is owned by the buffer
+        let fd = unsafe {
+            libc::syscall(
+                libc::SYS_perf_event_open,
+                attr as *const PerfEventAttr,
+                0, // the calling thread
+                cpu,
+                -1, // no group
+                0,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let file = unsafe { File::from_raw_fd(fd as i32) };
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+        // SAFETY: the mapping of the metadata page and the data pages is owned by the buffer
+        let base = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                (1 + RING_BUFFER_DATA_PAGES) * page_size,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if base == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self {
+            _file: file,
+            base: base as *mut u8,
+            page_size,
+        })
+    }
+
+    /// Parse the records written since the last drain, and free their space in the buffer
+    fn drain(&mut self, events: &mut Vec<(u64, SampleEvent)>, lost_count: &mut u64) {
+        let data_size = RING_BUFFER_DATA_PAGES * self.page_size;
+        // SAFETY: the head and tail are in the metadata page, the head being written by the
+        // kernel and the tail by the reader
+        let head = unsafe { ptr::read_volatile(self.base.add(DATA_HEAD_OFFSET) as *const u64) };
+        fence(Ordering::Acquire);
+        let tail = unsafe { ptr::read_volatile(self.base.add(DATA_TAIL_OFFSET) as *const u64) };
+        let mut data = vec![0u8; (head - tail) as usize];
+        let data_start = unsafe { self.base.add(self.page_size) };
+        for (i, byte) in data.iter_mut().enumerate() {
+            // SAFETY: the index is wrapped within the data pages
+            *byte = unsafe { *data_start.add((tail as usize + i) % data_size) };
+        }
+        fence(Ordering::Release);
+        unsafe { ptr::write_volatile(self.base.add(DATA_TAIL_OFFSET) as *mut u64, head) };
+
+        // the kernel only moves the head over complete records
+        let mut offset = 0;
+        while offset + 8 <= data.len() {
+            let record_type = read_u32(&data, offset).unwrap_or_default();
+            let misc = u16::from_ne_bytes([data[offset + 4], data[offset + 5]]);
+            let size = u16::from_ne_bytes([data[offset + 6], data[offset + 7]]) as usize;
+            if size < 8 || offset + size > data.len() {
+                break;
+            }
+            let body = &data[offset + 8..offset + size];
+            if record_type == PERF_RECORD_LOST {
+                *lost_count += read_u64(body, 8).unwrap_or_default();
+            } else if let Some(event) = parse_record(record_type, misc, body) {
+                events.push(event);
+            }
+            offset += size;
+        }
+    }
+}
+
+impl Drop for RingBuffer {
+    fn drop(&mut self) {
+        // SAFETY: the mapping was created with this size in open
+        unsafe {
+            libc::munmap(
+                self.base as *mut _,
+                (1 + RING_BUFFER_DATA_PAGES) * self.page_size,
+            )
+        };
+    }
+}
+
+/// Samples the stacks of the processes spawned by the calling thread, on every cpu.
+///
+/// The events are inherited by the spawned processes and only enabled when they exec, so the
+/// runner itself is not sampled.
+struct StackSampler {
+    ring_buffers: Vec<RingBuffer>,
+    events: Vec<(u64, SampleEvent)>,
+    lost_count: u64,
+}
+
+impl StackSampler {
+    fn open(frequency: u64) -> Result<Self> {
+        let attr = PerfEventAttr {
+            type_: PERF_TYPE_SOFTWARE,
+            size: std::mem::size_of::<PerfEventAttr>() as u32,
+            config: PERF_COUNT_SW_CPU_CLOCK,
+            sample_period: frequency,
+            sample_type: PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN,
+            // the kernel is excluded so that the samples are available to unprivileged users
+            flags: PERF_ATTR_FLAG_DISABLED
+                | PERF_ATTR_FLAG_INHERIT
+                | PERF_ATTR_FLAG_EXCLUDE_KERNEL
+                | PERF_ATTR_FLAG_EXCLUDE_HV
+                | PERF_ATTR_FLAG_MMAP
+                | PERF_ATTR_FLAG_COMM
+                | PERF_ATTR_FLAG_FREQ
+                | PERF_ATTR_FLAG_ENABLE_ON_EXEC
+                | PERF_ATTR_FLAG_TASK
+                | PERF_ATTR_FLAG_SAMPLE_ID_ALL
+                | PERF_ATTR_FLAG_EXCLUDE_CALLCHAIN_KERNEL
+                | PERF_ATTR_FLAG_MMAP2
+                | PERF_ATTR_FLAG_COMM_EXEC,
+            ..Default::default()
+        };
+        // the inherited events can only be mapped per cpu
+        let cpu_count = unsafe { libc::sysconf(libc::_SC_NPROCESSORS_CONF) }.max(1) as i32;
+        let mut ring_buffers = vec![];
+        let mut first_error = None;
+        for cpu in 0..cpu_count {
+            match RingBuffer::open(&attr, cpu) {
+                Ok(ring_buffer) => ring_buffers.push(ring_buffer),
+                // the offline cpus cannot be sampled
+                Err(e) => {
+                    debug!("Failed to sample the stacks on cpu {}: {}", cpu, e);
+                    first_error.get_or_insert(e);
+                }
+            }
+        }
+        if ring_buffers.is_empty() {
+            bail!(
+                "Failed to open the perf_event sampler, check /proc/sys/kernel/perf_event_paranoid: {}",
+                first_error.map(|e| e.to_string()).unwrap_or_default()
+            );
+        }
+        Ok(Self {
+            ring_buffers,
+            events: vec![],
+            lost_count: 0,
+        })
+    }
+
+    fn drain(&mut self) {
+        for ring_buffer in &mut self.ring_buffers {
+            ring_buffer.drain(&mut self.events, &mut self.lost_count);
+        }
+    }
+}
+
+/// A file mapped in the memory of a process
+#[derive(Debug, Clone, PartialEq)]
+struct Mapping {
+    start: u64,
+    end: u64,
+    file_offset: u64,
+    path: String,
+}
+
+#[derive(Default, Clone)]
+struct SampledProcess {
+    name: String,
+    mappings: Vec<Mapping>,
+}
+
+/// Resolves the instruction pointers to the functions of the mapped ELF files, or of the perf
+/// maps of the JIT runtimes
+#[derive(Default)]
+struct Symbolizer {
+    elf_symbols: HashMap<String, Option<ElfSymbols>>,
+    perf_maps: HashMap<u32, Vec<PerfMapSymbol>>,
+}
+
+impl Symbolizer {
+    fn resolve(&mut self, pid: u32, process: &SampledProcess, ip: u64) -> String {
+        // the latest mappings replace the previous ones at the same addresses
+        if let Some(mapping) = process
+            .mappings
+            .iter()
+            .rev()
+            .find(|mapping| mapping.start <= ip && ip < mapping.end)
+            .filter(|mapping| mapping.path.starts_with('/') && !mapping.path.starts_with("//"))
+        {
+            let symbols = self
+                .elf_symbols
+                .entry(mapping.path.clone())
+                .or_insert_with(|| ElfSymbols::read(Path::new(&mapping.path)).ok());
+            let file_offset = ip - mapping.start + mapping.file_offset;
+            if let Some(name) = symbols
+                .as_ref()
+                .and_then(|symbols| symbols.lookup(file_offset))
+            {
+                return name.to_string();
+            }
+            let file_name = Path::new(&mapping.path)
+                .file_name()
+                .unwrap_or_default()
+                .to_string_lossy();
+            return format!("[{}]", file_name);
+        }
+        let perf_map = self
+            .perf_maps
+            .entry(pid)
+            .or_insert_with(|| read_process_perf_map(pid));
+        let index = perf_map.partition_point(|(start, _, _)| *start <= ip);
+        match index.checked_sub(1).map(|index| &perf_map[index]) {
+            Some((start, size, name)) if ip < start + size => name.clone(),
+            _ => "[unknown]".to_string(),
+        }
+    }
+}
+
+/// Replay the events of the sampled processes in order, folding their symbolized stacks into
+/// `process;outer;...;inner` keys with their sample counts
+fn fold_stacks(
+    mut events: Vec<(u64, SampleEvent)>,
+    symbolizer: &mut Symbolizer,
+) -> HashMap<String, u64> {
+    events.sort_by_key(|(time, _)| *time);
+    let mut processes: HashMap<u32, SampledProcess> = HashMap::new();
+    let mut folded_stacks = HashMap::new();
+    for (_, event) in events {
+        match event {
+            // the new threads of a process share its mappings
+            SampleEvent::Fork { pid, parent_pid } if pid != parent_pid => {
+                let parent = processes.get(&parent_pid).cloned().unwrap_or_default();
+                processes.insert(pid, parent);
+            }
+            SampleEvent::Fork { .. } => {}
+            SampleEvent::Comm { pid, name, exec } => {
+                let process = processes.entry(pid).or_default();
+                if exec {
+                    process.mappings.clear();
+                    process.name = name;
+                } else if process.name.is_empty() {
+                    process.name = name;
+                }
+            }
+            SampleEvent::Mmap { pid, mapping } => {
+                processes.entry(pid).or_default().mappings.push(mapping);
+            }
+            SampleEvent::Sample { pid, ips } => {
+                let process = processes.entry(pid).or_default();
+                let process_name = if process.name.is_empty() {
+                    pid.to_string()
+                } else {
+                    process.name.clone()
+                };
+                // the callers are found from their return addresses, past the call instruction
+                let frames = ips.iter().enumerate().rev().map(|(i, ip)| {
+                    let ip = if i == 0 { *ip } else { ip.saturating_sub(1) };
+                    symbolizer.resolve(pid, process, ip)
+                });
+                let stack = std::iter::once(process_name).chain(frames).join(";");
+                *folded_stacks.entry(stack).or_default() += 1;
+            }
+        }
+    }
+    folded_stacks
+}
+
+fn write_folded_stacks(
+    profile_folder: &Path,
+    pid: u32,
+    folded_stacks: &HashMap<String, u64>,
+) -> Result<()> {
+    let stacks_path = profile_folder.join(format!("{}.folded", pid));
+    let mut stacks_file = BufWriter::new(
+        File::create(&stacks_path)
+            .map_err(|e| anyhow!("Failed to create file: {}, {}", stacks_path.display(), e))?,
+    );
+    for (stack, count) in folded_stacks.iter().sorted() {
+        writeln!(stacks_file, "{} {}", stack, count)?;
+    }
+    stacks_file.flush()?;
+    Ok(())
+}
+
+/// Run the command natively, sampling the stacks of all its processes `frequency` times per
+/// second of cpu time. The samples are written as collapsed stacks to `<pid>.folded`, the input
+/// format of the flamegraph tools.
+pub fn run_with_stack_samples(
+    cmd: &mut Command,
+    profile_folder: &Path,
+    bench_command: &str,
+    frequency: u64,
+) -> Result<ExitStatus> {
+    let mut sampler = StackSampler::open(frequency)?;
+    let mut child = cmd
+        .spawn()
+        .map_err(|e| anyhow!("failed to execute the benchmark process. {}", e))?;
+    // the buffers are drained while the command runs for them not to overflow
+    let status = loop {
+        sampler.drain();
+        if let Some(status) = child.try_wait()? {
+            break status;
+        }
+        thread::sleep(DRAIN_INTERVAL);
+    };
+    sampler.drain();
+    if sampler.lost_count > 0 {
+        warn!(
+            "{}: {} stack samples lost, the sampling frequency may be too high",
+            bench_command, sampler.lost_count
+        );
+    }
+
+    let folded_stacks = fold_stacks(
+        std::mem::take(&mut sampler.events),
+        &mut Symbolizer::default(),
+    );
+    info!(
+        "{}: {} stack samples",
+        bench_command,
+        folded_stacks.values().sum::<u64>()
+    );
+    write_folded_stacks(profile_folder, child.id(), &folded_stacks)?;
+    Ok(status)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_fold_stacks() {
+        let mut symbolizer = Symbolizer::default();
+        symbolizer.perf_maps.insert(
+            2,
+            vec![(0x1000, 0x100, "LazyCompile:~fib bench.js:1".into())],
+        );
+        let events = vec![
+            (
+                3,
+                SampleEvent::Sample {
+                    pid: 2,
+                    ips: vec![0x1010, 0x1020, 0x9000],
+                },
+            ),
+            (
+                1,
+                SampleEvent::Comm {
+                    pid: 1,
+                    name: "node".into(),
+                    exec: true,
+                },
+            ),
+            (
+                2,
+                SampleEvent::Fork {
+                    pid: 2,
+                    parent_pid: 1,
+                },
+            ),
+            (
+                4,
+                SampleEvent::Sample {
+                    pid: 2,
+                    ips: vec![0x1010, 0x1020, 0x9000],
+                },
+            ),
+        ];
+
+        let folded_stacks = fold_stacks(events, &mut symbolizer);
+
+        assert_eq!(
+            folded_stacks,
+            HashMap::from([(
+                "node;[unknown];LazyCompile:~fib bench.js:1;LazyCompile:~fib bench.js:1".into(),
+                2
+            )])
+        );
+    }
+
+    #[test]
+    fn test_parse_sample_record() {
+        let mut body = vec![];
+        body.extend(42u32.to_ne_bytes());
+        body.extend(43u32.to_ne_bytes());
+        body.extend(1000u64.to_ne_bytes());
+        body.extend(3u64.to_ne_bytes());
+        body.extend((-512i64 as u64).to_ne_bytes());
+        body.extend(0x1010u64.to_ne_bytes());
+        body.extend(0x2020u64.to_ne_bytes());
+
+        assert_eq!(
+            parse_record(PERF_RECORD_SAMPLE, 0, &body),
+            Some((
+                1000,
+                SampleEvent::Sample {
+                    pid: 42,
+                    ips: vec![0x1010, 0x2020]
+                }
+            ))
+        );
+    }
+}
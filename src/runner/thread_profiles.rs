@@ -0,0 +1,138 @@
+use crate::prelude::*;
+use std::{
+    collections::BTreeMap,
+    fs::{self, File},
+    io::{self, BufWriter, Read, Seek, SeekFrom, Write},
+    path::{Path, PathBuf},
+};
+
+/// Returns the pid and thread id of a `<pid>.out-<tid>` profile, written by callgrind for each
+/// thread of a process with `--separate-threads=yes`
+fn parse_thread_profile_name(name: &str) -> Option<(u32, u32)> {
+    let (pid, tid) = name.split_once(".out-")?;
+    Some((pid.parse().ok()?, tid.parse().ok()?))
+}
+
+/// Returns true if the file is empty or ends with a newline, leaving it at its start
+fn ends_with_newline(file: &mut File) -> io::Result<bool> {
+    if file.metadata()?.len() == 0 {
+        return Ok(true);
+    }
+    let mut last_byte = [0];
+    file.seek(SeekFrom::End(-1))?;
+    file.read_exact(&mut last_byte)?;
+    file.rewind()?;
+    Ok(last_byte[0] == b'\n')
+}
+
+/// Append a thread profile to the combined profile, ending it with a newline
+fn append_thread_profile(path: &Path, writer: &mut impl Write) -> io::Result<()> {
+    let mut thread_file = File::open(path)?;
+    let ends_with_newline = ends_with_newline(&mut thread_file)?;
+    io::copy(&mut thread_file, writer)?;
+    if !ends_with_newline {
+        writer.write_all(b"\n")?;
+    }
+    Ok(())
+}
+
+/// Combine the `<pid>.out-<tid>` profiles of the threads of each process into its `<pid>.out`
+/// profile, the dumps of each thread being kept as separate parts with their `thread:` header.
+/// The profiles are then read like the ones of the single-threaded processes, and the costs of
+/// each thread stay available for the reports.
+pub fn combine_thread_profiles(profile_folder: &Path) -> Result<()> {
+    let mut thread_profiles: BTreeMap<u32, Vec<(u32, PathBuf)>> = BTreeMap::new();
+    for path in fs::read_dir(profile_folder)?
+        .filter_map(|entry| entry.ok())
+        .map(|entry| entry.path())
+    {
+        let Some((pid, tid)) = path
+            .file_name()
+            .and_then(|name| name.to_str())
+            .and_then(parse_thread_profile_name)
+        else {
+            continue;
+        };
+        thread_profiles.entry(pid).or_default().push((tid, path));
+    }
+
+    let mut thread_count = 0;
+    for (pid, mut paths) in thread_profiles {
+        paths.sort();
+        // the profile is renamed once complete, since it is archived as soon as it shows up
+        let profile_path = profile_folder.join(format!("{}.out", pid));
+        let partial_profile_path = profile_path.with_extension("out.partial");
+        let write_error = |e: io::Error| {
+            anyhow!(
+                "Failed to write profile: {}, {}",
+                partial_profile_path.display(),
+                e
+            )
+        };
+        let mut writer = BufWriter::new(File::create(&partial_profile_path).map_err(write_error)?);
+        for (_, path) in &paths {
+            append_thread_profile(path, &mut writer)
+                .map_err(|e| anyhow!("Failed to read thread profile: {}, {}", path.display(), e))?;
+        }
+        writer.flush().map_err(write_error)?;
+        drop(writer);
+        fs::rename(&partial_profile_path, &profile_path)?;
+        for (_, path) in &paths {
+            fs::remove_file(path)?;
+        }
+        thread_count += paths.len();
+    }
+    debug!("Combined the profiles of {} threads", thread_count);
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::runner::merge_profiles::parse_profile_content;
+
+    fn thread_profile(tid: u32, cost: u64) -> String {
+        format!(
+            "# callgrind format
+version: 1
+creator: callgrind-3.21.0
+pid: 42
+cmd: ./queue_bench
+part: 1
+thread: {}
+desc: Trigger: Client Request: queue::push
+positions: line
+events: Ir Ge
+fl=(1) queue.c
+fn=(1) push
+4 {} 2
+",
+            tid, cost
+        )
+    }
+
+    #[test]
+    fn test_combine_thread_profiles() -> Result<()> {
+        let profile_folder = std::env::temp_dir().join("codspeed_test_thread_profiles");
+        let _ = fs::remove_dir_all(&profile_folder);
+        fs::create_dir_all(&profile_folder)?;
+        fs::write(profile_folder.join("42.out-01"), thread_profile(1, 10))?;
+        fs::write(profile_folder.join("42.out-02"), thread_profile(2, 30))?;
+        fs::write(profile_folder.join("43.out"), thread_profile(1, 5))?;
+
+        combine_thread_profiles(&profile_folder)?;
+
+        let content = fs::read_to_string(profile_folder.join("42.out"))?;
+        assert!(content.contains("thread: 1\n") && content.contains("thread: 2\n"));
+        assert_eq!(parse_profile_content(42, &content)?.parts.len(), 2);
+        assert_eq!(
+            fs::read_dir(&profile_folder)?
+                .map(|entry| entry.unwrap().file_name().into_string().unwrap())
+                .sorted()
+                .collect_vec(),
+            ["42.out", "43.out"]
+        );
+        fs::remove_dir_all(&profile_folder)?;
+        Ok(())
+    }
+}
@@ -1,12 +1,32 @@
-use crate::config::Config;
+use crate::config::{AdaptiveSampling, Config, MeasurementMode, Shard};
 use crate::prelude::*;
+use crate::runner::helpers::cache_dir::get_cache_dir;
+use crate::runner::helpers::cache_geometry::get_cache_simulation_folder;
 use crate::runner::helpers::ignored_objects_path::get_objects_path_to_ignore;
-use crate::runner::helpers::introspected_node::setup_introspected_node;
+use crate::runner::helpers::introspected_node::{setup_introspected_node, FLAGS_CACHE_DIR_ENV};
+use crate::runner::memory_profile::DHAT_PROFILE_EXTENSION;
+use crate::runner::perf_counters::{run_with_counters, write_profile};
+use crate::runner::stack_samples::run_with_stack_samples;
+use crate::runner::thread_profiles::combine_thread_profiles;
+use crate::runner::walltime::{run_samples, NoiseReduction};
+use crate::telemetry;
+use crate::uploader::{CacheGeometry, CacheSimulation};
 use lazy_static::lazy_static;
 use std::env;
+use std::fs;
 use std::fs::canonicalize;
-use std::path::Path;
-use std::{collections::HashMap, env::consts::ARCH, process::Command};
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+use std::thread;
+use std::{
+    collections::HashMap,
+    env::consts::ARCH,
+    process::{Command, ExitStatus},
+};
+
+/// The profile of each thread is written to `<pid>.out-<tid>`, the global bus events counting the
+/// atomic instructions
+const SEPARATE_THREADS_ARGS: &[&str] = &["--separate-threads=yes", "--collect-bus=yes"];
 
 lazy_static! {
     static ref BASE_INJECTED_ENV: HashMap<&'static str, String> = {
@@ -25,9 +45,6 @@ lazy_static! {
                 "--tool=callgrind",
                 "--trace-children=yes",
                 "--cache-sim=yes",
-                "--I1=32768,8,64",
-                "--D1=32768,8,64",
-                "--LL=8388608,16,64",
                 "--instr-atstart=no",
                 "--collect-systime=nsec",
                 "--compress-strings=no",
@@ -44,57 +61,406 @@ lazy_static! {
         ));
         args
     };
+    static ref DHAT_BASE_ARGS: Vec<String> = ["-q", "--tool=dhat", "--trace-children=yes"]
+        .iter()
+        .map(|x| x.to_string())
+        .collect();
 }
 
-fn get_bench_command(config: &Config) -> String {
-    let bench_command = &config.command;
+pub(super) fn normalize_bench_command(bench_command: &str) -> String {
     bench_command
         // Fixes a compatibility issue with cargo 1.66+ running directly under valgrind <3.20
         .replace("cargo codspeed", "cargo-codspeed")
 }
 
-pub fn measure(config: &Config, profile_folder: &Path) -> Result<()> {
-    debug!("profile dir: {}", profile_folder.display());
+fn get_bench_command(config: &Config) -> String {
+    normalize_bench_command(&config.command)
+}
 
-    // Create the command
-    let mut cmd = Command::new("setarch");
-    cmd.arg(ARCH).arg("-R");
-    // Configure the environment
-    cmd.envs(BASE_INJECTED_ENV.iter()).env(
-        "PATH",
-        format!(
+/// The commands only changing the state of the shell for the following lines
+const SHELL_STATE_COMMANDS: [&str; 2] = ["cd", "export"];
+
+/// Split the bench command in shards that can be measured in parallel, one per non-empty line
+pub(super) fn get_bench_shards(config: &Config) -> Vec<String> {
+    get_bench_command(config)
+        .lines()
+        .map(|line| line.trim())
+        .filter(|line| !line.is_empty())
+        .map(|line| line.to_string())
+        .collect()
+}
+
+/// Returns whether the line only changes the directory or the environment, e.g. `cd bench`,
+/// unlike `cd bench && pytest` which runs a benchmark in the same shell
+fn is_shell_state_line(line: &str) -> bool {
+    let is_shell_state_command = line
+        .split_whitespace()
+        .next()
+        .is_some_and(|command| SHELL_STATE_COMMANDS.contains(&command));
+    is_shell_state_command
+        && !["&&", "||", ";", "|"]
+            .iter()
+            .any(|separator| line.contains(separator))
+}
+
+/// Check that the lines of a bench command split in several shards run on their own, each shard
+/// running in its own shell: the lines continued on the next one or only changing the directory
+/// or the environment of the following ones are rejected
+fn check_standalone_lines(lines: &[String]) -> Result<()> {
+    if lines.len() < 2 {
+        return Ok(());
+    }
+    for line in lines {
+        if line.ends_with('\\') {
+            bail!(
+                "Failed to split the bench command in shards: {}, the line is continued on the next one, each line must be a standalone benchmark command",
+                line
+            );
+        }
+        if is_shell_state_line(line) {
+            bail!(
+                "Failed to split the bench command in shards: {}, the lines run in separate shells, each line must be a standalone benchmark command",
+                line
+            );
+        }
+    }
+    Ok(())
+}
+
+/// Select the lines of the bench command run by this CI job, distributed in a round-robin
+/// fashion among the jobs the benchmarks are sharded across
+fn get_ci_shard_lines(lines: Vec<String>, shard: Shard) -> Vec<String> {
+    lines
+        .into_iter()
+        .enumerate()
+        .filter(|(i, _)| i % shard.count == shard.index)
+        .map(|(_, line)| line)
+        .collect()
+}
+
+/// A profile recorded by running the benchmarks once more, after their measurement
+#[derive(Clone, Copy, PartialEq, Debug)]
+enum ExtraProfile {
+    /// The heap profile of DHAT
+    Heap,
+    /// The stack samples of the native processes, taken `frequency` times per second
+    Stacks { frequency: u64 },
+}
+
+/// The environment of the measured processes, shared by all the shards
+#[derive(Clone)]
+struct MeasureEnv {
+    mode: MeasurementMode,
+    /// The profile recorded instead of measuring the benchmarks, if any
+    extra_profile: Option<ExtraProfile>,
+    walltime_samples: usize,
+    adaptive_sampling: Option<AdaptiveSampling>,
+    cache_geometry: Option<CacheGeometry>,
+    separate_threads: bool,
+    path: String,
+    /// The tools directory of the relocatable valgrind toolchain, if used
+    valgrind_lib: Option<PathBuf>,
+    node_flags_cache_dir: PathBuf,
+    cwd: Option<PathBuf>,
+    /// The objects whose costs are charged to their callers, with --obj-skip
+    objects_path_to_ignore: Vec<String>,
+    instrumentation_scope_args: Vec<String>,
+}
+
+impl MeasureEnv {
+    fn new(config: &Config, valgrind_root: Option<&Path>) -> Result<Self> {
+        let _phase = telemetry::phase("Introspect the interpreters");
+        let cache_dir = get_cache_dir(config);
+        let mut path = format!(
             "{}:{}",
             setup_introspected_node()
                 .map_err(|e| anyhow!("failed to setup NodeJS introspection. {}", e))?
                 .to_str()
                 .unwrap(),
             env::var("PATH").unwrap_or_default(),
-        ),
+        );
+        if let Some(valgrind_root) = valgrind_root {
+            path = format!("{}:{}", valgrind_root.join("bin").display(), path);
+        }
+        let cwd = match &config.working_directory {
+            Some(cwd) => Some(canonicalize(cwd)?),
+            None => None,
+        };
+        Ok(Self {
+            mode: config.mode,
+            extra_profile: None,
+            walltime_samples: config.walltime_samples,
+            adaptive_sampling: config.adaptive_sampling,
+            cache_geometry: config.cache_geometry,
+            separate_threads: config.separate_threads,
+            path,
+            valgrind_lib: valgrind_root.map(|root| root.join("libexec/valgrind")),
+            node_flags_cache_dir: cache_dir.join("node_flags"),
+            cwd,
+            objects_path_to_ignore: get_objects_path_to_ignore(&cache_dir)
+                .into_iter()
+                .chain(config.skipped_objects.iter().cloned())
+                .collect(),
+            instrumentation_scope_args: get_instrumentation_scope_args(config),
+        })
+    }
+
+    /// The name of the valgrind logs of the run
+    fn log_name(&self) -> &'static str {
+        match self.extra_profile {
+            Some(ExtraProfile::Heap) => "dhat",
+            _ => "valgrind",
+        }
+    }
+}
+
+/// The callgrind options restricting the collection of the costs within the instrumented window.
+/// The skipped functions are still measured, their costs being charged to their callers.
+fn get_instrumentation_scope_args(config: &Config) -> Vec<String> {
+    let mut args = vec![];
+    if let Some(collect_atstart) = config.collect_atstart {
+        args.push(format!(
+            "--collect-atstart={}",
+            if collect_atstart { "yes" } else { "no" }
+        ));
+    }
+    args.extend(
+        config
+            .toggle_collect
+            .iter()
+            .map(|function| format!("--toggle-collect={}", function)),
+    );
+    args.extend(
+        config
+            .skipped_functions
+            .iter()
+            .map(|function| format!("--fn-skip={}", function)),
     );
-    if let Some(cwd) = &config.working_directory {
-        let abs_cwd = canonicalize(cwd)?;
-        cmd.current_dir(abs_cwd);
+    args
+}
+
+fn get_measure_command(
+    measure_env: &MeasureEnv,
+    profile_folder: &Path,
+    log_path: &Path,
+    bench_command: &str,
+) -> Command {
+    // Create the command
+    let mut cmd = Command::new("setarch");
+    cmd.arg(ARCH).arg("-R");
+    // Configure the environment
+    cmd.envs(BASE_INJECTED_ENV.iter())
+        .env("CODSPEED_RUNNER_MODE", measure_env.mode.name())
+        .env("PATH", &measure_env.path)
+        .env(FLAGS_CACHE_DIR_ENV, &measure_env.node_flags_cache_dir);
+    // the integrations sampling the benchmarks themselves follow the same target: they sample
+    // each benchmark until the half-width of the 95% confidence interval of its median, relative
+    // to the median, is at most CODSPEED_TARGET_PRECISION (a fraction, e.g. 0.01), or until
+    // CODSPEED_TIME_BUDGET_MS milliseconds were spent sampling it
+    if let Some(adaptive_sampling) = measure_env.adaptive_sampling {
+        cmd.env(
+            "CODSPEED_TARGET_PRECISION",
+            adaptive_sampling.target_precision.to_string(),
+        )
+        .env(
+            "CODSPEED_TIME_BUDGET_MS",
+            adaptive_sampling.time_budget.as_millis().to_string(),
+        );
+    }
+    if let Some(valgrind_lib) = &measure_env.valgrind_lib {
+        cmd.env("VALGRIND_LIB", valgrind_lib);
     }
-    // Configure valgrind
+    if let Some(cwd) = &measure_env.cwd {
+        cmd.current_dir(cwd);
+    }
+    match measure_env.extra_profile {
+        Some(ExtraProfile::Heap) => add_dhat_args(&mut cmd, profile_folder, log_path),
+        Some(ExtraProfile::Stacks { .. }) => {}
+        None if measure_env.mode == MeasurementMode::Instrumentation => {
+            add_valgrind_args(&mut cmd, measure_env, profile_folder, log_path)
+        }
+        None => {}
+    }
+
+    // Set the command to execute
+    cmd.args(["sh", "-c", bench_command]);
+    cmd
+}
+
+fn add_valgrind_args(
+    cmd: &mut Command,
+    measure_env: &MeasureEnv,
+    profile_folder: &Path,
+    log_path: &Path,
+) {
     let profile_path = profile_folder.join("%p.out");
-    let log_path = profile_folder.join("valgrind.log");
     cmd.arg("valgrind")
         .args(VALGRIND_BASE_ARGS.iter())
         .args(
-            get_objects_path_to_ignore()
+            measure_env
+                .cache_geometry
+                .map(|cache_geometry| cache_geometry.valgrind_args())
+                .unwrap_or_default(),
+        )
+        .args(
+            measure_env
+                .objects_path_to_ignore
                 .iter()
                 .map(|x| format!("--obj-skip={}", x)),
         )
+        .args(measure_env.instrumentation_scope_args.iter())
         .arg(format!("--callgrind-out-file={}", profile_path.to_str().unwrap()).as_str())
         .arg(format!("--log-file={}", log_path.to_str().unwrap()).as_str());
+    if measure_env.separate_threads {
+        cmd.args(SEPARATE_THREADS_ARGS);
+    }
+}
 
-    // Set the command to execute
-    cmd.args(["sh", "-c", get_bench_command(config).as_str()]);
+fn add_dhat_args(cmd: &mut Command, profile_folder: &Path, log_path: &Path) {
+    let profile_path = profile_folder.join(format!("%p.{}", DHAT_PROFILE_EXTENSION));
+    cmd.arg("valgrind")
+        .args(DHAT_BASE_ARGS.iter())
+        .arg(format!("--dhat-out-file={}", profile_path.to_str().unwrap()).as_str())
+        .arg(format!("--log-file={}", log_path.to_str().unwrap()).as_str());
+}
+
+/// Run a measure command. When measured natively, the profile of the command is written to the
+/// profile folder once it exits.
+fn run_measure_command(
+    measure_env: &MeasureEnv,
+    profile_folder: &Path,
+    cmd: &mut Command,
+    bench_command: &str,
+) -> Result<ExitStatus> {
+    match measure_env.extra_profile {
+        Some(ExtraProfile::Heap) => {
+            return cmd
+                .status()
+                .map_err(|e| anyhow!("failed to execute the benchmark process. {}", e));
+        }
+        Some(ExtraProfile::Stacks { frequency }) => {
+            return run_with_stack_samples(cmd, profile_folder, bench_command, frequency);
+        }
+        None => {}
+    }
+    match measure_env.mode {
+        MeasurementMode::Instrumentation => Ok(cmd
+            .status()
+            .map_err(|e| anyhow!("failed to execute the benchmark process. {}", e))?),
+        MeasurementMode::PerfCounters => {
+            let (pid, status, values) = run_with_counters(cmd)?;
+            debug!(
+                "{}: {} instructions, {} cycles, {} ns",
+                bench_command, values.instructions, values.cycles, values.walltime_ns
+            );
+            write_profile(profile_folder, pid, bench_command, &values)?;
+            Ok(status)
+        }
+        MeasurementMode::Walltime => run_samples(
+            cmd,
+            profile_folder,
+            bench_command,
+            measure_env.walltime_samples,
+            measure_env.adaptive_sampling,
+        ),
+    }
+}
+
+/// Measure the shards in parallel, `jobs` at a time. Callgrind counts instructions, so the
+/// results do not depend on the number of processes sharing the machine.
+fn measure_shards(
+    measure_env: &MeasureEnv,
+    profile_folder: &Path,
+    shards: Vec<String>,
+    jobs: usize,
+) -> Result<()> {
+    let shards_count = shards.len();
+    info!(
+        "Running {} benchmark shards, {} at a time",
+        shards_count,
+        jobs.min(shards_count)
+    );
+    let pending_shards = Mutex::new(shards.into_iter().enumerate());
+    let failed_shards = Mutex::new(vec![]);
+    thread::scope(|scope| {
+        for _ in 0..jobs.min(shards_count) {
+            scope.spawn(|| loop {
+                let Some((shard_index, shard)) = pending_shards.lock().unwrap().next() else {
+                    break;
+                };
+                info!(
+                    "Running shard {}/{}: {}",
+                    shard_index + 1,
+                    shards_count,
+                    shard
+                );
+                let log_path =
+                    profile_folder.join(format!("{}.{}.log", measure_env.log_name(), shard_index));
+                let mut cmd = get_measure_command(measure_env, profile_folder, &log_path, &shard);
+                debug!("cmd: {:?}", cmd);
+                let success =
+                    match run_measure_command(measure_env, profile_folder, &mut cmd, &shard) {
+                        Ok(status) => status.success(),
+                        Err(e) => {
+                            error!("failed to execute the benchmark shard {}. {}", shard, e);
+                            false
+                        }
+                    };
+                if !success {
+                    failed_shards.lock().unwrap().push(shard);
+                }
+            });
+        }
+    });
 
+    let failed_shards = failed_shards.into_inner().unwrap();
+    if !failed_shards.is_empty() {
+        bail!(
+            "failed to execute the benchmark shards: {}",
+            failed_shards.join(", ")
+        );
+    }
+    Ok(())
+}
+
+/// Run the bench command, except its `skipped_lines`, in the measure environment
+fn run_bench_command(
+    config: &Config,
+    measure_env: &MeasureEnv,
+    profile_folder: &Path,
+    skipped_lines: &[String],
+    jobs: usize,
+) -> Result<()> {
+    if config.shard.is_some() || !skipped_lines.is_empty() {
+        let shards = get_bench_shards(config);
+        check_standalone_lines(&shards)?;
+        let mut shards = shards
+            .into_iter()
+            .filter(|line| !skipped_lines.contains(line))
+            .collect_vec();
+        if let Some(shard) = config.shard {
+            shards = get_ci_shard_lines(shards, shard);
+        }
+        if shards.is_empty() {
+            warn!("No benchmarks to run");
+            return Ok(());
+        }
+        return measure_shards(measure_env, profile_folder, shards, jobs);
+    }
+
+    if jobs > 1 {
+        let shards = get_bench_shards(config);
+        if shards.len() > 1 {
+            check_standalone_lines(&shards)?;
+            return measure_shards(measure_env, profile_folder, shards, jobs);
+        }
+    }
+
+    let log_path = profile_folder.join(format!("{}.log", measure_env.log_name()));
+    let bench_command = get_bench_command(config);
+    let mut cmd = get_measure_command(measure_env, profile_folder, &log_path, &bench_command);
     debug!("cmd: {:?}", cmd);
-    let status = cmd
-        .status()
-        .map_err(|e| anyhow!("failed to execute the benchmark process. {}", e))?;
+    let status = run_measure_command(measure_env, profile_folder, &mut cmd, &bench_command)?;
     if !status.success() {
         bail!("failed to execute the benchmark process");
     }
@@ -102,6 +468,159 @@ pub fn measure(config: &Config, profile_folder: &Path) -> Result<()> {
     Ok(())
 }
 
+/// Run the bench command in the cache simulation folder, with its cache geometry
+fn run_cache_simulation(
+    config: &Config,
+    measure_env: &MeasureEnv,
+    profile_folder: &Path,
+    skipped_lines: &[String],
+    jobs: usize,
+    simulation: &CacheSimulation,
+) -> Result<()> {
+    let simulation_folder = get_cache_simulation_folder(profile_folder, simulation);
+    fs::create_dir_all(&simulation_folder).map_err(|e| {
+        anyhow!(
+            "Failed to create folder: {}, {}",
+            simulation_folder.display(),
+            e
+        )
+    })?;
+    let simulation_env = MeasureEnv {
+        cache_geometry: Some(simulation.cache_geometry),
+        ..measure_env.clone()
+    };
+    run_bench_command(
+        config,
+        &simulation_env,
+        &simulation_folder,
+        skipped_lines,
+        jobs,
+    )
+    .map_err(|e| anyhow!("{} cache simulation: {}", simulation.label, e))
+}
+
+/// Run the bench command once per simulated cache geometry, callgrind simulating a single cache
+/// hierarchy per run. The runs share the working directory of the benchmarks, so they are one
+/// after another unless the benchmarks support concurrent runs, the instruction counts not
+/// depending on the load of the machine.
+fn measure_cache_simulations(
+    config: &Config,
+    measure_env: &MeasureEnv,
+    profile_folder: &Path,
+    skipped_lines: &[String],
+    jobs: usize,
+) -> Result<()> {
+    info!(
+        "Simulating {} extra cache geometries{}: {}",
+        config.cache_simulations.len(),
+        if config.parallel_cache_simulations {
+            " in parallel"
+        } else {
+            ""
+        },
+        config
+            .cache_simulations
+            .iter()
+            .map(|simulation| &simulation.label)
+            .join(", ")
+    );
+    let run_simulation = |simulation| {
+        run_cache_simulation(
+            config,
+            measure_env,
+            profile_folder,
+            skipped_lines,
+            jobs,
+            simulation,
+        )
+    };
+    if !config.parallel_cache_simulations {
+        run_bench_command(config, measure_env, profile_folder, skipped_lines, jobs)?;
+        return config.cache_simulations.iter().try_for_each(run_simulation);
+    }
+    thread::scope(|scope| {
+        let handles = config
+            .cache_simulations
+            .iter()
+            .map(|simulation| scope.spawn(move || run_simulation(simulation)))
+            .collect_vec();
+        let result = run_bench_command(config, measure_env, profile_folder, skipped_lines, jobs);
+        handles
+            .into_iter()
+            .map(|handle| handle.join().unwrap())
+            .fold(result, |result, simulation_result| {
+                result.and(simulation_result)
+            })
+    })
+}
+
+/// Measure the bench command, except its `skipped_lines`. With `--memory-profile`, the
+/// benchmarks are then run once more under DHAT, writing a `<pid>.dhat.json` heap profile per
+/// process, and with `--stack-sampling-frequency`, once more natively to sample their stacks.
+///
+/// `valgrind_root` is the root of the relocatable valgrind toolchain, when valgrind is not
+/// installed system-wide.
+pub fn measure(
+    config: &Config,
+    profile_folder: &Path,
+    skipped_lines: &[String],
+    valgrind_root: Option<&Path>,
+) -> Result<()> {
+    debug!("profile dir: {}", profile_folder.display());
+    let measure_env = MeasureEnv::new(config, valgrind_root)?;
+    let mut jobs = config.jobs;
+    // the cycles and the wall time depend on the load of the machine, unlike the instructions
+    if config.mode != MeasurementMode::Instrumentation && jobs > 1 {
+        warn!(
+            "The shards are measured one at a time in {} mode",
+            config.mode.name()
+        );
+        jobs = 1;
+    }
+    let _noise_reduction = (config.mode == MeasurementMode::Walltime).then(NoiseReduction::apply);
+
+    if config.cache_simulations.is_empty() {
+        run_bench_command(config, &measure_env, profile_folder, skipped_lines, jobs)?;
+    } else {
+        measure_cache_simulations(config, &measure_env, profile_folder, skipped_lines, jobs)?;
+    }
+    if config.separate_threads {
+        combine_thread_profiles(profile_folder)?;
+        for simulation in &config.cache_simulations {
+            combine_thread_profiles(&get_cache_simulation_folder(profile_folder, simulation))?;
+        }
+    }
+    if config.memory_profile {
+        let _phase = telemetry::phase("Profile the memory");
+        info!("Profiling the heap of the benchmarks");
+        // the heap profiles do not depend on the load of the machine, unlike the native modes
+        let memory_env = MeasureEnv {
+            extra_profile: Some(ExtraProfile::Heap),
+            ..measure_env.clone()
+        };
+        run_bench_command(
+            config,
+            &memory_env,
+            profile_folder,
+            skipped_lines,
+            config.jobs,
+        )?;
+    }
+    if let Some(frequency) = config.stack_sampling_frequency {
+        let _phase = telemetry::phase("Sample the stacks");
+        info!(
+            "Sampling the stacks of the benchmarks {} times per second",
+            frequency
+        );
+        let sampling_env = MeasureEnv {
+            extra_profile: Some(ExtraProfile::Stacks { frequency }),
+            ..measure_env
+        };
+        run_bench_command(config, &sampling_env, profile_folder, skipped_lines, jobs)?;
+    }
+    Ok(())
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -135,4 +654,82 @@ pytest tests/ --codspeed
 "#
         );
     }
+
+    #[test]
+    fn test_get_bench_shards_multiline() {
+        let config = Config {
+            command: r#"
+cargo codspeed bench --features "foo bar"
+
+  pnpm vitest bench "my-app"
+pytest tests/ --codspeed
+"#
+            .into(),
+            ..Config::test()
+        };
+        assert_eq!(
+            get_bench_shards(&config),
+            vec![
+                r#"cargo-codspeed bench --features "foo bar""#,
+                r#"pnpm vitest bench "my-app""#,
+                "pytest tests/ --codspeed",
+            ]
+        );
+    }
+
+    #[test]
+    fn test_get_bench_shards_dependent_lines() {
+        let check_command = |command: &str| {
+            let config = Config {
+                command: command.into(),
+                ..Config::test()
+            };
+            check_standalone_lines(&get_bench_shards(&config))
+        };
+        for command in [
+            "pytest tests/ \\\n  --codspeed",
+            "cd bench\npytest --codspeed",
+            "export RUSTFLAGS=-g\ncargo codspeed bench",
+        ] {
+            assert!(check_command(command).is_err(), "{}", command);
+        }
+        for command in [
+            "cd bench && pytest --codspeed\ncargo codspeed bench",
+            "export RUSTFLAGS=-g; cargo codspeed bench\npytest --codspeed",
+            "cd bench",
+        ] {
+            assert!(check_command(command).is_ok(), "{}", command);
+        }
+    }
+
+    #[test]
+    fn test_get_ci_shard_lines() {
+        let lines = (0..5).map(|i| format!("bench {}", i)).collect_vec();
+        assert_eq!(
+            get_ci_shard_lines(lines.clone(), Shard { index: 0, count: 2 }),
+            vec!["bench 0", "bench 2", "bench 4"]
+        );
+        assert_eq!(
+            get_ci_shard_lines(lines, Shard { index: 1, count: 2 }),
+            vec!["bench 1", "bench 3"]
+        );
+    }
+
+    #[test]
+    fn test_get_instrumentation_scope_args() {
+        let config = Config {
+            collect_atstart: Some(false),
+            toggle_collect: vec!["bench_*".into()],
+            skipped_functions: vec!["load_fixtures".into()],
+            ..Config::test()
+        };
+        assert_eq!(
+            get_instrumentation_scope_args(&config),
+            vec![
+                "--collect-atstart=no",
+                "--toggle-collect=bench_*",
+                "--fn-skip=load_fixtures",
+            ]
+        );
+    }
 }
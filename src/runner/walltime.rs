@@ -0,0 +1,331 @@
+use crate::config::AdaptiveSampling;
+use crate::prelude::*;
+use serde::Serialize;
+use std::{
+    fs, io,
+    path::{Path, PathBuf},
+    process::{Command, ExitStatus},
+    time::{Duration, Instant},
+};
+
+const ISOLATED_CPUS_PATH: &str = "/sys/devices/system/cpu/isolated";
+/// Written to disable turbo boost on intel_pstate systems
+const INTEL_NO_TURBO_PATH: &str = "/sys/devices/system/cpu/intel_pstate/no_turbo";
+/// Written to disable frequency boosting on acpi-cpufreq systems
+const CPUFREQ_BOOST_PATH: &str = "/sys/devices/system/cpu/cpufreq/boost";
+/// Samples further from the median than this number of scaled MADs are outliers
+const OUTLIER_THRESHOLD: f64 = 3.0;
+/// Scales the MAD into a consistent estimator of the standard deviation of normal samples
+const MAD_SCALE: f64 = 1.4826;
+/// The quantile of the normal distribution bounding the 95% confidence intervals
+const CONFIDENCE_Z: f64 = 1.96;
+/// The asymptotic standard error of the median of normal samples over the one of their mean,
+/// sqrt(pi / 2)
+const MEDIAN_STANDARD_ERROR_SCALE: f64 = 1.2533;
+/// The samples taken before the precision is estimated, the MAD of fewer samples being unstable
+const MIN_ADAPTIVE_SAMPLES: usize = 5;
+
+/// Parse a cpu list as written by the kernel, e.g. `2-3,6`
+fn parse_cpu_list(cpu_list: &str) -> Result<Vec<usize>> {
+    let mut cpus = vec![];
+    for range in cpu_list.trim().split(',').filter(|range| !range.is_empty()) {
+        let (start, end) = range.split_once('-').unwrap_or((range, range));
+        let (start, end): (usize, usize) = (start.parse()?, end.parse()?);
+        cpus.extend(start..=end);
+    }
+    Ok(cpus)
+}
+
+fn get_affinity() -> io::Result<libc::cpu_set_t> {
+    // SAFETY: cpu_set_t is a plain bitmask, valid when zeroed
+    let mut cpu_set: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+    if unsafe { libc::sched_getaffinity(0, std::mem::size_of_val(&cpu_set), &mut cpu_set) } < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(cpu_set)
+}
+
+/// Set the affinity of the calling thread, inherited by the threads and processes it spawns
+fn set_affinity(cpu_set: &libc::cpu_set_t) -> io::Result<()> {
+    if unsafe { libc::sched_setaffinity(0, std::mem::size_of_val(cpu_set), cpu_set) } < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Reduces the sources of noise of the walltime measurements while it is alive: the benchmarks
+/// are pinned to the isolated cpus and the frequency boosting is turned off. Each setting is
+/// skipped when the runner lacks the permission to change it, and restored when dropped.
+pub struct NoiseReduction {
+    previous_affinity: Option<libc::cpu_set_t>,
+    /// The frequency settings changed, with their previous value
+    previous_settings: Vec<(PathBuf, String)>,
+}
+
+impl NoiseReduction {
+    pub fn apply() -> Self {
+        let mut noise_reduction = Self {
+            previous_affinity: None,
+            previous_settings: vec![],
+        };
+        if let Err(e) = noise_reduction.pin_to_isolated_cpus() {
+            warn!("Failed to pin the benchmarks to the isolated cpus: {}", e);
+        }
+        noise_reduction.write_setting(INTEL_NO_TURBO_PATH, "1");
+        noise_reduction.write_setting(CPUFREQ_BOOST_PATH, "0");
+        noise_reduction
+    }
+
+    fn pin_to_isolated_cpus(&mut self) -> Result<()> {
+        let isolated_cpus = parse_cpu_list(&fs::read_to_string(ISOLATED_CPUS_PATH)?)?;
+        if isolated_cpus.is_empty() {
+            info!("No isolated cpus, the benchmarks are not pinned");
+            return Ok(());
+        }
+        let previous_affinity = get_affinity()?;
+        // SAFETY: cpu_set_t is a plain bitmask, valid when zeroed
+        let mut cpu_set: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+        for cpu in &isolated_cpus {
+            unsafe { libc::CPU_SET(*cpu, &mut cpu_set) };
+        }
+        set_affinity(&cpu_set)?;
+        self.previous_affinity = Some(previous_affinity);
+        info!(
+            "Pinned the benchmarks to the isolated cpus: {:?}",
+            isolated_cpus
+        );
+        Ok(())
+    }
+
+    fn write_setting(&mut self, path: &str, value: &str) {
+        let Ok(previous_value) = fs::read_to_string(path) else {
+            return;
+        };
+        match fs::write(path, value) {
+            Ok(()) => {
+                debug!("Set {} to {}", path, value);
+                self.previous_settings
+                    .push((path.into(), previous_value.trim().to_string()));
+            }
+            Err(e) => debug!("Failed to set {} to {}: {}", path, value, e),
+        }
+    }
+}
+
+impl Drop for NoiseReduction {
+    fn drop(&mut self) {
+        if let Some(previous_affinity) = &self.previous_affinity {
+            if let Err(e) = set_affinity(previous_affinity) {
+                warn!("Failed to restore the cpu affinity: {}", e);
+            }
+        }
+        for (path, previous_value) in &self.previous_settings {
+            if let Err(e) = fs::write(path, previous_value) {
+                warn!("Failed to restore {}: {}", path.display(), e);
+            }
+        }
+    }
+}
+
+/// The timing distribution of the samples of a bench command
+#[derive(Serialize, Debug, PartialEq)]
+#[serde(rename_all = "camelCase")]
+struct WalltimeResult {
+    command: String,
+    samples_ns: Vec<u64>,
+    min_ns: u64,
+    median_ns: u64,
+    /// The median absolute deviation from the median
+    mad_ns: u64,
+    /// The indices of the samples further than 3 scaled MADs from the median
+    outliers: Vec<usize>,
+    /// The half-width of the 95% confidence interval of the median, estimated from the MAD
+    ci_half_width_ns: u64,
+}
+
+fn median(sorted_values: &[u64]) -> u64 {
+    let middle = sorted_values.len() / 2;
+    if sorted_values.len() % 2 == 0 {
+        (sorted_values[middle - 1] + sorted_values[middle]) / 2
+    } else {
+        sorted_values[middle]
+    }
+}
+
+impl WalltimeResult {
+    fn new(command: &str, samples_ns: Vec<u64>) -> Self {
+        let mut sorted_samples = samples_ns.clone();
+        sorted_samples.sort_unstable();
+        let median_ns = median(&sorted_samples);
+        let mut deviations = samples_ns
+            .iter()
+            .map(|sample| sample.abs_diff(median_ns))
+            .collect_vec();
+        deviations.sort_unstable();
+        let mad_ns = median(&deviations);
+        let threshold = OUTLIER_THRESHOLD * MAD_SCALE * mad_ns as f64;
+        let outliers = samples_ns
+            .iter()
+            .enumerate()
+            .filter(|(_, sample)| sample.abs_diff(median_ns) as f64 > threshold)
+            .map(|(i, _)| i)
+            .collect();
+        let ci_half_width_ns =
+            CONFIDENCE_Z * MEDIAN_STANDARD_ERROR_SCALE * MAD_SCALE * mad_ns as f64
+                / (samples_ns.len() as f64).sqrt();
+        Self {
+            command: command.to_string(),
+            min_ns: sorted_samples[0],
+            median_ns,
+            mad_ns,
+            outliers,
+            ci_half_width_ns: ci_half_width_ns.round() as u64,
+            samples_ns,
+        }
+    }
+
+    /// The half-width of the confidence interval relative to the median
+    fn relative_precision(&self) -> f64 {
+        self.ci_half_width_ns as f64 / self.median_ns.max(1) as f64
+    }
+}
+
+/// Returns whether enough samples were taken, either `samples` or, with an adaptive sampling, the
+/// ones reaching the target precision or spending the time budget
+fn is_sampling_done(
+    samples_ns: &[u64],
+    samples: usize,
+    adaptive_sampling: Option<AdaptiveSampling>,
+    sampling_time: Duration,
+) -> bool {
+    let Some(adaptive_sampling) = adaptive_sampling else {
+        return samples_ns.len() >= samples.max(1);
+    };
+    if sampling_time >= adaptive_sampling.time_budget {
+        return true;
+    }
+    samples_ns.len() >= MIN_ADAPTIVE_SAMPLES
+        && WalltimeResult::new("", samples_ns.to_vec()).relative_precision()
+            <= adaptive_sampling.target_precision
+}
+
+/// Run the command `samples` times, or until the target of the adaptive sampling is reached, and
+/// write the timing distribution to `walltime-<pid>.json` in the profile folder, the upload
+/// metadata telling the walltime runs apart by their mode
+pub fn run_samples(
+    cmd: &mut Command,
+    profile_folder: &Path,
+    bench_command: &str,
+    samples: usize,
+    adaptive_sampling: Option<AdaptiveSampling>,
+) -> Result<ExitStatus> {
+    let mut samples_ns = Vec::with_capacity(samples);
+    let mut first_pid = None;
+    let mut status = None;
+    let sampling_start = Instant::now();
+    while !is_sampling_done(
+        &samples_ns,
+        samples,
+        adaptive_sampling,
+        sampling_start.elapsed(),
+    ) {
+        let start = Instant::now();
+        let mut child = cmd
+            .spawn()
+            .map_err(|e| anyhow!("failed to execute the benchmark process. {}", e))?;
+        let sample_status = child.wait()?;
+        let elapsed = start.elapsed();
+        if !sample_status.success() {
+            return Ok(sample_status);
+        }
+        first_pid.get_or_insert(child.id());
+        samples_ns.push(elapsed.as_nanos() as u64);
+        status = Some(sample_status);
+    }
+
+    let result = WalltimeResult::new(bench_command, samples_ns);
+    info!(
+        "{}: median {} ns, MAD {} ns, {} outliers in {} samples, ±{:.2}%",
+        bench_command,
+        result.median_ns,
+        result.mad_ns,
+        result.outliers.len(),
+        result.samples_ns.len(),
+        result.relative_precision() * 100.0
+    );
+    if let Some(adaptive_sampling) = adaptive_sampling {
+        if result.relative_precision() > adaptive_sampling.target_precision {
+            warn!(
+                "{}: the target precision was not reached within the time budget",
+                bench_command
+            );
+        }
+    }
+    let result_path = profile_folder.join(format!("walltime-{}.json", first_pid.unwrap()));
+    fs::write(&result_path, serde_json::to_string_pretty(&result)?).map_err(|e| {
+        anyhow!(
+            "Failed to write walltime results: {}, {}",
+            result_path.display(),
+            e
+        )
+    })?;
+    Ok(status.unwrap())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_cpu_list() {
+        assert_eq!(parse_cpu_list("2-3,6\n").unwrap(), vec![2, 3, 6]);
+        assert!(parse_cpu_list("\n").unwrap().is_empty());
+    }
+
+    #[test]
+    fn test_walltime_result() {
+        let result = WalltimeResult::new("bench", vec![100, 102, 98, 101, 250, 99]);
+        assert_eq!(result.min_ns, 98);
+        assert_eq!(result.median_ns, 100);
+        assert_eq!(result.mad_ns, 1);
+        assert_eq!(result.outliers, vec![4]);
+        // 1.96 * 1.2533 * 1.4826 * 1 / sqrt(6)
+        assert_eq!(result.ci_half_width_ns, 1);
+    }
+
+    #[test]
+    fn test_is_sampling_done() {
+        let adaptive_sampling = Some(AdaptiveSampling {
+            target_precision: 0.01,
+            time_budget: Duration::from_secs(10),
+        });
+        let stable_samples = [1000, 1001, 999, 1000, 1002];
+        let noisy_samples = [1000, 1200, 800, 1100, 900];
+        assert!(!is_sampling_done(&[], 10, None, Duration::ZERO));
+        assert!(is_sampling_done(&stable_samples, 5, None, Duration::ZERO));
+        assert!(!is_sampling_done(
+            &stable_samples[..4],
+            10,
+            adaptive_sampling,
+            Duration::ZERO
+        ));
+        assert!(is_sampling_done(
+            &stable_samples,
+            10,
+            adaptive_sampling,
+            Duration::ZERO
+        ));
+        assert!(!is_sampling_done(
+            &noisy_samples,
+            1,
+            adaptive_sampling,
+            Duration::from_secs(1)
+        ));
+        assert!(is_sampling_done(
+            &noisy_samples,
+            1,
+            adaptive_sampling,
+            Duration::from_secs(10)
+        ));
+    }
+}
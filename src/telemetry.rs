@@ -0,0 +1,247 @@
+use crate::prelude::*;
+use lazy_static::lazy_static;
+use serde::{Deserialize, Serialize};
+use std::{
+    cell::RefCell,
+    fs,
+    path::Path,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Mutex,
+    },
+    time::Instant,
+};
+
+const TELEMETRY_REPORT_FILE: &str = "runner-telemetry.json";
+
+/// The resources used by the runner during a phase of the run
+#[derive(Deserialize, Serialize, Debug, Clone, PartialEq)]
+#[serde(rename_all = "camelCase")]
+pub struct PhaseTelemetry {
+    pub name: String,
+    /// The phase containing this phase, e.g. the log group of a step of the upload
+    pub parent: Option<String>,
+    pub wall_time_ns: u64,
+    /// The user and system time of the runner process
+    pub cpu_time_ns: u64,
+    /// The user and system time of the processes spawned by the runner that exited
+    pub children_cpu_time_ns: u64,
+    /// The peak resident set size of the runner process since it started
+    pub peak_rss_kib: u64,
+    /// The peak resident set size of the largest spawned process since the runner started
+    pub children_peak_rss_kib: u64,
+    pub read_bytes: u64,
+    pub written_bytes: u64,
+    /// The bytes of the profile archive uploaded
+    pub sent_bytes: u64,
+}
+
+/// The counters of the runner at a point in time
+struct Snapshot {
+    instant: Instant,
+    cpu_time_ns: u64,
+    children_cpu_time_ns: u64,
+    peak_rss_kib: u64,
+    children_peak_rss_kib: u64,
+    read_bytes: u64,
+    written_bytes: u64,
+    sent_bytes: u64,
+}
+
+/// Returns the cpu time in nanoseconds and the peak resident set size in KiB
+fn get_resource_usage(who: libc::c_int) -> (u64, u64) {
+    // SAFETY: rusage is a plain struct, valid when zeroed and filled by getrusage
+    let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+    if unsafe { libc::getrusage(who, &mut usage) } < 0 {
+        return (0, 0);
+    }
+    let timeval_ns =
+        |time: libc::timeval| time.tv_sec as u64 * 1_000_000_000 + time.tv_usec as u64 * 1000;
+    (
+        timeval_ns(usage.ru_utime) + timeval_ns(usage.ru_stime),
+        usage.ru_maxrss as u64,
+    )
+}
+
+/// Returns the bytes read from and written to the storage by the runner process, zero when
+/// /proc/self/io cannot be read
+fn get_io_bytes() -> (u64, u64) {
+    let io = fs::read_to_string("/proc/self/io").unwrap_or_default();
+    let get_counter = |name: &str| {
+        io.lines()
+            .find_map(|line| line.strip_prefix(name)?.strip_prefix(": "))
+            .and_then(|value| value.trim().parse().ok())
+            .unwrap_or_default()
+    };
+    (get_counter("read_bytes"), get_counter("write_bytes"))
+}
+
+static SENT_BYTES: AtomicU64 = AtomicU64::new(0);
+
+impl Snapshot {
+    fn take() -> Self {
+        let (cpu_time_ns, peak_rss_kib) = get_resource_usage(libc::RUSAGE_SELF);
+        let (children_cpu_time_ns, children_peak_rss_kib) =
+            get_resource_usage(libc::RUSAGE_CHILDREN);
+        let (read_bytes, written_bytes) = get_io_bytes();
+        Self {
+            instant: Instant::now(),
+            cpu_time_ns,
+            children_cpu_time_ns,
+            peak_rss_kib,
+            children_peak_rss_kib,
+            read_bytes,
+            written_bytes,
+            sent_bytes: SENT_BYTES.load(Ordering::Relaxed),
+        }
+    }
+
+    fn phase_since(
+        &self,
+        start: &Snapshot,
+        name: String,
+        parent: Option<String>,
+    ) -> PhaseTelemetry {
+        PhaseTelemetry {
+            name,
+            parent,
+            wall_time_ns: self.instant.duration_since(start.instant).as_nanos() as u64,
+            cpu_time_ns: self.cpu_time_ns.saturating_sub(start.cpu_time_ns),
+            children_cpu_time_ns: self
+                .children_cpu_time_ns
+                .saturating_sub(start.children_cpu_time_ns),
+            peak_rss_kib: self.peak_rss_kib,
+            children_peak_rss_kib: self.children_peak_rss_kib,
+            read_bytes: self.read_bytes.saturating_sub(start.read_bytes),
+            written_bytes: self.written_bytes.saturating_sub(start.written_bytes),
+            sent_bytes: self.sent_bytes.saturating_sub(start.sent_bytes),
+        }
+    }
+}
+
+thread_local! {
+    /// The phases started and not ended yet by this thread, the innermost last, so that the
+    /// phases of other threads are never taken for the parent of a phase
+    static OPEN_PHASES: RefCell<Vec<(String, Snapshot)>> = const { RefCell::new(Vec::new()) };
+}
+
+lazy_static! {
+    /// The phases ended by all the threads
+    static ref PHASES: Mutex<Vec<PhaseTelemetry>> = Mutex::new(vec![]);
+}
+
+/// Start a phase of the run, ended by the next call to `end_phase` on the same thread. Called by
+/// `start_group!`
+pub fn start_phase(name: &str) {
+    let snapshot = Snapshot::take();
+    OPEN_PHASES.with(|open_phases| open_phases.borrow_mut().push((name.to_string(), snapshot)));
+}
+
+/// End the innermost phase of the run started by this thread. Called by `end_group!`
+pub fn end_phase() {
+    let snapshot = Snapshot::take();
+    let phase = OPEN_PHASES.with(|open_phases| {
+        let mut open_phases = open_phases.borrow_mut();
+        let (name, start) = open_phases.pop()?;
+        let parent = open_phases.last().map(|(name, _)| name.clone());
+        Some(snapshot.phase_since(&start, name, parent))
+    });
+    let Some(phase) = phase else {
+        return;
+    };
+    trace!("Phase telemetry: {:?}", phase);
+    PHASES.lock().unwrap().push(phase);
+}
+
+/// Ends the phase it was created for when dropped
+pub struct PhaseGuard;
+
+impl Drop for PhaseGuard {
+    fn drop(&mut self) {
+        end_phase();
+    }
+}
+
+/// Start a phase nested in the current log group, ended when the returned guard is dropped
+pub fn phase(name: &str) -> PhaseGuard {
+    start_phase(name);
+    PhaseGuard
+}
+
+pub fn record_sent_bytes(bytes: u64) {
+    SENT_BYTES.fetch_add(bytes, Ordering::Relaxed);
+}
+
+/// Returns the phases ended so far, in the order they ended
+pub fn get_phases() -> Vec<PhaseTelemetry> {
+    PHASES.lock().unwrap().clone()
+}
+
+/// Forget the phases of the previous run, the runner daemon serving many runs
+pub fn reset() {
+    OPEN_PHASES.with(|open_phases| open_phases.borrow_mut().clear());
+    PHASES.lock().unwrap().clear();
+}
+
+/// Write the phases ended so far to the profile folder
+pub fn write_report(profile_folder: &Path) -> Result<()> {
+    let report_path = profile_folder.join(TELEMETRY_REPORT_FILE);
+    fs::write(&report_path, serde_json::to_string_pretty(&get_phases())?).map_err(|e| {
+        anyhow!(
+            "Failed to write runner telemetry: {}, {}",
+            report_path.display(),
+            e
+        )
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_phases() {
+        start_group!("Test telemetry group");
+        {
+            let _phase = phase("Test telemetry phase");
+            record_sent_bytes(1024);
+        }
+        end_group!();
+
+        let phases = get_phases();
+        let phase = phases
+            .iter()
+            .find(|phase| phase.name == "Test telemetry phase")
+            .unwrap();
+        assert_eq!(phase.parent.as_deref(), Some("Test telemetry group"));
+        // the bytes sent by the tests running in parallel are counted too
+        assert!(phase.sent_bytes >= 1024);
+        let group = phases
+            .iter()
+            .find(|phase| phase.name == "Test telemetry group")
+            .unwrap();
+        assert_eq!(group.parent, None);
+        assert!(group.wall_time_ns >= phase.wall_time_ns);
+    }
+
+    #[test]
+    fn test_phases_of_other_threads() {
+        start_group!("Test telemetry main thread group");
+        std::thread::spawn(|| {
+            let _phase = phase("Test telemetry other thread phase");
+        })
+        .join()
+        .unwrap();
+        end_group!();
+
+        let phases = get_phases();
+        let phase = phases
+            .iter()
+            .find(|phase| phase.name == "Test telemetry other thread phase")
+            .unwrap();
+        assert_eq!(phase.parent, None);
+        assert!(phases
+            .iter()
+            .any(|phase| phase.name == "Test telemetry main thread group"));
+    }
+}
@@ -0,0 +1,255 @@
+use super::{
+    interfaces::ArchiveFormat,
+    profile_archive::{create_profile_archive, get_archive_path, write_archive, ProfileArchive},
+};
+use crate::prelude::*;
+use std::{
+    collections::HashMap,
+    fs,
+    path::{Path, PathBuf},
+    sync::mpsc::{self, RecvTimeoutError},
+    thread,
+    time::{Duration, SystemTime},
+};
+
+/// Interval between two scans of the profile folder for the profiles of exited processes
+const POLL_INTERVAL: Duration = Duration::from_millis(500);
+
+/// The state of an archived file, used to detect files modified after being archived
+#[derive(PartialEq)]
+struct ArchivedFileState {
+    len: u64,
+    modified: SystemTime,
+}
+
+impl ArchivedFileState {
+    fn read(path: &Path) -> Result<Self> {
+        let metadata = fs::metadata(path)?;
+        Ok(Self {
+            len: metadata.len(),
+            modified: metadata.modified()?,
+        })
+    }
+}
+
+/// Returns the `<pid>.out` profiles of the processes that are not running anymore.
+///
+/// Callgrind keeps appending the dumps of a process to its profile until the process exits, so
+/// only those profiles are complete.
+fn get_exited_process_profiles(profile_folder: &Path) -> Result<Vec<PathBuf>> {
+    Ok(fs::read_dir(profile_folder)?
+        .filter_map(|entry| entry.ok())
+        .map(|entry| entry.path())
+        .filter(|path| path.extension().unwrap_or_default() == "out")
+        .filter(|path| {
+            path.file_stem()
+                .and_then(|pid| pid.to_str())
+                .and_then(|pid| pid.parse::<u32>().ok())
+                .is_some_and(|pid| !Path::new("/proc").join(pid.to_string()).exists())
+        })
+        .collect())
+}
+
+fn build_archive(
+    profile_folder: &Path,
+    format: ArchiveFormat,
+    compression_level: Option<i32>,
+    remove_archived_profiles: bool,
+    stop_receiver: mpsc::Receiver<()>,
+) -> Result<ProfileArchive> {
+    let archive_path = get_archive_path(profile_folder, format);
+    write_archive(&archive_path, format, compression_level, |tar| {
+        // same root entry as the one written by append_dir_all
+        tar.append_dir("./", profile_folder)?;
+
+        let mut archived_profiles = HashMap::new();
+        loop {
+            let stopped = !matches!(
+                stop_receiver.recv_timeout(POLL_INTERVAL),
+                Err(RecvTimeoutError::Timeout)
+            );
+            for profile_path in get_exited_process_profiles(profile_folder)? {
+                if archived_profiles.contains_key(&profile_path) {
+                    continue;
+                }
+                let mut state = ArchivedFileState::read(&profile_path)?;
+                tar.append_path_with_name(&profile_path, profile_path.file_name().unwrap())?;
+                trace!("Archived profile: {}", profile_path.display());
+                if remove_archived_profiles {
+                    // truncated rather than removed, the perf maps being harvested by the pids of
+                    // the profiles
+                    fs::File::options()
+                        .write(true)
+                        .open(&profile_path)?
+                        .set_len(0)?;
+                    state = ArchivedFileState::read(&profile_path)?;
+                }
+                archived_profiles.insert(profile_path, state);
+            }
+            if stopped {
+                break;
+            }
+        }
+
+        // Append the rest of the profile folder, e.g. the perf maps and the valgrind logs
+        for entry in fs::read_dir(profile_folder)? {
+            let path = entry?.path();
+            let name = path.file_name().unwrap();
+            match archived_profiles.get(&path) {
+                Some(state) => ensure!(
+                    *state == ArchivedFileState::read(&path)?,
+                    "Profile {} was modified after being archived",
+                    path.display()
+                ),
+                None if path.is_dir() => tar.append_dir_all(name, &path)?,
+                None => tar.append_path_with_name(&path, name)?,
+            }
+        }
+        Ok(())
+    })
+}
+
+/// Builds the profile archive on a background thread while the benchmarks are running.
+///
+/// The profile of each benchmark process is compressed as soon as the process exits, and the
+/// remaining files of the profile folder are appended once the benchmarks are done. The archived
+/// profiles can be emptied right away, for their content not to be held on disk twice.
+pub struct ArchivePipeline {
+    profile_folder: PathBuf,
+    format: ArchiveFormat,
+    compression_level: Option<i32>,
+    remove_archived_profiles: bool,
+    /// Dropping the sender stops the pipeline
+    stop_sender: mpsc::Sender<()>,
+    handle: thread::JoinHandle<Result<ProfileArchive>>,
+}
+
+impl ArchivePipeline {
+    pub fn start(
+        profile_folder: &Path,
+        format: ArchiveFormat,
+        compression_level: Option<i32>,
+        remove_archived_profiles: bool,
+    ) -> Self {
+        debug!(
+            "Starting the archive pipeline: {}",
+            profile_folder.display()
+        );
+        let (stop_sender, stop_receiver) = mpsc::channel();
+        let thread_profile_folder = profile_folder.to_path_buf();
+        let handle = thread::spawn(move || {
+            build_archive(
+                &thread_profile_folder,
+                format,
+                compression_level,
+                remove_archived_profiles,
+                stop_receiver,
+            )
+        });
+        Self {
+            profile_folder: profile_folder.to_path_buf(),
+            format,
+            compression_level,
+            remove_archived_profiles,
+            stop_sender,
+            handle,
+        }
+    }
+
+    /// Wait for the archive to be completed, once the benchmarks are done.
+    ///
+    /// If the pipelined archive could not be built, the archive is created again from the
+    /// profile folder, unless the archived profiles were emptied.
+    pub async fn finish(self) -> Result<ProfileArchive> {
+        drop(self.stop_sender);
+        let handle = self.handle;
+        match tokio::task::spawn_blocking(move || handle.join()).await? {
+            Ok(Ok(archive)) => Ok(archive),
+            Ok(Err(e)) if self.remove_archived_profiles => bail!(
+                "Failed to build the pipelined profile archive, the archived profiles were removed: {}",
+                e
+            ),
+            Ok(Err(e)) => {
+                warn!(
+                    "Failed to build the pipelined profile archive: {}, creating it again",
+                    e
+                );
+                create_profile_archive(&self.profile_folder, self.format, self.compression_level)
+                    .await
+            }
+            Err(_) => bail!("The archive pipeline thread panicked"),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::uploader::profile_archive::tests::{create_test_profile_folder, list_entries};
+    use flate2::read::GzDecoder;
+
+    #[tokio::test]
+    async fn test_archive_pipeline() -> Result<()> {
+        let profile_folder = create_test_profile_folder("codspeed_test_archive_pipeline.out")?;
+        // the pid is above the maximum value of pid_max, so its process is never running
+        fs::write(profile_folder.join("4194305.out"), "events: Ir\n")?;
+        fs::write(
+            profile_folder.join(format!("{}.out", std::process::id())),
+            "events: Ir\n",
+        )?;
+
+        let archive_pipeline =
+            ArchivePipeline::start(&profile_folder, ArchiveFormat::Gzip, None, false);
+        thread::sleep(POLL_INTERVAL * 2);
+        fs::write(profile_folder.join("valgrind.log"), "")?;
+        let archive = archive_pipeline.finish().await?;
+
+        let mut expected_entries = vec![
+            "./".to_string(),
+            "1234.out".into(),
+            "4194305.out".into(),
+            format!("{}.out", std::process::id()),
+            "perf-1234.map".into(),
+            "valgrind.log".into(),
+        ];
+        expected_entries.sort();
+        assert_eq!(
+            list_entries(GzDecoder::new(fs::File::open(&archive.path)?))?,
+            expected_entries
+        );
+
+        fs::remove_dir_all(&profile_folder)?;
+        fs::remove_file(&archive.path)?;
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_archive_pipeline_removing_archived_profiles() -> Result<()> {
+        let profile_folder =
+            create_test_profile_folder("codspeed_test_removing_archive_pipeline.out")?;
+        let profile_path = profile_folder.join("4194305.out");
+        fs::write(&profile_path, "events: Ir\nfn=main\n0 42\n")?;
+
+        let archive_pipeline =
+            ArchivePipeline::start(&profile_folder, ArchiveFormat::Gzip, None, true);
+        thread::sleep(POLL_INTERVAL * 2);
+        assert_eq!(fs::metadata(&profile_path)?.len(), 0);
+        let archive = archive_pipeline.finish().await?;
+
+        let mut tar = tar::Archive::new(GzDecoder::new(fs::File::open(&archive.path)?));
+        let archived_profile = tar
+            .entries()?
+            .filter_map(|entry| entry.ok())
+            .find(|entry| {
+                entry
+                    .path()
+                    .is_ok_and(|path| path == Path::new("4194305.out"))
+            })
+            .unwrap();
+        assert_eq!(archived_profile.size(), 24);
+
+        fs::remove_dir_all(&profile_folder)?;
+        fs::remove_file(&archive.path)?;
+        Ok(())
+    }
+}
@@ -0,0 +1,111 @@
+use super::interfaces::ContentEntry;
+use crate::prelude::*;
+use sha2::{Digest, Sha256};
+use std::{
+    collections::HashSet,
+    fs::{self, File},
+    io,
+    path::{Path, PathBuf},
+    thread,
+};
+
+/// List the files of the profile folder recursively, relative to it
+fn list_files(profile_folder: &Path, dir: &Path, files: &mut Vec<PathBuf>) -> Result<()> {
+    for entry in fs::read_dir(dir)? {
+        let path = entry?.path();
+        if path.is_dir() {
+            list_files(profile_folder, &path, files)?;
+        } else {
+            files.push(path.strip_prefix(profile_folder)?.to_path_buf());
+        }
+    }
+    Ok(())
+}
+
+fn hash_file(profile_folder: &Path, path: &Path) -> Result<ContentEntry> {
+    let full_path = profile_folder.join(path);
+    let mut file = File::open(&full_path)
+        .map_err(|e| anyhow!("Failed to open file: {}, {}", full_path.display(), e))?;
+    let mut hasher = Sha256::new();
+    let size = io::copy(&mut file, &mut hasher)?;
+    Ok(ContentEntry {
+        path: path.to_string_lossy().into_owned(),
+        sha256: format!("{:x}", hasher.finalize()),
+        size,
+    })
+}
+
+/// Hash each file of the profile folder, on all the cpus since the perf maps can be large.
+///
+/// The entries are sorted by path.
+fn get_content_manifest_blocking(profile_folder: &Path) -> Result<Vec<ContentEntry>> {
+    let mut files = vec![];
+    list_files(profile_folder, profile_folder, &mut files)?;
+    files.sort();
+    let thread_count = thread::available_parallelism().map_or(1, |count| count.get());
+    let chunk_size = files.len().div_ceil(thread_count).max(1);
+    thread::scope(|scope| {
+        let handles = files
+            .chunks(chunk_size)
+            .map(|chunk| {
+                scope.spawn(move || {
+                    chunk
+                        .iter()
+                        .map(|path| hash_file(profile_folder, path))
+                        .collect_vec()
+                })
+            })
+            .collect_vec();
+        handles
+            .into_iter()
+            .flat_map(|handle| handle.join().unwrap())
+            .collect()
+    })
+}
+
+pub async fn get_content_manifest(profile_folder: &Path) -> Result<Vec<ContentEntry>> {
+    let profile_folder = profile_folder.to_path_buf();
+    tokio::task::spawn_blocking(move || get_content_manifest_blocking(&profile_folder)).await?
+}
+
+/// Returns the paths of the files whose content is missing from the backend
+pub fn get_missing_paths(
+    content_manifest: &[ContentEntry],
+    missing_content_hashes: &[String],
+) -> Vec<PathBuf> {
+    let missing_content_hashes = missing_content_hashes.iter().collect::<HashSet<_>>();
+    content_manifest
+        .iter()
+        .filter(|entry| missing_content_hashes.contains(&entry.sha256))
+        .map(|entry| PathBuf::from(&entry.path))
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::uploader::profile_archive::tests::create_test_profile_folder;
+
+    #[tokio::test]
+    async fn test_get_content_manifest() -> Result<()> {
+        let profile_folder = create_test_profile_folder("codspeed_test_content_manifest.out")?;
+
+        let content_manifest = get_content_manifest(&profile_folder).await?;
+
+        assert_eq!(
+            content_manifest
+                .iter()
+                .map(|entry| &entry.path)
+                .collect_vec(),
+            ["1234.out", "perf-1234.map"]
+        );
+        assert_eq!(content_manifest[1].size, 13);
+        assert_eq!(
+            get_missing_paths(&content_manifest, &[content_manifest[1].sha256.clone()]),
+            [PathBuf::from("perf-1234.map")]
+        );
+
+        fs::remove_dir_all(&profile_folder)?;
+        Ok(())
+    }
+}
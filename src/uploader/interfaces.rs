@@ -1,5 +1,8 @@
+use clap::ValueEnum;
 use serde::{Deserialize, Serialize};
 
+use crate::{config::MeasurementMode, telemetry::PhaseTelemetry};
+
 #[derive(Deserialize, Serialize, Debug, Clone, PartialEq)]
 #[serde(rename_all = "snake_case")]
 pub enum RunEvent {
@@ -9,6 +12,13 @@ pub enum RunEvent {
     Schedule,
 }
 
+#[derive(Deserialize, Serialize, Debug, Clone, Copy, PartialEq, ValueEnum)]
+#[serde(rename_all = "snake_case")]
+pub enum ArchiveFormat {
+    Gzip,
+    Zstd,
+}
+
 #[derive(Deserialize, Serialize, Debug)]
 #[serde(rename_all = "camelCase")]
 pub struct UploadMetadata {
@@ -23,12 +33,84 @@ pub struct UploadMetadata {
     pub commit_hash: String,
     pub event: RunEvent,
     pub profile_md5: String,
+    pub archive_format: ArchiveFormat,
+    pub archive_size: u64,
+    /// The engine of the measurements: callgrind profiles in instrumentation mode, the
+    /// `perf-counters-<pid>.json` and `walltime-<pid>.json` results in the native modes
+    pub mode: MeasurementMode,
+    /// The caches simulated by callgrind, absent when the benchmarks are measured natively
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub cache_geometry: Option<CacheGeometry>,
+    /// Present when the benchmarks are sharded across several CI jobs
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub shard: Option<ShardData>,
+    /// The lines of the bench command skipped by an incremental run, their results being reused
+    /// from the base commit
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub skipped_bench_commands: Vec<String>,
+    /// The hash of each file of the profile folder, present when the upload is deduplicated
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub content_manifest: Vec<ContentEntry>,
+    /// The resources used by the runner in each phase of the run, when reported
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub runner_telemetry: Vec<PhaseTelemetry>,
+    /// The cache geometries simulated in addition to `cache_geometry`
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub cache_simulations: Vec<CacheSimulation>,
     pub gh_data: Option<GhData>,
     pub runner: Runner,
     pub platform: String,
     pub repository_root_path: String,
 }
 
+/// A file of the profile folder, identified by the hash of its content
+#[derive(Deserialize, Serialize, Debug, Clone, PartialEq)]
+#[serde(rename_all = "camelCase")]
+pub struct ContentEntry {
+    /// The path of the file, relative to the profile folder
+    pub path: String,
+    pub sha256: String,
+    pub size: u64,
+}
+
+/// A cache simulated by callgrind, sizes being in bytes
+#[derive(Deserialize, Serialize, Debug, Clone, Copy, PartialEq)]
+#[serde(rename_all = "camelCase")]
+pub struct CacheLevel {
+    pub size: u64,
+    pub assoc: u64,
+    pub line_size: u64,
+}
+
+#[derive(Deserialize, Serialize, Debug, Clone, Copy, PartialEq)]
+#[serde(rename_all = "camelCase")]
+pub struct CacheGeometry {
+    pub i1: CacheLevel,
+    pub d1: CacheLevel,
+    /// The last level cache
+    pub ll: CacheLevel,
+}
+
+/// A cache geometry simulated by an extra instrumented run of the benchmarks, whose profiles are
+/// in the `cache-simulations/<label>` folder of the profile archive
+#[derive(Deserialize, Serialize, Debug, Clone, PartialEq)]
+#[serde(rename_all = "camelCase")]
+pub struct CacheSimulation {
+    pub label: String,
+    pub cache_geometry: CacheGeometry,
+}
+
+/// Identifies the partial results of a run sharded across several CI jobs, so that they can be
+/// merged once all the shards are uploaded
+#[derive(Deserialize, Serialize, Debug, Clone)]
+#[serde(rename_all = "camelCase")]
+pub struct ShardData {
+    pub index: usize,
+    pub count: usize,
+    /// Shared by all the jobs of the CI run
+    pub run_identity: String,
+}
+
 #[derive(Deserialize, Serialize, Debug, Clone)]
 #[serde(rename_all = "camelCase")]
 pub struct GhData {
@@ -57,4 +139,54 @@ pub struct UploadData {
     pub status: String,
     pub upload_url: String,
     pub run_id: String,
+    /// Present when the upload endpoint requires the archive to be uploaded in several parts
+    #[serde(default)]
+    pub multipart_upload: Option<MultipartUploadData>,
+}
+
+/// Sent before the archive is built, the upload endpoint registering a run for each upload
+/// metadata
+#[derive(Deserialize, Serialize, Debug)]
+#[serde(rename_all = "camelCase")]
+pub struct UploadPreflight {
+    /// The format the archive is requested in
+    pub archive_format: ArchiveFormat,
+    /// The hash of each file of the profile folder, present when the upload is deduplicated
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub content_manifest: Vec<ContentEntry>,
+}
+
+#[derive(Deserialize, Serialize, Debug)]
+#[serde(rename_all = "camelCase")]
+pub struct UploadPreflightData {
+    /// The archive formats accepted by the upload endpoint besides gzip
+    #[serde(default)]
+    pub accepted_archive_formats: Vec<String>,
+    /// Present when the upload is deduplicated, the hashes of the content manifest whose content
+    /// is not known by the backend. Only the files with those hashes have to be uploaded
+    #[serde(default)]
+    pub missing_content_hashes: Option<Vec<String>>,
+}
+
+#[derive(Deserialize, Serialize, Debug)]
+#[serde(rename_all = "camelCase")]
+pub struct MultipartUploadData {
+    pub part_size: u64,
+    /// The upload URL of each part, in order
+    pub part_upload_urls: Vec<String>,
+    /// The URL committing the multipart upload once all the parts are uploaded
+    pub complete_url: String,
+}
+
+#[derive(Deserialize, Serialize, Debug)]
+#[serde(rename_all = "camelCase")]
+pub struct CompletedPart {
+    pub part_number: u32,
+    pub etag: String,
+}
+
+#[derive(Deserialize, Serialize, Debug)]
+#[serde(rename_all = "camelCase")]
+pub struct CompleteMultipartUpload {
+    pub parts: Vec<CompletedPart>,
 }
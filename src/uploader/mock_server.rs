@@ -0,0 +1,250 @@
+use base64::{engine::general_purpose, Engine as _};
+use serde_json::{json, Value};
+use std::{
+    collections::HashMap,
+    io,
+    sync::{Arc, Mutex},
+};
+use tokio::{
+    io::{AsyncBufReadExt, AsyncReadExt, AsyncWriteExt, BufReader},
+    net::{TcpListener, TcpStream},
+};
+use url::Url;
+
+/// The bodies larger than this are only hashed, e.g. the archive of a benchmark of the upload
+const MAX_RECORDED_BODY_SIZE: u64 = 1024 * 1024;
+
+/// A request received by the mock upload server
+#[derive(Debug, Clone)]
+pub struct ReceivedRequest {
+    pub method: String,
+    pub path: String,
+    /// The headers, by lowercase name
+    pub headers: HashMap<String, String>,
+    pub body_size: u64,
+    /// The md5 hash of the body encoded in base64, as sent in Content-MD5
+    pub body_md5: String,
+    /// Empty when the body is larger than 1 MiB
+    pub body: Vec<u8>,
+}
+
+/// A local HTTP server standing in for the upload endpoint and the storage.
+///
+/// The upload metadata POSTed to `/upload` is answered with an upload URL on `/archive`, merged
+/// with the extra fields given when starting the server, and the archive PUT is accepted. The
+/// pre-flight requests POSTed to `/upload/preflight` are answered with the same fields. A GET of
+/// `/download/<size>` streams a file of `size` bytes, or the requested range of it, the
+/// connection being dropped after `<bytes>` bytes of the whole file with `?interrupt=<bytes>`.
+pub struct MockUploadServer {
+    pub upload_url: Url,
+    requests: Arc<Mutex<Vec<ReceivedRequest>>>,
+}
+
+impl MockUploadServer {
+    pub async fn start(extra_upload_data: Value) -> io::Result<Self> {
+        let listener = TcpListener::bind("127.0.0.1:0").await?;
+        let base_url = format!("http://{}", listener.local_addr()?);
+        let mut upload_data = json!({
+            "status": "success",
+            "uploadUrl": format!("{}/archive", base_url),
+            "runId": "mock_run_id",
+        });
+        if let (Some(upload_data), Value::Object(extra_upload_data)) =
+            (upload_data.as_object_mut(), extra_upload_data)
+        {
+            upload_data.extend(extra_upload_data);
+        }
+        let upload_data = upload_data.to_string();
+
+        let requests = Arc::new(Mutex::new(vec![]));
+        let server_requests = requests.clone();
+        tokio::spawn(async move {
+            while let Ok((stream, _)) = listener.accept().await {
+                let requests = server_requests.clone();
+                let upload_data = upload_data.clone();
+                tokio::spawn(async move {
+                    let _ = handle_connection(stream, &upload_data, &requests).await;
+                });
+            }
+        });
+        Ok(Self {
+            upload_url: Url::parse(&format!("{}/upload", base_url)).unwrap(),
+            requests,
+        })
+    }
+
+    pub fn requests(&self) -> Vec<ReceivedRequest> {
+        self.requests.lock().unwrap().clone()
+    }
+}
+
+/// The byte at `offset` of the downloads, varying with the offset so that a part written at the
+/// wrong offset changes the digest of the file
+pub fn download_byte(offset: u64) -> u8 {
+    (offset % 251) as u8
+}
+
+/// The size of the file requested by a `/download/<size>` path, and the number of bytes after
+/// which the connection is dropped, given by `?interrupt=<bytes>`
+fn parse_download_path(path: &str) -> Option<(u64, Option<u64>)> {
+    let (path, query) = path.split_once('?').unwrap_or((path, ""));
+    let size = path.strip_prefix("/download/")?.parse().ok()?;
+    let interrupt = query
+        .strip_prefix("interrupt=")
+        .and_then(|bytes| bytes.parse().ok());
+    Some((size, interrupt))
+}
+
+/// The range of a `bytes=<start>-<end>` header, the end being inclusive and optional
+fn parse_range(range: &str, size: u64) -> Option<(u64, u64)> {
+    let (start, end) = range.strip_prefix("bytes=")?.split_once('-')?;
+    let end = match end {
+        "" => size,
+        end => end.parse::<u64>().ok()? + 1,
+    };
+    Some((start.parse().ok()?, end.min(size)))
+}
+
+/// Write the response to a request, the downloads being streamed without being held in memory
+async fn write_response(
+    stream: &mut TcpStream,
+    method: &str,
+    path: &str,
+    headers: &HashMap<String, String>,
+    upload_data: &str,
+) -> io::Result<()> {
+    if let Some((download_size, interrupt)) = parse_download_path(path) {
+        let range = headers
+            .get("range")
+            .and_then(|range| parse_range(range, download_size));
+        let (status, (start, end)) = match range {
+            Some(range) => ("206 Partial Content", range),
+            None => ("200 OK", (0, download_size)),
+        };
+        let headers = format!(
+            "HTTP/1.1 {}\r\nContent-Type: application/octet-stream\r\nAccept-Ranges: bytes\r\n\
+             Content-Length: {}\r\n\r\n",
+            status,
+            end - start
+        );
+        stream.write_all(headers.as_bytes()).await?;
+        if method != "GET" {
+            return Ok(());
+        }
+        // only the requests of the whole file are interrupted, so that the resumed ones complete
+        let body_end = match (range, interrupt) {
+            (None, Some(interrupt)) => interrupt.min(end),
+            _ => end,
+        };
+        let mut offset = start;
+        while offset < body_end {
+            let chunk_end = body_end.min(offset + 64 * 1024);
+            let chunk = (offset..chunk_end).map(download_byte).collect::<Vec<_>>();
+            stream.write_all(&chunk).await?;
+            offset = chunk_end;
+        }
+        if body_end < end {
+            return Err(io::Error::new(
+                io::ErrorKind::ConnectionAborted,
+                "interrupted download",
+            ));
+        }
+        return Ok(());
+    }
+    let response_body = if method == "POST" && ["/upload", "/upload/preflight"].contains(&path) {
+        upload_data
+    } else {
+        ""
+    };
+    let response = format!(
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nETag: \"mock-etag\"\r\n\
+         Content-Length: {}\r\n\r\n{}",
+        response_body.len(),
+        response_body
+    );
+    stream.write_all(response.as_bytes()).await
+}
+
+/// Read `size` bytes of the body, hashing them and keeping them if the body is small enough
+async fn read_body_bytes(
+    reader: &mut BufReader<TcpStream>,
+    size: u64,
+    context: &mut md5::Context,
+    body: &mut Vec<u8>,
+    keep: bool,
+) -> io::Result<()> {
+    let mut remaining = size;
+    let mut buffer = vec![0; 64 * 1024];
+    while remaining > 0 {
+        let read_size = remaining.min(buffer.len() as u64) as usize;
+        reader.read_exact(&mut buffer[..read_size]).await?;
+        context.consume(&buffer[..read_size]);
+        if keep {
+            body.extend_from_slice(&buffer[..read_size]);
+        }
+        remaining -= read_size as u64;
+    }
+    Ok(())
+}
+
+async fn handle_connection(
+    stream: TcpStream,
+    upload_data: &str,
+    requests: &Mutex<Vec<ReceivedRequest>>,
+) -> io::Result<()> {
+    let mut reader = BufReader::new(stream);
+    loop {
+        let mut request_line = String::new();
+        if reader.read_line(&mut request_line).await? == 0 {
+            return Ok(());
+        }
+        let mut request_line = request_line.split_whitespace();
+        let method = request_line.next().unwrap_or_default().to_string();
+        let path = request_line.next().unwrap_or_default().to_string();
+        let mut headers = HashMap::new();
+        loop {
+            let mut header = String::new();
+            reader.read_line(&mut header).await?;
+            let Some((name, value)) = header.trim_end().split_once(':') else {
+                break;
+            };
+            headers.insert(name.trim().to_lowercase(), value.trim().to_string());
+        }
+
+        let mut context = md5::Context::new();
+        let mut body = vec![];
+        let mut body_size = 0;
+        if let Some(content_length) = headers.get("content-length") {
+            body_size = content_length.parse().unwrap_or_default();
+            let keep = body_size <= MAX_RECORDED_BODY_SIZE;
+            read_body_bytes(&mut reader, body_size, &mut context, &mut body, keep).await?;
+        } else if headers.get("transfer-encoding").map(String::as_str) == Some("chunked") {
+            loop {
+                let mut chunk_size = String::new();
+                reader.read_line(&mut chunk_size).await?;
+                let chunk_size = u64::from_str_radix(chunk_size.trim(), 16).unwrap_or_default();
+                let keep = body_size + chunk_size <= MAX_RECORDED_BODY_SIZE;
+                read_body_bytes(&mut reader, chunk_size, &mut context, &mut body, keep).await?;
+                body_size += chunk_size;
+                let mut chunk_end = String::new();
+                reader.read_line(&mut chunk_end).await?;
+                if chunk_size == 0 {
+                    break;
+                }
+            }
+            if body_size > MAX_RECORDED_BODY_SIZE {
+                body.clear();
+            }
+        }
+
+        requests.lock().unwrap().push(ReceivedRequest {
+            method: method.clone(),
+            path: path.clone(),
+            headers: headers.clone(),
+            body_size,
+            body_md5: general_purpose::STANDARD.encode(context.compute().0),
+            body,
+        });
+        write_response(reader.get_mut(), &method, &path, &headers, upload_data).await?;
+    }
+}
@@ -1,6 +1,14 @@
+mod archive_pipeline;
+mod content_manifest;
 mod interfaces;
+#[cfg(test)]
+pub mod mock_server;
+mod parallel_gzip;
+mod profile_archive;
 mod upload;
 mod upload_metadata;
 
+pub use archive_pipeline::ArchivePipeline;
 pub use interfaces::*;
+pub use profile_archive::ProfileArchive;
 pub use upload::upload;
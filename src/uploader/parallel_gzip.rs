@@ -0,0 +1,195 @@
+use crate::prelude::*;
+use flate2::{Compress, Compression, FlushCompress, Status};
+use std::{
+    io::{self, Write},
+    thread,
+};
+
+/// Size of the blocks compressed independently by the worker threads
+const BLOCK_SIZE: usize = 1024 * 1024;
+/// Gzip header with no optional fields, no modification time and an unknown OS, as written by flate2
+const GZIP_HEADER: [u8; 10] = [0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff];
+
+struct CompressedBlock {
+    data: Vec<u8>,
+    crc: crc32fast::Hasher,
+}
+
+/// Deflate a block as a raw deflate stream.
+///
+/// Non-final blocks are ended with a sync flush so that they end on a byte boundary and the
+/// blocks can be concatenated into a single deflate stream, like pigz does.
+fn deflate_block(data: &[u8], level: Compression, last: bool) -> io::Result<CompressedBlock> {
+    let mut compress = Compress::new(level, false);
+    let flush = if last {
+        FlushCompress::Finish
+    } else {
+        FlushCompress::Sync
+    };
+    let mut output = Vec::with_capacity(data.len() / 2 + 1024);
+    loop {
+        if output.len() == output.capacity() {
+            output.reserve(output.capacity());
+        }
+        let input = &data[compress.total_in() as usize..];
+        let status = compress
+            .compress_vec(input, &mut output, flush)
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e))?;
+        let flushed =
+            compress.total_in() as usize == data.len() && output.len() < output.capacity();
+        match status {
+            Status::StreamEnd => break,
+            Status::Ok | Status::BufError if !last && flushed => break,
+            Status::Ok | Status::BufError => {}
+        }
+    }
+
+    let mut crc = crc32fast::Hasher::new();
+    crc.update(data);
+    Ok(CompressedBlock { data: output, crc })
+}
+
+/// A gzip encoder compressing blocks of the input in parallel on all the available cores.
+///
+/// The output is a single gzip member, readable by any gzip decoder.
+pub struct ParallelGzEncoder<W: Write> {
+    inner: W,
+    level: Compression,
+    block_size: usize,
+    threads: usize,
+    pending: Vec<u8>,
+    crc: crc32fast::Hasher,
+    size: u64,
+    header_written: bool,
+}
+
+impl<W: Write> ParallelGzEncoder<W> {
+    pub fn new(inner: W, level: Compression) -> Self {
+        let threads = thread::available_parallelism()
+            .map(|threads| threads.get())
+            .unwrap_or(1);
+        Self::with_block_size(inner, level, BLOCK_SIZE, threads)
+    }
+
+    fn with_block_size(inner: W, level: Compression, block_size: usize, threads: usize) -> Self {
+        debug!(
+            "Compressing with {} threads, {} bytes blocks",
+            threads, block_size
+        );
+        Self {
+            inner,
+            level,
+            block_size,
+            threads,
+            pending: Vec::with_capacity(block_size * threads),
+            crc: crc32fast::Hasher::new(),
+            size: 0,
+            header_written: false,
+        }
+    }
+
+    /// Compress and write the pending data, the last block ending the deflate stream if `finish`
+    fn compress_pending(&mut self, finish: bool) -> io::Result<()> {
+        if !self.header_written {
+            self.inner.write_all(&GZIP_HEADER)?;
+            self.header_written = true;
+        }
+
+        let level = self.level;
+        let blocks = if self.pending.is_empty() {
+            // the deflate stream still has to be ended with a final block
+            vec![&self.pending[..]]
+        } else {
+            self.pending.chunks(self.block_size).collect_vec()
+        };
+        let last_block_index = blocks.len() - 1;
+        let compressed_blocks = thread::scope(|scope| {
+            blocks
+                .into_iter()
+                .enumerate()
+                .map(|(i, block)| {
+                    scope
+                        .spawn(move || deflate_block(block, level, finish && i == last_block_index))
+                })
+                .collect_vec()
+                .into_iter()
+                .map(|handle| handle.join().expect("compression thread panicked"))
+                .collect::<io::Result<Vec<_>>>()
+        })?;
+        for compressed_block in compressed_blocks {
+            self.inner.write_all(&compressed_block.data)?;
+            self.crc.combine(&compressed_block.crc);
+        }
+        self.size += self.pending.len() as u64;
+        self.pending.clear();
+        Ok(())
+    }
+
+    /// Write the last blocks and the gzip trailer, and return the underlying writer
+    pub fn finish(mut self) -> io::Result<W> {
+        self.compress_pending(true)?;
+        // the gzip trailer stores the size of the uncompressed data modulo 2^32
+        let size = self.size as u32;
+        self.inner
+            .write_all(&self.crc.clone().finalize().to_le_bytes())?;
+        self.inner.write_all(&size.to_le_bytes())?;
+        self.inner.flush()?;
+        Ok(self.inner)
+    }
+}
+
+impl<W: Write> Write for ParallelGzEncoder<W> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let batch_size = self.block_size * self.threads;
+        let written = buf.len().min(batch_size - self.pending.len());
+        self.pending.extend_from_slice(&buf[..written]);
+        if self.pending.len() == batch_size {
+            self.compress_pending(false)?;
+        }
+        Ok(written)
+    }
+
+    /// Only flushes the underlying writer, pending data is compressed once a whole batch of
+    /// blocks is available or when finishing the stream
+    fn flush(&mut self) -> io::Result<()> {
+        self.inner.flush()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use flate2::read::GzDecoder;
+    use std::io::Read;
+
+    fn decode(archive: &[u8]) -> Vec<u8> {
+        let mut decoded = vec![];
+        GzDecoder::new(archive).read_to_end(&mut decoded).unwrap();
+        decoded
+    }
+
+    #[test]
+    fn test_parallel_gzip_roundtrip() {
+        let data = (0..100_000u32)
+            .map(|i| format!("fn={} {}\n", i % 97, i))
+            .collect::<String>()
+            .into_bytes();
+        let mut encoder =
+            ParallelGzEncoder::with_block_size(Vec::new(), Compression::default(), 4096, 3);
+        for chunk in data.chunks(1000) {
+            encoder.write_all(chunk).unwrap();
+        }
+        let archive = encoder.finish().unwrap();
+
+        assert!(archive.len() < data.len());
+        assert_eq!(decode(&archive), data);
+    }
+
+    #[test]
+    fn test_parallel_gzip_empty() {
+        let archive = ParallelGzEncoder::new(Vec::new(), Compression::default())
+            .finish()
+            .unwrap();
+        assert!(decode(&archive).is_empty());
+    }
+}
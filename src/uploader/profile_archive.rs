@@ -0,0 +1,265 @@
+use super::{interfaces::ArchiveFormat, parallel_gzip::ParallelGzEncoder};
+use crate::prelude::*;
+use base64::{engine::general_purpose, Engine as _};
+use flate2::Compression;
+use std::{
+    fs::File,
+    io::{self, BufWriter, Write},
+    path::{Path, PathBuf},
+    thread,
+};
+
+/// A compressed archive of the profile folder, spooled to disk
+pub struct ProfileArchive {
+    pub path: PathBuf,
+    pub format: ArchiveFormat,
+    pub size: u64,
+    /// The md5 hash of the archive encoded in base64
+    pub hash: String,
+}
+
+#[cfg(test)]
+impl ProfileArchive {
+    /// Constructs a new `ProfileArchive` with default values for testing purposes
+    pub fn test() -> Self {
+        Self {
+            path: PathBuf::from("/tmp/profile.test.tar.gz"),
+            format: ArchiveFormat::Gzip,
+            size: 1024,
+            hash: "archive_hash".into(),
+        }
+    }
+}
+
+/// A writer computing the size and the md5 digest of the data written through it
+struct HashingWriter<W: Write> {
+    inner: W,
+    context: md5::Context,
+    size: u64,
+}
+
+impl<W: Write> HashingWriter<W> {
+    fn new(inner: W) -> Self {
+        Self {
+            inner,
+            context: md5::Context::new(),
+            size: 0,
+        }
+    }
+}
+
+impl<W: Write> Write for HashingWriter<W> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let written = self.inner.write(buf)?;
+        self.context.consume(&buf[..written]);
+        self.size += written as u64;
+        Ok(written)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.inner.flush()
+    }
+}
+
+impl ArchiveFormat {
+    fn extension(&self) -> &'static str {
+        match self {
+            ArchiveFormat::Gzip => "tar.gz",
+            ArchiveFormat::Zstd => "tar.zst",
+        }
+    }
+
+    pub fn content_type(&self) -> &'static str {
+        match self {
+            ArchiveFormat::Gzip => "application/gzip",
+            ArchiveFormat::Zstd => "application/zstd",
+        }
+    }
+
+    /// The name of the format, as serialized in the upload metadata
+    pub fn name(&self) -> &'static str {
+        match self {
+            ArchiveFormat::Gzip => "gzip",
+            ArchiveFormat::Zstd => "zstd",
+        }
+    }
+}
+
+/// The path of the archive of the profile folder, next to it on disk
+pub(super) fn get_archive_path(profile_folder: &Path, format: ArchiveFormat) -> PathBuf {
+    profile_folder.with_extension(format.extension())
+}
+
+fn append_tar_entries(
+    writer: &mut dyn Write,
+    append_entries: impl FnOnce(&mut tar::Builder<&mut dyn Write>) -> Result<()>,
+) -> Result<()> {
+    let mut tar = tar::Builder::new(writer);
+    append_entries(&mut tar)?;
+    tar.finish()?;
+    Ok(())
+}
+
+/// Write a compressed tar archive to `archive_path`, its entries being appended by
+/// `append_entries`
+pub(super) fn write_archive(
+    archive_path: &Path,
+    format: ArchiveFormat,
+    compression_level: Option<i32>,
+    append_entries: impl FnOnce(&mut tar::Builder<&mut dyn Write>) -> Result<()>,
+) -> Result<ProfileArchive> {
+    let file = File::create(archive_path).map_err(|e| {
+        anyhow!(
+            "Failed to create archive file: {}, {}",
+            archive_path.display(),
+            e
+        )
+    })?;
+    let writer = HashingWriter::new(BufWriter::new(file));
+    let mut writer = match format {
+        ArchiveFormat::Gzip => {
+            let level = compression_level
+                .map(|level| Compression::new(level as u32))
+                .unwrap_or_default();
+            let mut encoder = ParallelGzEncoder::new(writer, level);
+            append_tar_entries(&mut encoder, append_entries)?;
+            encoder.finish()?
+        }
+        ArchiveFormat::Zstd => {
+            let level = compression_level.unwrap_or(zstd::DEFAULT_COMPRESSION_LEVEL);
+            let mut encoder = zstd::Encoder::new(writer, level)?;
+            let threads = thread::available_parallelism()
+                .map(|threads| threads.get())
+                .unwrap_or(1);
+            encoder.multithread(threads as u32)?;
+            append_tar_entries(&mut encoder, append_entries)?;
+            encoder.finish()?
+        }
+    };
+    writer.flush()?;
+
+    let archive_digest = writer.context.compute();
+    Ok(ProfileArchive {
+        path: archive_path.to_path_buf(),
+        format,
+        size: writer.size,
+        hash: general_purpose::STANDARD.encode(archive_digest.0),
+    })
+}
+
+/// Create a compressed tar archive of the profile folder next to it on disk.
+///
+/// The archive is streamed through the compressor and the md5 digest, so the memory usage does
+/// not depend on the size of the profile folder.
+pub async fn create_profile_archive(
+    profile_folder: &Path,
+    format: ArchiveFormat,
+    compression_level: Option<i32>,
+) -> Result<ProfileArchive> {
+    let profile_folder = profile_folder.to_path_buf();
+    let archive_path = get_archive_path(&profile_folder, format);
+    debug!("Creating profile archive: {}", archive_path.display());
+    tokio::task::spawn_blocking(move || {
+        write_archive(&archive_path, format, compression_level, |tar| {
+            Ok(tar.append_dir_all(".", &profile_folder)?)
+        })
+    })
+    .await?
+}
+
+/// Create a compressed tar archive of a subset of the files of the profile folder, given by their
+/// path relative to the folder
+pub async fn create_partial_profile_archive(
+    profile_folder: &Path,
+    format: ArchiveFormat,
+    compression_level: Option<i32>,
+    paths: Vec<PathBuf>,
+) -> Result<ProfileArchive> {
+    let profile_folder = profile_folder.to_path_buf();
+    let archive_path = get_archive_path(&profile_folder, format);
+    debug!(
+        "Creating partial profile archive of {} files: {}",
+        paths.len(),
+        archive_path.display()
+    );
+    tokio::task::spawn_blocking(move || {
+        write_archive(&archive_path, format, compression_level, |tar| {
+            for path in &paths {
+                tar.append_path_with_name(profile_folder.join(path), path)?;
+            }
+            Ok(())
+        })
+    })
+    .await?
+}
+
+#[cfg(test)]
+pub(super) mod tests {
+    use super::*;
+    use flate2::read::GzDecoder;
+    use std::{env, fs};
+
+    pub(in crate::uploader) fn create_test_profile_folder(name: &str) -> Result<PathBuf> {
+        let profile_folder = env::temp_dir().join(name);
+        // start from an empty folder, even if a previous run failed before cleaning it up
+        if profile_folder.exists() {
+            fs::remove_dir_all(&profile_folder)?;
+        }
+        fs::create_dir_all(&profile_folder)?;
+        fs::write(
+            profile_folder.join("1234.out"),
+            "events: Ir\nfn=main\n0 42\n",
+        )?;
+        fs::write(profile_folder.join("perf-1234.map"), "1000 10 main\n")?;
+        Ok(profile_folder)
+    }
+
+    pub(in crate::uploader) fn list_entries<R: io::Read>(archive: R) -> Result<Vec<String>> {
+        let mut entries = tar::Archive::new(archive)
+            .entries()?
+            .map(|entry| Ok(entry?.path()?.to_string_lossy().into_owned()))
+            .collect::<Result<Vec<_>>>()?;
+        entries.sort();
+        Ok(entries)
+    }
+
+    #[tokio::test]
+    async fn test_create_profile_archive() -> Result<()> {
+        let profile_folder = create_test_profile_folder("codspeed_test_profile_archive.out")?;
+
+        let archive = create_profile_archive(&profile_folder, ArchiveFormat::Gzip, None).await?;
+
+        let archive_content = fs::read(&archive.path)?;
+        assert_eq!(archive.size, archive_content.len() as u64);
+        assert_eq!(
+            archive.hash,
+            general_purpose::STANDARD.encode(md5::compute(&archive_content).0)
+        );
+        assert_eq!(
+            list_entries(GzDecoder::new(archive_content.as_slice()))?,
+            ["./", "1234.out", "perf-1234.map"]
+        );
+
+        fs::remove_dir_all(&profile_folder)?;
+        fs::remove_file(&archive.path)?;
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_create_zstd_profile_archive() -> Result<()> {
+        let profile_folder = create_test_profile_folder("codspeed_test_zstd_profile_archive.out")?;
+
+        let archive =
+            create_profile_archive(&profile_folder, ArchiveFormat::Zstd, Some(19)).await?;
+
+        assert_eq!(archive.path.extension().unwrap(), "zst");
+        assert_eq!(
+            list_entries(zstd::Decoder::new(fs::File::open(&archive.path)?)?)?,
+            ["./", "1234.out", "perf-1234.map"]
+        );
+
+        fs::remove_dir_all(&profile_folder)?;
+        fs::remove_file(&archive.path)?;
+        Ok(())
+    }
+}
@@ -1,29 +1,26 @@
 use crate::{
-    ci_provider::CIProvider, config::Config, prelude::*, request_client::REQUEST_CLIENT,
+    ci_provider::CIProvider,
+    config::Config,
+    prelude::*,
+    request_client::{REQUEST_CLIENT, STREAMING_CLIENT, UPLOAD_RETRY_COUNT},
     runner::RunData,
+    telemetry,
 };
-use async_compression::tokio::write::GzipEncoder;
-use base64::{engine::general_purpose, Engine as _};
-use tokio::io::AsyncWriteExt;
-use tokio_tar::Builder;
-
-use super::interfaces::{UploadData, UploadMetadata};
-
-/// Create a tar.gz archive buffer of the profile folder and return its md5 hash encoded in base64
-async fn get_profile_archive_buffer(run_data: &RunData) -> Result<(Vec<u8>, String)> {
-    let enc = GzipEncoder::new(Vec::new());
-    let mut tar = Builder::new(enc);
-    tar.append_dir_all(".", run_data.profile_folder.clone())
-        .await?;
-    let mut gzip_encoder = tar.into_inner().await?;
-    gzip_encoder.shutdown().await?;
-
-    let archive_buffer = gzip_encoder.into_inner();
-    let archive_digest = md5::compute(archive_buffer.as_slice());
-    let archive_hash = general_purpose::STANDARD.encode(archive_digest.0);
+use futures::{stream, StreamExt, TryStreamExt};
+use reqwest::{Body, RequestBuilder, Response};
+use std::{io::SeekFrom, ops::Range, path::PathBuf, time::Duration};
+use tokio::io::{AsyncReadExt, AsyncSeekExt};
+use tokio_util::io::ReaderStream;
 
-    Ok((archive_buffer, archive_hash))
-}
+use super::{
+    archive_pipeline::ArchivePipeline,
+    content_manifest::{get_content_manifest, get_missing_paths},
+    interfaces::{
+        ArchiveFormat, CompleteMultipartUpload, CompletedPart, ContentEntry, MultipartUploadData,
+        UploadData, UploadMetadata, UploadPreflight, UploadPreflightData,
+    },
+    profile_archive::{create_partial_profile_archive, create_profile_archive, ProfileArchive},
+};
 
 async fn retrieve_upload_data(
     config: &Config,
@@ -54,33 +51,172 @@ async fn retrieve_upload_data(
     }
 }
 
-async fn upload_archive_buffer(
-    upload_data: &UploadData,
-    archive_buffer: Vec<u8>,
-    archive_hash: &String,
+/// PUT a byte range of the archive with a streamed body, reading it back from the disk.
+///
+/// Streamed requests cannot be cloned by the retry middleware, so retries are handled here by
+/// reopening the archive file for each attempt.
+async fn put_archive_range(
+    request: impl Fn() -> RequestBuilder,
+    archive: &ProfileArchive,
+    range: Range<u64>,
+) -> Result<Response> {
+    let mut attempt = 0;
+    loop {
+        let mut archive_file = tokio::fs::File::open(&archive.path).await.map_err(|e| {
+            anyhow!(
+                "Failed to open archive file: {}, {}",
+                archive.path.display(),
+                e
+            )
+        })?;
+        archive_file.seek(SeekFrom::Start(range.start)).await?;
+        let range_reader = archive_file.take(range.end - range.start);
+        let response = request()
+            .header("Content-Length", range.end - range.start)
+            .body(Body::wrap_stream(ReaderStream::new(range_reader)))
+            .send()
+            .await;
+
+        let error = match response {
+            Ok(response) if response.status().is_success() => {
+                telemetry::record_sent_bytes(range.end - range.start);
+                return Ok(response);
+            }
+            Ok(response) if response.status().is_client_error() => {
+                bail!("{} {}", response.status(), response.text().await?);
+            }
+            Ok(response) => anyhow!("{}", response.status()),
+            Err(err) => err.into(),
+        };
+        if attempt >= UPLOAD_RETRY_COUNT {
+            return Err(error);
+        }
+        attempt += 1;
+        warn!(
+            "Failed to upload profile data: {}, retrying ({}/{})",
+            error, attempt, UPLOAD_RETRY_COUNT
+        );
+        tokio::time::sleep(Duration::from_secs(2u64.pow(attempt))).await;
+    }
+}
+
+async fn upload_archive(upload_data: &UploadData, archive: &ProfileArchive) -> Result<()> {
+    put_archive_range(
+        || {
+            STREAMING_CLIENT
+                .put(upload_data.upload_url.clone())
+                .header("Content-Type", archive.format.content_type())
+                .header("Content-MD5", &archive.hash)
+        },
+        archive,
+        0..archive.size,
+    )
+    .await
+    .map_err(|e| anyhow!("Failed to upload profile data: {}", e))?;
+    Ok(())
+}
+
+/// Split the archive in consecutive byte ranges of `part_size` bytes, the last one being shorter
+fn get_part_ranges(archive_size: u64, part_size: u64) -> Vec<Range<u64>> {
+    // an empty archive is still uploaded as a single empty part
+    let parts_count = archive_size.div_ceil(part_size).max(1);
+    (0..parts_count)
+        .map(|part_index| {
+            let start = part_index * part_size;
+            start..archive_size.min(start + part_size)
+        })
+        .collect()
+}
+
+/// Upload the archive parts concurrently, each part being retried on its own, then commit the
+/// multipart upload
+async fn upload_archive_parts(
+    multipart_upload: &MultipartUploadData,
+    archive: &ProfileArchive,
+    concurrency: usize,
 ) -> Result<()> {
-    REQUEST_CLIENT
-        .put(upload_data.upload_url.clone())
-        .header("Content-Type", "application/gzip")
-        .header("Content-Length", archive_buffer.len())
-        .header("Content-MD5", archive_hash)
-        .body(archive_buffer)
+    ensure!(
+        multipart_upload.part_size > 0,
+        "Invalid multipart upload part size: 0"
+    );
+    let part_ranges = get_part_ranges(archive.size, multipart_upload.part_size);
+    if part_ranges.len() > multipart_upload.part_upload_urls.len() {
+        bail!(
+            "Not enough multipart upload URLs: {} parts to upload, {} URLs received",
+            part_ranges.len(),
+            multipart_upload.part_upload_urls.len()
+        );
+    }
+    debug!(
+        "Uploading {} parts of {} bytes, {} at a time",
+        part_ranges.len(),
+        multipart_upload.part_size,
+        concurrency
+    );
+
+    let mut completed_parts = stream::iter(
+        part_ranges
+            .into_iter()
+            .zip(multipart_upload.part_upload_urls.iter())
+            .enumerate(),
+    )
+    .map(|(part_index, (range, part_upload_url))| async move {
+        let part_number = part_index as u32 + 1;
+        let response = put_archive_range(
+            || STREAMING_CLIENT.put(part_upload_url.clone()),
+            archive,
+            range,
+        )
+        .await
+        .map_err(|e| anyhow!("Failed to upload profile data part {}: {}", part_number, e))?;
+        let etag = response
+            .headers()
+            .get("ETag")
+            .and_then(|etag| etag.to_str().ok())
+            .ok_or_else(|| anyhow!("Missing ETag for profile data part {}", part_number))?;
+        trace!("Uploaded profile data part {}", part_number);
+        Ok::<_, Error>(CompletedPart {
+            part_number,
+            etag: etag.to_string(),
+        })
+    })
+    .buffer_unordered(concurrency)
+    .try_collect::<Vec<_>>()
+    .await?;
+    completed_parts.sort_by_key(|part| part.part_number);
+
+    let response = REQUEST_CLIENT
+        .post(multipart_upload.complete_url.clone())
+        .json(&CompleteMultipartUpload {
+            parts: completed_parts,
+        })
         .send()
         .await?;
+    if !response.status().is_success() {
+        bail!(
+            "Failed to complete the multipart upload: {} {}",
+            response.status(),
+            response.text().await?
+        );
+    }
 
     Ok(())
 }
 
-pub async fn upload(
+/// Send the upload metadata of the archive and retrieve the upload data
+async fn prepare_upload(
     config: &Config,
-    provider: Box<dyn CIProvider>,
+    provider: &dyn CIProvider,
     run_data: &RunData,
-) -> Result<()> {
-    let (archive_buffer, archive_hash) = get_profile_archive_buffer(run_data).await?;
-
-    debug!("CI provider detected: {:#?}", provider.get_provider_name());
-
-    let upload_metadata = provider.get_upload_metadata(config, &archive_hash)?;
+    archive: &ProfileArchive,
+    content_manifest: &[ContentEntry],
+) -> Result<UploadData> {
+    let mut upload_metadata = provider.get_upload_metadata(config, archive)?;
+    upload_metadata.skipped_bench_commands = run_data.skipped_bench_commands.clone();
+    upload_metadata.content_manifest = content_manifest.to_vec();
+    if config.runner_telemetry {
+        upload_metadata.runner_telemetry = telemetry::get_phases();
+    }
     debug!("Upload metadata: {:#?}", upload_metadata);
     if upload_metadata.tokenless {
         let hash = upload_metadata.get_hash();
@@ -88,75 +224,521 @@ pub async fn upload(
     }
 
     info!("Preparing upload...");
+    let _phase = telemetry::phase("Send the upload metadata");
     let upload_data = retrieve_upload_data(config, &upload_metadata).await?;
     debug!("runId: {}", upload_data.run_id);
+    Ok(upload_data)
+}
+
+/// Send the pre-flight request of the upload, answered without registering a run
+async fn retrieve_preflight_data(
+    config: &Config,
+    preflight: &UploadPreflight,
+) -> Result<UploadPreflightData> {
+    let mut preflight_url = config.upload_url.clone();
+    preflight_url
+        .path_segments_mut()
+        .map_err(|_| anyhow!("Invalid upload URL: {}", config.upload_url))?
+        .push("preflight");
+    let mut preflight_request = REQUEST_CLIENT.post(preflight_url).json(preflight);
+    if let Some(token) = &config.token {
+        preflight_request = preflight_request.header("Authorization", token.clone());
+    }
+
+    let response = preflight_request.send().await?;
+    if !response.status().is_success() {
+        bail!(
+            "Failed to retrieve preflight data: {} {}",
+            response.status(),
+            response.text().await?
+        );
+    }
+    Ok(response.json().await?)
+}
+
+fn is_archive_format_accepted(preflight_data: &UploadPreflightData, format: ArchiveFormat) -> bool {
+    format == ArchiveFormat::Gzip
+        || preflight_data
+            .accepted_archive_formats
+            .iter()
+            .any(|accepted_format| accepted_format == format.name())
+}
+
+/// The archive to upload, as negotiated with the upload endpoint before it is built
+struct NegotiatedUpload {
+    archive_format: ArchiveFormat,
+    /// The hashes of the content manifest not known by the backend, when the upload is
+    /// deduplicated
+    missing_content_hashes: Option<Vec<String>>,
+}
+
+/// Negotiate the archive with the upload endpoint: the requested format when it is accepted,
+/// else gzip, and the content missing from the backend. The whole folder is archived in gzip
+/// when the endpoint cannot be asked.
+async fn negotiate_upload(config: &Config, content_manifest: &[ContentEntry]) -> NegotiatedUpload {
+    let mut negotiated_upload = NegotiatedUpload {
+        archive_format: ArchiveFormat::Gzip,
+        missing_content_hashes: None,
+    };
+    if config.archive_format == ArchiveFormat::Gzip && content_manifest.is_empty() {
+        return negotiated_upload;
+    }
+    let preflight = UploadPreflight {
+        archive_format: config.archive_format,
+        content_manifest: content_manifest.to_vec(),
+    };
+    match retrieve_preflight_data(config, &preflight).await {
+        Ok(preflight_data) => {
+            if is_archive_format_accepted(&preflight_data, config.archive_format) {
+                negotiated_upload.archive_format = config.archive_format;
+            } else {
+                warn!(
+                    "The upload endpoint does not accept {} archives, falling back to gzip",
+                    config.archive_format.name()
+                );
+            }
+            negotiated_upload.missing_content_hashes = preflight_data.missing_content_hashes;
+        }
+        Err(e) => warn!(
+            "Failed to negotiate the upload: {}, uploading the whole profile folder in gzip",
+            e
+        ),
+    }
+    negotiated_upload
+}
+
+fn remove_archive(archive: &ProfileArchive) {
+    if let Err(e) = std::fs::remove_file(&archive.path) {
+        warn!(
+            "Failed to remove archive: {}, {}",
+            archive.path.display(),
+            e
+        );
+    }
+}
+
+/// Returns the archive of the profile folder in `format`, or of the `partial_paths` only, the
+/// archive of the pipeline being used when it was built in this format for the whole folder
+async fn build_archive(
+    config: &Config,
+    run_data: &RunData,
+    archive_pipeline: Option<ArchivePipeline>,
+    format: ArchiveFormat,
+    partial_paths: Option<Vec<PathBuf>>,
+) -> Result<ProfileArchive> {
+    let _phase = telemetry::phase("Build the archive");
+    if let Some(archive_pipeline) = archive_pipeline {
+        let archive = archive_pipeline.finish().await?;
+        if archive.format == format && partial_paths.is_none() {
+            return Ok(archive);
+        }
+        remove_archive(&archive);
+    }
+    // the compression level is validated against the requested format, so it is not reused
+    let compression_level = if format == config.archive_format {
+        config.archive_compression_level
+    } else {
+        None
+    };
+    match partial_paths {
+        Some(partial_paths) => {
+            create_partial_profile_archive(
+                &run_data.profile_folder,
+                format,
+                compression_level,
+                partial_paths,
+            )
+            .await
+        }
+        None => create_profile_archive(&run_data.profile_folder, format, compression_level).await,
+    }
+}
+
+pub async fn upload(
+    config: &Config,
+    provider: Box<dyn CIProvider>,
+    run_data: &RunData,
+    archive_pipeline: Option<ArchivePipeline>,
+) -> Result<()> {
+    debug!("CI provider detected: {:#?}", provider.get_provider_name());
+
+    let content_manifest = if config.deduplicated_upload {
+        get_content_manifest(&run_data.profile_folder).await?
+    } else {
+        vec![]
+    };
+    // negotiated before the upload metadata is sent, since each one registers a run
+    let negotiated_upload = negotiate_upload(config, &content_manifest).await;
+    let partial_paths = negotiated_upload
+        .missing_content_hashes
+        .map(|missing_content_hashes| get_missing_paths(&content_manifest, &missing_content_hashes))
+        .filter(|missing_paths| missing_paths.len() < content_manifest.len());
+    if let Some(missing_paths) = &partial_paths {
+        info!(
+            "{} of the {} profile files are already known, uploading the {} others",
+            content_manifest.len() - missing_paths.len(),
+            content_manifest.len(),
+            missing_paths.len()
+        );
+    }
+    let archive = build_archive(
+        config,
+        run_data,
+        archive_pipeline,
+        negotiated_upload.archive_format,
+        partial_paths,
+    )
+    .await?;
+    // the backend restores the files of the content manifest missing from the archive from their
+    // hash
+    let upload_data = prepare_upload(
+        config,
+        provider.as_ref(),
+        run_data,
+        &archive,
+        &content_manifest,
+    )
+    .await?;
 
     info!("Uploading profile data...");
-    debug!("Uploading {} bytes...", archive_buffer.len());
-    upload_archive_buffer(&upload_data, archive_buffer, &archive_hash).await?;
+    debug!("Uploading {} bytes...", archive.size);
+    let _phase = telemetry::phase("Upload the archive");
+    match &upload_data.multipart_upload {
+        Some(multipart_upload) => {
+            upload_archive_parts(multipart_upload, &archive, config.upload_concurrency).await?
+        }
+        None => upload_archive(&upload_data, &archive).await?,
+    }
     info!("Results uploaded.");
+    remove_archive(&archive);
 
     Ok(())
 }
 
 #[cfg(test)]
 mod tests {
+    use flate2::read::GzDecoder;
+    use serde_json::json;
     use temp_env::async_with_vars;
-    use url::Url;
 
     use super::*;
-    use crate::runner::RunData;
-    use std::path::PathBuf;
+    use crate::runner::{download_file, harvest_perf_maps_from, RunData};
+    use crate::uploader::{
+        mock_server::MockUploadServer,
+        profile_archive::{
+            get_archive_path,
+            tests::{create_test_profile_folder, list_entries},
+        },
+    };
+    use std::{
+        fs,
+        io::{BufWriter, Write},
+        path::PathBuf,
+    };
+
+    #[test]
+    fn test_is_archive_format_accepted() {
+        let mut preflight_data = UploadPreflightData {
+            accepted_archive_formats: vec![],
+            missing_content_hashes: None,
+        };
+        assert!(is_archive_format_accepted(
+            &preflight_data,
+            ArchiveFormat::Gzip
+        ));
+        assert!(!is_archive_format_accepted(
+            &preflight_data,
+            ArchiveFormat::Zstd
+        ));
+
+        preflight_data.accepted_archive_formats = vec!["zstd".into()];
+        assert!(is_archive_format_accepted(
+            &preflight_data,
+            ArchiveFormat::Zstd
+        ));
+    }
+
+    #[test]
+    fn test_get_part_ranges() {
+        assert_eq!(get_part_ranges(10, 4), vec![0..4, 4..8, 8..10]);
+        assert_eq!(get_part_ranges(8, 4), vec![0..4, 4..8]);
+        assert_eq!(get_part_ranges(3, 4), vec![0..3]);
+        assert_eq!(get_part_ranges(0, 4), vec![0..0]);
+    }
+
+    const GITHUB_PUSH_ENV: [(&str, Option<&str>); 10] = [
+        ("GITHUB_ACTIONS", Some("true")),
+        ("GITHUB_ACTOR_ID", Some("19605940")),
+        ("GITHUB_ACTOR", Some("adriencaccia")),
+        ("GITHUB_EVENT_NAME", Some("push")),
+        ("GITHUB_JOB", Some("log-env")),
+        ("GITHUB_REF", Some("refs/heads/main")),
+        ("GITHUB_REPOSITORY", Some("my-org/adrien-python-test")),
+        ("GITHUB_RUN_ID", Some("6957110437")),
+        (
+            "GITHUB_SHA",
+            Some("5bd77cb0da72bef094893ed45fb793ff16ecfbe3"),
+        ),
+        ("VERSION", Some("0.1.0")),
+    ];
+
+    async fn upload_to_mock_server(
+        config: Config,
+        profile_folder: PathBuf,
+        server: &MockUploadServer,
+    ) -> Result<()> {
+        let config = Config {
+            upload_url: server.upload_url.clone(),
+            token: Some("token".into()),
+            ..config
+        };
+        let run_data = RunData {
+            profile_folder,
+            skipped_bench_commands: vec![],
+        };
+        async_with_vars(GITHUB_PUSH_ENV, async {
+            let provider = crate::ci_provider::get_provider(&config)?;
+            upload(&config, provider, &run_data, None).await
+        })
+        .await
+    }
 
-    // TODO: remove the ignore when implementing network mocking
-    #[ignore]
     #[tokio::test]
-    async fn test_upload() {
+    async fn test_upload() -> Result<()> {
+        let profile_folder = create_test_profile_folder("codspeed_test_upload.out")?;
+        let server = MockUploadServer::start(json!({})).await?;
+
+        upload_to_mock_server(Config::test(), profile_folder.clone(), &server).await?;
+
+        let requests = server.requests();
+        let methods = requests
+            .iter()
+            .map(|request| (request.method.as_str(), request.path.as_str()))
+            .collect_vec();
+        assert_eq!(methods, [("POST", "/upload"), ("PUT", "/archive")]);
+        let upload_metadata: UploadMetadata = serde_json::from_slice(&requests[0].body)?;
+        assert_eq!(requests[0].headers["authorization"], "token");
+        assert_eq!(requests[1].body_size, upload_metadata.archive_size);
+        assert_eq!(requests[1].body_md5, upload_metadata.profile_md5);
+        assert_eq!(
+            requests[1].headers["content-md5"],
+            upload_metadata.profile_md5
+        );
+
+        fs::remove_dir_all(&profile_folder)?;
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_archive_format_fallback() -> Result<()> {
+        let profile_folder = create_test_profile_folder("codspeed_test_fallback_upload.out")?;
+        let server = MockUploadServer::start(json!({})).await?;
         let config = Config {
-            command: "pytest tests/ --codspeed".into(),
-            upload_url: Url::parse("change me").unwrap(),
-            token: Some("change me".into()),
+            archive_format: ArchiveFormat::Zstd,
             ..Config::test()
         };
-        let run_data = RunData {
-            profile_folder: PathBuf::from(format!(
-                "{}/src/uploader/samples/adrien-python-test",
-                env!("CARGO_MANIFEST_DIR")
-            )),
+
+        upload_to_mock_server(config, profile_folder.clone(), &server).await?;
+
+        let requests = server.requests();
+        let methods = requests
+            .iter()
+            .map(|request| (request.method.as_str(), request.path.as_str()))
+            .collect_vec();
+        // a single run is registered, for the gzip archive
+        assert_eq!(
+            methods,
+            [
+                ("POST", "/upload/preflight"),
+                ("POST", "/upload"),
+                ("PUT", "/archive")
+            ]
+        );
+        let upload_metadata: UploadMetadata = serde_json::from_slice(&requests[1].body)?;
+        assert_eq!(upload_metadata.archive_format, ArchiveFormat::Gzip);
+        for format in [ArchiveFormat::Gzip, ArchiveFormat::Zstd] {
+            assert!(!get_archive_path(&profile_folder, format).exists());
+        }
+
+        fs::remove_dir_all(&profile_folder)?;
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_deduplicated_upload() -> Result<()> {
+        let profile_folder = create_test_profile_folder("codspeed_test_deduplicated_upload.out")?;
+        let content_manifest = get_content_manifest(&profile_folder).await?;
+        // the backend already knows the perf map
+        let server = MockUploadServer::start(json!({
+            "missingContentHashes": [content_manifest[0].sha256],
+        }))
+        .await?;
+        let config = Config {
+            deduplicated_upload: true,
+            ..Config::test()
         };
-        async_with_vars(
+
+        upload_to_mock_server(config, profile_folder.clone(), &server).await?;
+
+        let requests = server.requests();
+        let methods = requests
+            .iter()
+            .map(|request| (request.method.as_str(), request.path.as_str()))
+            .collect_vec();
+        // a single run is registered, for the partial archive only
+        assert_eq!(
+            methods,
             [
-                ("GITHUB_ACTIONS", Some("true")),
-                ("GITHUB_ACTOR_ID", Some("19605940")),
-                ("GITHUB_ACTOR", Some("adriencaccia")),
-                ("GITHUB_BASE_REF", Some("main")),
-                ("GITHUB_EVENT_NAME", Some("pull_request")),
-                (
-                    "GITHUB_EVENT_PATH",
-                    Some(
-                        format!(
-                            "{}/src/uploader/samples/pr-event.json",
-                            env!("CARGO_MANIFEST_DIR")
-                        )
-                        .as_str(),
-                    ),
-                ),
-                ("GITHUB_HEAD_REF", Some("feat/codspeed-runner")),
-                ("GITHUB_JOB", Some("log-env")),
-                ("GITHUB_REF", Some("refs/pull/22/merge")),
-                ("GITHUB_REPOSITORY", Some("my-org/adrien-python-test")),
-                ("GITHUB_RUN_ID", Some("6957110437")),
-                (
-                    "GITHUB_SHA",
-                    Some("5bd77cb0da72bef094893ed45fb793ff16ecfbe3"),
-                ),
-                ("VERSION", Some("0.1.0")),
-            ],
-            async {
-                let provider = crate::ci_provider::get_provider(&config).unwrap();
-                upload(&config, provider, &run_data).await.unwrap();
-            },
-        )
-        .await;
+                ("POST", "/upload/preflight"),
+                ("POST", "/upload"),
+                ("PUT", "/archive")
+            ]
+        );
+        let preflight: UploadPreflight = serde_json::from_slice(&requests[0].body)?;
+        assert_eq!(preflight.content_manifest, content_manifest);
+        let upload_metadata: UploadMetadata = serde_json::from_slice(&requests[1].body)?;
+        assert_eq!(upload_metadata.content_manifest, content_manifest);
+        assert_eq!(requests[2].body_md5, upload_metadata.profile_md5);
+        assert_eq!(
+            list_entries(GzDecoder::new(requests[2].body.as_slice()))?,
+            [content_manifest[0].path.as_str()]
+        );
+
+        fs::remove_dir_all(&profile_folder)?;
+        Ok(())
+    }
+
+    /// Create a profile folder of `file_count` callgrind-like profiles of `total_size` bytes
+    fn create_synthetic_profile_folder(
+        name: &str,
+        total_size: u64,
+        file_count: u64,
+    ) -> Result<PathBuf> {
+        let profile_folder = std::env::temp_dir().join(name);
+        if profile_folder.exists() {
+            fs::remove_dir_all(&profile_folder)?;
+        }
+        fs::create_dir_all(&profile_folder)?;
+        let file_size = total_size / file_count;
+        let mut seed: u64 = 42;
+        for pid in 0..file_count {
+            let mut file = BufWriter::new(fs::File::create(
+                profile_folder.join(format!("{}.out", pid)),
+            )?);
+            let mut written = file.write(b"events: Ir\n")? as u64;
+            while written < file_size {
+                seed = seed.wrapping_mul(6364136223846793005).wrapping_add(1);
+                let line = format!(
+                    "fn=function_{}\n{} {}\n",
+                    seed >> 54,
+                    (seed >> 40) & 0xfff,
+                    seed >> 44
+                );
+                file.write_all(line.as_bytes())?;
+                written += line.len() as u64;
+            }
+            file.flush()?;
+        }
+        Ok(profile_folder)
+    }
+
+    /// Reset the peak resident set size of the process to its current one
+    fn reset_peak_rss() {
+        let _ = fs::write("/proc/self/clear_refs", "5");
+    }
+
+    /// Returns the peak resident set size of the process since the last reset
+    fn get_peak_rss_mib() -> u64 {
+        fs::read_to_string("/proc/self/status")
+            .ok()
+            .and_then(|status| {
+                let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+                line.split_whitespace().nth(1)?.parse::<u64>().ok()
+            })
+            .unwrap_or_default()
+            / 1024
+    }
+
+    /// Measure the throughput and the peak memory of the archive, the upload, the harvest of the
+    /// perf maps and the download on synthetic files, with a few large profiles or many small
+    /// ones. Run with
+    /// `CODSPEED_BENCH_PROFILE_SIZES_MB=10,1000,5000 cargo test --release bench_upload -- --ignored --nocapture`
+    #[ignore]
+    #[tokio::test]
+    async fn bench_upload() -> Result<()> {
+        let sizes_mb = std::env::var("CODSPEED_BENCH_PROFILE_SIZES_MB")
+            .unwrap_or_else(|_| "10,100".into())
+            .split(',')
+            .map(|size| size.trim().parse::<u64>())
+            .collect::<Result<Vec<_>, _>>()?;
+        let server = MockUploadServer::start(json!({})).await?;
+        for size_mb in sizes_mb {
+            let size = size_mb * 1024 * 1024;
+            for (layout, file_count) in [("few large", 4), ("many small", (size / 65536).max(1))] {
+                let profile_folder =
+                    create_synthetic_profile_folder("codspeed_bench_upload.out", size, file_count)?;
+                let case = format!("{} MB, {} ({} files)", size_mb, layout, file_count);
+
+                reset_peak_rss();
+                let start = std::time::Instant::now();
+                let archive =
+                    create_profile_archive(&profile_folder, ArchiveFormat::Gzip, None).await?;
+                println!(
+                    "{}: archive {:.0} MB/s, {:.1}% compressed size, peak RSS {} MiB",
+                    case,
+                    size_mb as f64 / start.elapsed().as_secs_f64(),
+                    archive.size as f64 * 100.0 / size as f64,
+                    get_peak_rss_mib()
+                );
+                fs::remove_file(&archive.path)?;
+
+                reset_peak_rss();
+                let start = std::time::Instant::now();
+                upload_to_mock_server(Config::test(), profile_folder.clone(), &server).await?;
+                println!(
+                    "{}: archive and upload {:.0} MB/s, peak RSS {} MiB",
+                    case,
+                    size_mb as f64 / start.elapsed().as_secs_f64(),
+                    get_peak_rss_mib()
+                );
+
+                // a perf map for each profile, linked into the profile folder
+                let perf_map_dir = std::env::temp_dir().join("codspeed_bench_perf_maps");
+                let _ = fs::remove_dir_all(&perf_map_dir);
+                fs::create_dir_all(&perf_map_dir)?;
+                for pid in 0..file_count {
+                    fs::write(
+                        perf_map_dir.join(format!("perf-{}.map", pid)),
+                        format!("1000 10 jitted_{}\n", pid),
+                    )?;
+                }
+                reset_peak_rss();
+                let start = std::time::Instant::now();
+                harvest_perf_maps_from(&perf_map_dir, &profile_folder)?;
+                println!(
+                    "{}: harvest {:.0} perf maps/s, peak RSS {} MiB",
+                    case,
+                    file_count as f64 / start.elapsed().as_secs_f64(),
+                    get_peak_rss_mib()
+                );
+                fs::remove_dir_all(&perf_map_dir)?;
+                fs::remove_dir_all(&profile_folder)?;
+            }
+
+            let download_path = std::env::temp_dir().join("codspeed_bench_download");
+            let download_url = server.upload_url.join(&format!("/download/{}", size))?;
+            reset_peak_rss();
+            let start = std::time::Instant::now();
+            download_file(&download_url, &download_path, None).await?;
+            println!(
+                "{} MB: download {:.0} MB/s, peak RSS {} MiB",
+                size_mb,
+                size_mb as f64 / start.elapsed().as_secs_f64(),
+                get_peak_rss_mib()
+            );
+            ensure!(fs::metadata(&download_path)?.len() == size);
+            fs::remove_file(&download_path)?;
+        }
+        Ok(())
     }
 }
@@ -11,7 +11,11 @@ impl UploadMetadata {
 
 #[cfg(test)]
 mod tests {
-    use crate::uploader::{GhData, RunEvent, Runner, Sender, UploadMetadata};
+    use crate::config::MeasurementMode;
+    use crate::uploader::{
+        ArchiveFormat, CacheGeometry, CacheLevel, GhData, RunEvent, Runner, Sender, UploadMetadata,
+    };
+    use clap::ValueEnum;
 
     #[test]
     fn test_get_metadata_hash() {
@@ -26,6 +30,31 @@ mod tests {
             commit_hash: "ea4005444338762d85163c8e8787387e2ba97fb6".into(),
             event: RunEvent::PullRequest,
             profile_md5: "jp/k05RKuqP3ERQuIIvx4Q==".into(),
+            archive_format: ArchiveFormat::Gzip,
+            archive_size: 1024,
+            mode: MeasurementMode::Instrumentation,
+            cache_geometry: Some(CacheGeometry {
+                i1: CacheLevel {
+                    size: 32768,
+                    assoc: 8,
+                    line_size: 64,
+                },
+                d1: CacheLevel {
+                    size: 32768,
+                    assoc: 8,
+                    line_size: 64,
+                },
+                ll: CacheLevel {
+                    size: 8388608,
+                    assoc: 16,
+                    line_size: 64,
+                },
+            }),
+            shard: None,
+            skipped_bench_commands: vec![],
+            content_manifest: vec![],
+            runner_telemetry: vec![],
+            cache_simulations: vec![],
             gh_data: Some(GhData {
                 run_id: 7044765741,
                 job: "codspeed".into(),
@@ -45,7 +74,15 @@ mod tests {
         let hash = upload_metadata.get_hash();
         assert_eq!(
             hash,
-            "ca9a71d06e61517fabd2784eb690b1cb8a9736f93122d07f20abb8e5356761ca"
+            "32844270549be71fa91c852421357804d62ab57513de8d806ed6be6836af0fc2"
         )
     }
+
+    #[test]
+    fn test_measurement_mode_metadata() {
+        // the backend reads the walltime distributions and the perf counters by the mode
+        for mode in MeasurementMode::value_variants() {
+            assert_eq!(serde_json::json!(mode), mode.name());
+        }
+    }
 }